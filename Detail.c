@@ -563,18 +563,13 @@ int Detail(char *dev, struct context *c)
 			break;
 		}
 
-		if (array.raid_disks) {
-			struct mdinfo *mdi;
-
-			mdi = sysfs_read(fd, NULL, GET_CONSISTENCY_POLICY);
-			if (mdi) {
-				char *policy = map_num(consistency_policies,
-						       mdi->consistency_policy);
-				sysfs_free(mdi);
-				if (policy)
-					printf("Consistency Policy : %s\n\n",
-					       policy);
-			}
+		if (array.raid_disks && sra &&
+		    sysfs_load(sra, GET_CONSISTENCY_POLICY) == 0) {
+			char *policy = map_num(consistency_policies,
+					       sra->consistency_policy);
+			if (policy)
+				printf("Consistency Policy : %s\n\n",
+				       policy);
 		}
 
 		if (e && e->percent >= 0) {
@@ -4216,7 +4216,7 @@ static int grow_backup(struct mdinfo *sra,
 		int disks, int chunk, int level, int layout,
 		int dests, int *destfd, unsigned long long *destoffsets,
 		int part, int *degraded,
-		char *buf)
+		struct stripe_io *sio)
 {
 	/* Backup 'blocks' sectors at 'offset' on each device of the array,
 	 * to storage 'destfd' (offset 'destoffsets'), after first
@@ -4282,7 +4282,7 @@ static int grow_backup(struct mdinfo *sra,
 
 	rv = save_stripes(sources, offsets, disks, chunk, level, layout,
 			  dests, destfd, offset * 512 * odata,
-			  stripes * chunk * odata, buf);
+			  stripes * chunk * odata, NULL, sio);
 
 	if (rv)
 		return rv;
@@ -4310,9 +4310,10 @@ static int grow_backup(struct mdinfo *sra,
 			if (write(destfd[i], &bsb, 512) != 512)
 				break;
 		}
-		fsync(destfd[i]);
 		rv = 0;
 	}
+	/* Flush all the backups at once rather than one after another */
+	fsync_fds(sio, destfd, i);
 
 	return rv;
 }
@@ -4330,7 +4331,7 @@ static int grow_backup(struct mdinfo *sra,
 /* FIXME return value is often ignored */
 static int forget_backup(int dests, int *destfd,
 			 unsigned long long *destoffsets,
-			 int part)
+			 int part, struct stripe_io *sio)
 {
 	/*
 	 * Erase backup 'part' (which is 0 or 1)
@@ -4359,8 +4360,8 @@ static int forget_backup(int dests, int *destfd,
 			rv = -1;
 		if (rv == 0 && write(destfd[i], &bsb, 512) != 512)
 			rv = -1;
-		fsync(destfd[i]);
 	}
+	fsync_fds(sio, destfd, dests);
 	return rv;
 }
 
@@ -4466,7 +4467,7 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	 * 'native' mechanism - either to a backup file, or
 	 * to some space in a spare.
 	 */
-	char *buf;
+	struct stripe_io *sio;
 	int degraded = -1;
 	unsigned long long speed;
 	unsigned long long suspend_point, array_size;
@@ -4521,7 +4522,11 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	stripes = blocks / (sra->array.chunk_size/512) /
 		reshape->before.data_disks;
 
-	if (posix_memalign((void**)&buf, 4096, disks * chunk))
+	/* Everything grow_backup() needs is set up now, as it runs with
+	 * part of the array suspended where it must not allocate.
+	 */
+	sio = stripe_io_new(disks, chunk, level, layout, dests, stripes);
+	if (!sio)
 		/* Don't start the 'reshape' */
 		return 0;
 	if (reshape->before.data_disks == reshape->after.data_disks) {
@@ -4577,21 +4582,21 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 			    reshape_completed >= (__le64_to_cpu(bsb.arraystart) +
 						  __le64_to_cpu(bsb.length)))
 				forget_backup(dests, destfd,
-					      destoffsets, 0);
+					      destoffsets, 0, sio);
 			if (__le64_to_cpu(bsb.length2) > 0 &&
 			    reshape_completed >= (__le64_to_cpu(bsb.arraystart2) +
 						  __le64_to_cpu(bsb.length2)))
 				forget_backup(dests, destfd,
-					      destoffsets, 1);
+					      destoffsets, 1, sio);
 		} else {
 			if (__le64_to_cpu(bsb.length) > 0 &&
 			    reshape_completed <= (__le64_to_cpu(bsb.arraystart)))
 				forget_backup(dests, destfd,
-					      destoffsets, 0);
+					      destoffsets, 0, sio);
 			if (__le64_to_cpu(bsb.length2) > 0 &&
 			    reshape_completed <= (__le64_to_cpu(bsb.arraystart2)))
 				forget_backup(dests, destfd,
-					      destoffsets, 1);
+					      destoffsets, 1, sio);
 		}
 		if (sigterm)
 			rv = -2;
@@ -4642,7 +4647,7 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 				break;
 			grow_backup(sra, offset, actual_stripes, fds, offsets,
 				    disks, chunk, level, layout, dests, destfd,
-				    destoffsets, part, &degraded, buf);
+				    destoffsets, part, &degraded, sio);
 			validate(afd, destfd[0], destoffsets[0]);
 			/* record where 'part' is up to */
 			part = !part;
@@ -4662,7 +4667,7 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 
 	if (reshape->before.data_disks == reshape->after.data_disks)
 		sysfs_set_num(sra, NULL, "sync_speed_min", speed);
-	free(buf);
+	stripe_io_free(sio);
 	return done;
 }
 
@@ -4700,6 +4705,8 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist,
 		int bsbsize;
 		char *devname, namebuf[20];
 		unsigned long long lo, hi;
+		unsigned long long most;
+		struct stripe_io *sio;
 
 		/* This was a spare and may have some saved data on it.
 		 * Load the superblock, find and load the
@@ -4858,16 +4865,24 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist,
 		}
 		printf("%s: restoring critical section\n", Name);
 
+		/* Both parts are restored through the same batches */
+		most = __le64_to_cpu(bsb.length);
+		if (bsb.magic[15] == '2' && __le64_to_cpu(bsb.length2) > most)
+			most = __le64_to_cpu(bsb.length2);
+		sio = stripe_io_new(info->array.raid_disks, info->new_chunk,
+				    info->new_level, info->new_layout, 0,
+				    most * 512 / info->new_chunk);
 		if (restore_stripes(fdlist, offsets, info->array.raid_disks,
 				    info->new_chunk, info->new_level,
 				    info->new_layout, fd,
 				    __le64_to_cpu(bsb.devstart)*512,
 				    __le64_to_cpu(bsb.arraystart)*512,
-				    __le64_to_cpu(bsb.length)*512, NULL)) {
+				    __le64_to_cpu(bsb.length)*512, NULL, sio)) {
 			/* didn't succeed, so giveup */
 			if (verbose)
 				pr_err("Error restoring backup from %s\n",
 					devname);
+			stripe_io_free(sio);
 			free(offsets);
 			return 1;
 		}
@@ -4879,15 +4894,17 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist,
 				    __le64_to_cpu(bsb.devstart)*512 +
 				    __le64_to_cpu(bsb.devstart2)*512,
 				    __le64_to_cpu(bsb.arraystart2)*512,
-				    __le64_to_cpu(bsb.length2)*512, NULL)) {
+				    __le64_to_cpu(bsb.length2)*512, NULL, sio)) {
 			/* didn't succeed, so giveup */
 			if (verbose)
 				pr_err("Error restoring second backup from %s\n",
 					devname);
+			stripe_io_free(sio);
 			free(offsets);
 			return 1;
 		}
 
+		stripe_io_free(sio);
 		free(offsets);
 
 		/* Ok, so the data is restored. Let's update those superblocks. */
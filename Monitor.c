@@ -26,9 +26,26 @@
 #include	"md_p.h"
 #include	"md_u.h"
 #include	<sys/wait.h>
+#include	<poll.h>
 #include	<signal.h>
 #include	<limits.h>
 #include	<syslog.h>
+#ifdef USE_PTHREADS
+#include	<pthread.h>
+#endif
+
+/* An open sysfs attribute of an array, or of one of its members */
+struct watch_fd {
+	int fd;
+	char *attr;
+	char member[32];	/* sys_name, or "" for the array */
+};
+
+enum {
+	M_DISKS, M_DEGRADED, M_SYNC_ACTION, M_SYNC_COMPLETED, M_SYNC_SPEED,
+	M_MISMATCH, M_MEMBER_STATE, M_MEMBER_ERRORS, M_MEMBER_BAD_BLOCKS,
+	NR_METRICS
+};
 
 struct state {
 	char *devname;
@@ -43,6 +60,11 @@ struct state {
 	int devstate[MAX_DISKS];
 	dev_t devid[MAX_DISKS];
 	int percent;
+	struct watch_fd *evfd;	/* sysfs attributes which announce changes */
+	int nevfd, evsize;
+	int fired;	/* one of evfd[] changed: skip no shortcuts */
+	char *metrics[NR_METRICS]; /* this array's lines of each metric */
+	int metrics_fresh;	/* nothing changed since they were read */
 	char parent_devnm[32]; /* For subarray, devnm of parent.
 				* For others, ""
 				*/
@@ -52,32 +74,127 @@ struct state {
 				* in the same container */
 	struct state *parent;  /* for a subarray it is a link to its container
 				*/
+	struct state *next_donor; /* same spare_group, in try_spare_migration */
 	struct state *next;
 };
 
+/*
+ * Open-addressed table of items keyed by a name such as a devnm.
+ * They are rebuilt whenever the list they index may have changed,
+ * which is cheaper than keeping them in step, and the key is
+ * compared as it is at lookup time, so clearing an mdstat_ent's
+ * devnm to mark it "used" also hides it here.
+ */
+struct name_index {
+	struct name_slot {
+		char *name;
+		void *item;
+	} *slots;
+	unsigned int size;
+};
+
 struct alert_info {
 	char *mailaddr;
 	char *mailfrom;
 	char *alert_cmd;
 	int dosyslog;
 };
+/*
+ * Alerts are queued and delivered by a worker thread, so that a burst
+ * of them, such as a controller taking many members with it, doesn't
+ * delay noticing the next change.  The worker lets ALERT_WINDOW
+ * seconds pass after the first alert of a burst, during which
+ * repeats of a pending alert are dropped, a RebuildNN replaces any
+ * pending RebuildNN for the same array, and everything worth a mail
+ * is collected into one.  Without pthreads, alerts go out at once.
+ */
+#define ALERT_WINDOW 1
+
+struct alert_ent {
+	struct alert_ent *next;
+	char *event, *dev, *disc;
+};
+
+static struct alert_queue {
+	struct alert_ent *head, **tail;
+	struct alert_info *info;
+#ifdef USE_PTHREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running, stop;
+#endif
+} alerts = {
+	.tail = &alerts.head,
+#ifdef USE_PTHREADS
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+#endif
+};
+
+/*
+ * With --metrics, the state of every array is written in the
+ * Prometheus text format to a file, which is replaced atomically after
+ * every pass and at least every METRICS_INTERVAL seconds.  Each
+ * array's lines are kept in its state and only re-read from sysfs
+ * when check_array() found something changed, or once an interval
+ * for counters that change without announcing it.
+ */
+#define METRICS_INTERVAL 60
+
+struct alert_count {
+	struct alert_count *next;
+	char *dev, *event;
+	unsigned long count;
+};
+static struct alert_count *alert_counts[256];
+
+/*
+ * SIGTERM and SIGINT end the monitor loop, so that queued alerts are
+ * still delivered.  The handler writes to a pipe which
+ * wait_for_events() polls, whichever thread the signal lands on.
+ */
+static volatile sig_atomic_t monitor_stop;
+static int stop_pipe[2] = { -1, -1 };
+
+static void monitor_term(int sig)
+{
+	int err = errno;
+
+	monitor_stop = 1;
+	if (stop_pipe[1] >= 0 && write(stop_pipe[1], "", 1) < 0) {
+		/* the pipe is full, so the loop is woken already */
+	}
+	errno = err;
+}
+
 static int make_daemon(char *pidfile);
 static int check_one_sharer(int scan);
+static void unwatch_array(struct state *st);
+static void wait_for_events(struct state *statelist, int delay,
+			    int max_wait, int mdstat_held);
+static void write_metrics(char *file, struct state *statelist);
+static void free_metrics(struct state *st);
 static void alert(char *event, char *dev, char *disc, struct alert_info *info);
-static int check_array(struct state *st, struct mdstat_ent *mdstat,
+static void flush_alerts(void);
+static int check_array(struct state *st, struct name_index *mdstat_ix,
 		       int test, struct alert_info *info,
 		       int increments, char *prefer);
 static int add_new_arrays(struct mdstat_ent *mdstat, struct state **statelist,
 			  int test, struct alert_info *info);
 static void try_spare_migration(struct state *statelist, struct alert_info *info);
 static void link_containers_with_subarrays(struct state *list);
+static void name_index_build(struct name_index *ix, int n);
+static void name_index_add(struct name_index *ix, char *name, void *item);
+static void *name_index_find(struct name_index *ix, char *name);
+static unsigned int name_hash(char *name);
 
 int Monitor(struct mddev_dev *devlist,
 	    char *mailaddr, char *alert_cmd,
 	    struct context *c,
 	    int daemonise, int oneshot,
 	    int dosyslog, char *pidfile, int increments,
-	    int share)
+	    int share, char *metrics)
 {
 	/*
 	 * Every few seconds, scan every md device looking for changes
@@ -124,7 +241,9 @@ int Monitor(struct mddev_dev *devlist,
 	struct state *statelist = NULL;
 	struct state *st2;
 	int finished = 0;
-	struct mdstat_ent *mdstat = NULL;
+	struct mdstat_snapshot snap;
+	struct mdstat_ent *mdstat, *mse;
+	struct name_index mdstat_ix;
 	char *mailfrom;
 	struct alert_info info;
 	struct mddev_ident *mdlist;
@@ -143,7 +262,7 @@ int Monitor(struct mddev_dev *devlist,
 			pr_err("Monitor using program \"%s\" from config file\n",
 			       alert_cmd);
 	}
-	if (c->scan && !mailaddr && !alert_cmd && !dosyslog) {
+	if (c->scan && !mailaddr && !alert_cmd && !dosyslog && !metrics) {
 		pr_err("No mail address or alert command - not monitoring.\n");
 		return 1;
 	}
@@ -162,6 +281,22 @@ int Monitor(struct mddev_dev *devlist,
 		if (check_one_sharer(c->scan))
 			return 1;
 
+	if (!oneshot && pipe(stop_pipe) == 0) {
+		struct sigaction act;
+
+		fcntl(stop_pipe[0], F_SETFD, FD_CLOEXEC);
+		fcntl(stop_pipe[1], F_SETFD, FD_CLOEXEC);
+		fcntl(stop_pipe[1], F_SETFL, O_NONBLOCK);
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = monitor_term;
+		sigemptyset(&act.sa_mask);
+		sigaction(SIGTERM, &act, NULL);
+		sigaction(SIGINT, &act, NULL);
+	}
+
+	memset(&snap, 0, sizeof(snap));
+	memset(&mdstat_ix, 0, sizeof(mdstat_ix));
+
 	if (devlist == NULL) {
 		mdlist = conf_get_ident(NULL);
 		for (; mdlist; mdlist = mdlist->next) {
@@ -208,19 +343,35 @@ int Monitor(struct mddev_dev *devlist,
 		}
 	}
 
-	while (!finished) {
+	while (!finished && !monitor_stop) {
 		int new_found = 0;
 		struct state *st, **stp;
 		int anydegraded = 0;
+		int i, nfds, ndirs;
 
-		if (mdstat)
-			free_mdstat(mdstat);
-		mdstat = mdstat_read(oneshot ? 0 : 1, 0);
+		mdstat_snapshot_read(&snap, oneshot ? 0 : 1);
+		mdstat = snap.ents;
 		if (!mdstat)
 			mdstat_close();
 
+		/* Each array keeps 3 + members sysfs attributes open,
+		 * and the sysfs cache its directory and one per member.
+		 */
+		i = 0;
+		nfds = ndirs = 0;
+		for (mse = mdstat; mse; mse = mse->next) {
+			i++;
+			nfds += 3 + mse->devcnt;
+			ndirs += 1 + mse->devcnt;
+		}
+		sysfs_cache_size(ndirs);
+		enable_fds(nfds + ndirs);
+		name_index_build(&mdstat_ix, i);
+		for (mse = mdstat; mse; mse = mse->next)
+			name_index_add(&mdstat_ix, mse->devnm, mse);
+
 		for (st = statelist; st; st = st->next)
-			if (check_array(st, mdstat, c->test, &info,
+			if (check_array(st, &mdstat_ix, c->test, &info,
 					increments, c->prefer))
 				anydegraded = 1;
 
@@ -235,17 +386,23 @@ int Monitor(struct mddev_dev *devlist,
 		 */
 		if (share && anydegraded)
 			try_spare_migration(statelist, &info);
+		if (metrics)
+			write_metrics(metrics, statelist);
 		if (!new_found) {
 			if (oneshot)
 				break;
 			else
-				mdstat_wait(c->delay);
+				wait_for_events(statelist, c->delay,
+						metrics ? METRICS_INTERVAL : 0,
+						mdstat != NULL);
 		}
 		c->test = 0;
 
 		for (stp = &statelist; (st = *stp) != NULL; ) {
 			if (st->from_auto && st->err > 5) {
 				*stp = st->next;
+				unwatch_array(st);
+				free_metrics(st);
 				free(st->devname);
 				free(st->spare_group);
 				free(st);
@@ -255,8 +412,20 @@ int Monitor(struct mddev_dev *devlist,
 	}
 	for (st2 = statelist; st2; st2 = statelist) {
 		statelist = st2->next;
+		unwatch_array(st2);
+		free_metrics(st2);
 		free(st2);
 	}
+	mdstat_snapshot_free(&snap);
+	free(mdstat_ix.slots);
+	flush_alerts();
+	if (stop_pipe[0] >= 0) {
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		close(stop_pipe[0]);
+		close(stop_pipe[1]);
+		stop_pipe[0] = stop_pipe[1] = -1;
+	}
 
 	if (pidfile)
 		unlink(pidfile);
@@ -349,112 +518,463 @@ static int check_one_sharer(int scan)
 	return 0;
 }
 
-static void alert(char *event, char *dev, char *disc, struct alert_info *info)
+static int mail_worthy(char *event)
+{
+	return strncmp(event, "Fail", 4) == 0 ||
+		strncmp(event, "Test", 4) == 0 ||
+		strncmp(event, "Spares", 6) == 0 ||
+		strncmp(event, "Degrade", 7) == 0;
+}
+
+static int is_rebuild_step(char *event)
+{
+	return strncmp(event, "Rebuild", 7) == 0 &&
+		event[7] >= '0' && event[7] <= '9';
+}
+
+static int same_str(char *a, char *b)
 {
+	if (!a || !b)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+static void run_alert_cmd(struct alert_ent *a, struct alert_info *info)
+{
+	int pid = fork();
+
+	switch(pid) {
+	default:
+		waitpid(pid, NULL, 0);
+		break;
+	case -1:
+		break;
+	case 0:
+		execl(info->alert_cmd, info->alert_cmd,
+		      a->event, a->dev, a->disc, NULL);
+		exit(2);
+	}
+}
+
+static void mail_alerts(struct alert_ent *list, struct alert_info *info)
+{
+	struct alert_ent *a, *first = NULL;
+	int cnt = 0;
+	FILE *mp;
+	FILE *mdstat;
+	char hname[256];
+
+	for (a = list; a; a = a->next)
+		if (mail_worthy(a->event)) {
+			if (!first)
+				first = a;
+			cnt++;
+		}
+	if (!cnt)
+		return;
+
+	mp = popen(Sendmail, "w");
+	if (!mp)
+		return;
+	gethostname(hname, sizeof(hname));
+	signal(SIGPIPE, SIG_IGN);
+	if (info->mailfrom)
+		fprintf(mp, "From: %s\n", info->mailfrom);
+	else
+		fprintf(mp, "From: %s monitoring <root>\n", Name);
+	fprintf(mp, "To: %s\n", info->mailaddr);
+	if (cnt == 1)
+		fprintf(mp, "Subject: %s event on %s:%s\n\n",
+			first->event, first->dev, hname);
+	else
+		fprintf(mp, "Subject: %d md events on %s\n\n", cnt, hname);
+
+	fprintf(mp,
+		"This is an automatically generated mail message from %s\n", Name);
+	fprintf(mp, "running on %s\n\n", hname);
+
+	for (a = first; a; a = a->next) {
+		if (!mail_worthy(a->event))
+			continue;
+		fprintf(mp,
+			"A %s event had been detected on md device %s.\n\n",
+			a->event, a->dev);
+
+		if (a->disc && a->disc[0] != ' ')
+			fprintf(mp,
+				"It could be related to component device %s.\n\n",
+				a->disc);
+		if (a->disc && a->disc[0] == ' ')
+			fprintf(mp, "Extra information:%s.\n\n", a->disc);
+	}
+
+	fprintf(mp, "Faithfully yours, etc.\n");
+
+	mdstat = fopen("/proc/mdstat", "r");
+	if (mdstat) {
+		char buf[8192];
+		int n;
+		fprintf(mp,
+			"\nP.S. The /proc/mdstat file currently contains the following:\n\n");
+		while ((n = fread(buf, 1, sizeof(buf), mdstat)) > 0)
+			n = fwrite(buf, 1, n, mp);
+		fclose(mdstat);
+	}
+	pclose(mp);
+}
+
+static void log_alert(struct alert_ent *a)
+{
+	char *event = a->event, *dev = a->dev, *disc = a->disc;
 	int priority;
 
+	/* Log at a different severity depending on the event.
+	 *
+	 * These are the critical events:  */
+	if (strncmp(event, "Fail", 4) == 0 ||
+	    strncmp(event, "Degrade", 7) == 0 ||
+	    strncmp(event, "DeviceDisappeared", 17) == 0)
+		priority = LOG_CRIT;
+	/* Good to know about, but are not failures: */
+	else if (strncmp(event, "Rebuild", 7) == 0 ||
+		 strncmp(event, "MoveSpare", 9) == 0 ||
+		 strncmp(event, "Spares", 6) != 0)
+		priority = LOG_WARNING;
+	/* Everything else: */
+	else
+		priority = LOG_INFO;
+
+	if (disc && disc[0] != ' ')
+		syslog(priority,
+		       "%s event detected on md device %s, component device %s", event, dev, disc);
+	else if (disc)
+		syslog(priority,
+		       "%s event detected on md device %s: %s",
+		       event, dev, disc);
+	else
+		syslog(priority,
+		       "%s event detected on md device %s",
+		       event, dev);
+}
+
+/* Deliver, and free, a list of alerts in the order they were raised */
+static void deliver_alerts(struct alert_ent *list, struct alert_info *info)
+{
+	struct alert_ent *a;
+
+	for (a = list; a; a = a->next) {
+		if (info->alert_cmd)
+			run_alert_cmd(a, info);
+		/* log the event to syslog maybe */
+		if (info->dosyslog)
+			log_alert(a);
+	}
+	if (info->mailaddr)
+		mail_alerts(list, info);
+
+	while ((a = list) != NULL) {
+		list = a->next;
+		free(a->event);
+		free(a->dev);
+		free(a->disc);
+		free(a);
+	}
+}
+
+#ifdef USE_PTHREADS
+static void *alert_worker(void *arg)
+{
+	struct alert_ent *list;
+
+	pthread_mutex_lock(&alerts.lock);
+	while (1) {
+		while (!alerts.head && !alerts.stop)
+			pthread_cond_wait(&alerts.cond, &alerts.lock);
+		if (!alerts.head)
+			break;
+		if (!alerts.stop) {
+			/* Let the rest of a burst arrive */
+			struct timespec ts;
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += ALERT_WINDOW;
+			while (!alerts.stop &&
+			       pthread_cond_timedwait(&alerts.cond, &alerts.lock,
+						      &ts) != ETIMEDOUT)
+				;
+		}
+		list = alerts.head;
+		alerts.head = NULL;
+		alerts.tail = &alerts.head;
+		pthread_mutex_unlock(&alerts.lock);
+
+		deliver_alerts(list, alerts.info);
+
+		pthread_mutex_lock(&alerts.lock);
+	}
+	pthread_mutex_unlock(&alerts.lock);
+	return NULL;
+}
+#endif
+
+static void count_alert(char *event, char *dev)
+{
+	struct alert_count **acp = &alert_counts[name_hash(dev) & 255];
+	struct alert_count *ac;
+
+	for (ac = *acp; ac; ac = ac->next)
+		if (strcmp(ac->dev, dev) == 0 && strcmp(ac->event, event) == 0)
+			break;
+	if (!ac) {
+		ac = xmalloc(sizeof(*ac));
+		ac->dev = xstrdup(dev);
+		ac->event = xstrdup(event);
+		ac->count = 0;
+		ac->next = *acp;
+		*acp = ac;
+	}
+	ac->count++;
+}
+
+static void alert(char *event, char *dev, char *disc, struct alert_info *info)
+{
+	struct alert_ent *a;
+
+	count_alert(event, dev);
+
 	if (!info->alert_cmd && !info->mailaddr && !info->dosyslog) {
 		time_t now = time(0);
 
 		printf("%1.15s: %s on %s %s\n", ctime(&now) + 4,
 		       event, dev, disc?disc:"unknown device");
+		return;
 	}
-	if (info->alert_cmd) {
-		int pid = fork();
-		switch(pid) {
-		default:
-			waitpid(pid, NULL, 0);
-			break;
-		case -1:
+
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&alerts.lock);
+#endif
+	alerts.info = info;
+	for (a = alerts.head; a; a = a->next) {
+		if (strcmp(a->dev, dev) != 0)
+			continue;
+		if (is_rebuild_step(a->event) && is_rebuild_step(event)) {
+			/* Only the latest progress is interesting */
+			free(a->event);
+			a->event = xstrdup(event);
 			break;
-		case 0:
-			execl(info->alert_cmd, info->alert_cmd,
-			      event, dev, disc, NULL);
-			exit(2);
 		}
+		if (strcmp(a->event, event) == 0 && same_str(a->disc, disc))
+			break;
 	}
-	if (info->mailaddr && (strncmp(event, "Fail", 4) == 0 ||
-			       strncmp(event, "Test", 4) == 0 ||
-			       strncmp(event, "Spares", 6) == 0 ||
-			       strncmp(event, "Degrade", 7) == 0)) {
-		FILE *mp = popen(Sendmail, "w");
-		if (mp) {
-			FILE *mdstat;
-			char hname[256];
-			gethostname(hname, sizeof(hname));
-			signal(SIGPIPE, SIG_IGN);
-			if (info->mailfrom)
-				fprintf(mp, "From: %s\n", info->mailfrom);
-			else
-				fprintf(mp, "From: %s monitoring <root>\n",
-					Name);
-			fprintf(mp, "To: %s\n", info->mailaddr);
-			fprintf(mp, "Subject: %s event on %s:%s\n\n",
-				event, dev, hname);
+	if (!a) {
+		a = xmalloc(sizeof(*a));
+		a->next = NULL;
+		a->event = xstrdup(event);
+		a->dev = xstrdup(dev);
+		a->disc = disc ? xstrdup(disc) : NULL;
+		*alerts.tail = a;
+		alerts.tail = &a->next;
+	}
+#ifdef USE_PTHREADS
+	if (!alerts.running)
+		alerts.running = pthread_create(&alerts.thread, NULL,
+						alert_worker, NULL) == 0;
+	if (alerts.running) {
+		pthread_cond_signal(&alerts.cond);
+		pthread_mutex_unlock(&alerts.lock);
+		return;
+	}
+	pthread_mutex_unlock(&alerts.lock);
+#endif
+	a = alerts.head;
+	alerts.head = NULL;
+	alerts.tail = &alerts.head;
+	deliver_alerts(a, info);
+}
 
-			fprintf(mp,
-				"This is an automatically generated mail message from %s\n", Name);
-			fprintf(mp, "running on %s\n\n", hname);
+/* Wait for queued alerts to be delivered */
+static void flush_alerts(void)
+{
+#ifdef USE_PTHREADS
+	if (!alerts.running)
+		return;
+	pthread_mutex_lock(&alerts.lock);
+	alerts.stop = 1;
+	pthread_cond_signal(&alerts.cond);
+	pthread_mutex_unlock(&alerts.lock);
+	pthread_join(alerts.thread, NULL);
+	alerts.running = 0;
+	alerts.stop = 0;
+#endif
+}
 
-			fprintf(mp,
-				"A %s event had been detected on md device %s.\n\n", event, dev);
-
-			if (disc && disc[0] != ' ')
-				fprintf(mp,
-					"It could be related to component device %s.\n\n", disc);
-			if (disc && disc[0] == ' ')
-				fprintf(mp, "Extra information:%s.\n\n", disc);
-
-			fprintf(mp, "Faithfully yours, etc.\n");
-
-			mdstat = fopen("/proc/mdstat", "r");
-			if (mdstat) {
-				char buf[8192];
-				int n;
-				fprintf(mp,
-					"\nP.S. The /proc/mdstat file currently contains the following:\n\n");
-				while ((n = fread(buf, 1, sizeof(buf),
-						  mdstat)) > 0)
-					n = fwrite(buf, 1, n, mp);
-				fclose(mdstat);
+static void unwatch_array(struct state *st)
+{
+	int i;
+
+	for (i = 0; i < st->nevfd; i++)
+		close(st->evfd[i].fd);
+	free(st->evfd);
+	st->evfd = NULL;
+	st->nevfd = st->evsize = 0;
+}
+
+static void unwatch_one(struct state *st, int i)
+{
+	close(st->evfd[i].fd);
+	st->evfd[i] = st->evfd[--st->nevfd];
+}
+
+/* Returns -1 if out of fds, and then nothing of 'st' is watched */
+static int watch_one(struct state *st, char *member, char *attr)
+{
+	char buf[64];
+	int i, fd;
+
+	for (i = 0; i < st->nevfd; i++)
+		if (st->evfd[i].attr == attr &&
+		    strcmp(st->evfd[i].member, member) == 0)
+			return 0;
+
+	fd = sysfs_open(st->devnm, member[0] ? member : NULL, attr);
+	if (fd < 0) {
+		if (errno != EMFILE && errno != ENFILE)
+			return 0;
+		/* Poll this one every 'delay' instead, which leaves
+		 * fds for checking it.
+		 */
+		unwatch_array(st);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	/* sysfs only reports changes since the last read */
+	if (pread(fd, buf, sizeof(buf), 0) < 0) {
+		close(fd);
+		return 0;
+	}
+	if (st->nevfd == st->evsize) {
+		st->evsize = st->evsize ? st->evsize * 2 : 8;
+		st->evfd = xrealloc(st->evfd,
+				    st->evsize * sizeof(st->evfd[0]));
+	}
+	st->evfd[st->nevfd].fd = fd;
+	st->evfd[st->nevfd].attr = attr;
+	strcpy(st->evfd[st->nevfd].member, member);
+	st->nevfd++;
+	return 0;
+}
+
+/*
+ * Re-arm every attribute before the state is read, so that a change
+ * made while it is being read fires again.  Attributes which went
+ * away are forgotten.
+ */
+static void rearm_array(struct state *st)
+{
+	char buf[64];
+	int i = 0;
+
+	while (i < st->nevfd)
+		if (pread(st->evfd[i].fd, buf, sizeof(buf), 0) < 0)
+			unwatch_one(st, i);
+		else
+			i++;
+}
+
+/*
+ * Keep open the attributes which md calls sysfs_notify() on, so that
+ * wait_for_events() hears about changes which needn't show in
+ * /proc/mdstat, such as a member becoming 'blocked' or a 'check'
+ * being requested.  Called on each full check with the current
+ * member list: new members are opened and departed ones closed.
+ */
+static char *array_attrs[] = { "array_state", "degraded", "sync_action" };
+static char member_attr[] = "state";
+
+static void watch_array(struct state *st, struct mdinfo *sra)
+{
+	struct mdinfo *d;
+	unsigned int a;
+	int i = 0;
+
+	while (i < st->nevfd) {
+		if (st->evfd[i].member[0]) {
+			for (d = sra->devs; d; d = d->next)
+				if (strcmp(d->sys_name, st->evfd[i].member) == 0)
+					break;
+			if (!d) {
+				unwatch_one(st, i);
+				continue;
 			}
-			pclose(mp);
 		}
+		i++;
 	}
 
-	/* log the event to syslog maybe */
-	if (info->dosyslog) {
-		/* Log at a different severity depending on the event.
-		 *
-		 * These are the critical events:  */
-		if (strncmp(event, "Fail", 4) == 0 ||
-		    strncmp(event, "Degrade", 7) == 0 ||
-		    strncmp(event, "DeviceDisappeared", 17) == 0)
-			priority = LOG_CRIT;
-		/* Good to know about, but are not failures: */
-		else if (strncmp(event, "Rebuild", 7) == 0 ||
-			 strncmp(event, "MoveSpare", 9) == 0 ||
-			 strncmp(event, "Spares", 6) != 0)
-			priority = LOG_WARNING;
-		/* Everything else: */
-		else
-			priority = LOG_INFO;
-
-		if (disc && disc[0] != ' ')
-			syslog(priority,
-			       "%s event detected on md device %s, component device %s", event, dev, disc);
-		else if (disc)
-			syslog(priority,
-			       "%s event detected on md device %s: %s",
-			       event, dev, disc);
-		else
-			syslog(priority,
-			       "%s event detected on md device %s",
-			       event, dev);
+	for (a = 0; a < ARRAY_SIZE(array_attrs); a++)
+		if (watch_one(st, "", array_attrs[a]) < 0)
+			return;
+	for (d = sra->devs; d; d = d->next)
+		if (watch_one(st, d->sys_name, member_attr) < 0)
+			return;
+}
+
+/*
+ * Everything but resync progress is announced by /proc/mdstat or
+ * st->evfd, so only wake every 'delay' seconds while some array is
+ * resyncing, degraded or not properly watched.  Otherwise sleep
+ * for much longer, in case something is missed.  With no arrays, or
+ * /proc/mdstat not held open, nothing would announce a new array,
+ * so stay with 'delay' then too.
+ */
+#define IDLE_DELAY_FACTOR 10
+static void wait_for_events(struct state *statelist, int delay,
+			    int max_wait, int mdstat_held)
+{
+	/* Kept between calls, and only grown, so a wakeup doesn't
+	 * allocate for every array being watched.
+	 */
+	static struct pollfd *fds;
+	static struct state **owner;
+	static int fds_size;
+	struct state *st;
+	int n = 2, i;
+	long long msec = (long long)delay * 1000 * IDLE_DELAY_FACTOR;
+
+	if (!statelist || !mdstat_held)
+		msec = (long long)delay * 1000;
+	for (st = statelist; st; st = st->next) {
+		if (st->err || !st->devnm[0] || !st->nevfd ||
+		    st->percent != RESYNC_NONE || st->active < st->raid)
+			msec = (long long)delay * 1000;
+		n += st->nevfd;
+	}
+	if (max_wait && msec > max_wait * 1000LL)
+		msec = max_wait * 1000LL;
+	if (msec > INT_MAX)
+		msec = INT_MAX;
+	if (n > fds_size) {
+		fds = xrealloc(fds, n * sizeof(*fds));
+		owner = xrealloc(owner, n * sizeof(*owner));
+		fds_size = n;
 	}
+	memset(fds, 0, n * sizeof(*fds));
+	fds[1].fd = stop_pipe[0];
+	fds[1].events = POLLIN;
+	n = 2;
+	for (st = statelist; st; st = st->next)
+		for (i = 0; i < st->nevfd; i++) {
+			fds[n].fd = st->evfd[i].fd;
+			owner[n++] = st;
+		}
+
+	/* check_array() re-arms what fired when it reads the state */
+	if (!monitor_stop && mdstat_poll(fds, n, msec) > 0)
+		for (i = 2; i < n; i++)
+			if (fds[i].revents)
+				owner[i]->fired = 1;
 }
 
-static int check_array(struct state *st, struct mdstat_ent *mdstat,
+static int check_array(struct state *st, struct name_index *mdstat_ix,
 		       int test, struct alert_info *ainfo,
 		       int increments, char *prefer)
 {
@@ -465,7 +985,7 @@ static int check_array(struct state *st, struct mdstat_ent *mdstat,
 	struct { int state, major, minor; } info[MAX_DISKS];
 	struct mdinfo *sra = NULL;
 	mdu_array_info_t array;
-	struct mdstat_ent *mse = NULL, *mse2;
+	struct mdstat_ent *mse = NULL;
 	char *dev = st->devname;
 	int fd;
 	int i;
@@ -474,25 +994,40 @@ static int check_array(struct state *st, struct mdstat_ent *mdstat,
 	int new_array = 0;
 	int retval;
 	int is_container = 0;
-	unsigned long redundancy_only_flags = 0;
+	int redundant = 0;
 
 	if (test)
 		alert("TestMessage", dev, NULL, ainfo);
+	else if (st->utime && !st->err && st->devnm[0] && !st->fired) {
+		/* Nearly everything we report on shows in /proc/mdstat,
+		 * and the rest fires one of st->evfd, so there is nothing
+		 * to do if neither happened.
+		 */
+		mse = name_index_find(mdstat_ix, st->devnm);
+		if (mse && mse->changed == MDSTAT_SAME) {
+			mse->devnm[0] = 0; /* flag it as "used" */
+			return (st->active < st->raid) && st->spare == 0;
+		}
+		mse = NULL;
+	}
 
 	retval = 0;
+	st->fired = 0;
+	st->metrics_fresh = 0;
+	rearm_array(st);
 
 	fd = open(dev, O_RDONLY);
+	if (fd < 0 && (errno == EMFILE || errno == ENFILE))
+		goto short_of_fds;
 	if (fd < 0)
 		goto disappeared;
 
 	if (st->devnm[0] == 0)
 		strcpy(st->devnm, fd2devnm(fd));
 
-	for (mse2 = mdstat; mse2; mse2 = mse2->next)
-		if (strcmp(mse2->devnm, st->devnm) == 0) {
-			mse2->devnm[0] = 0; /* flag it as "used" */
-			mse = mse2;
-		}
+	mse = name_index_find(mdstat_ix, st->devnm);
+	if (mse)
+		mse->devnm[0] = 0; /* flag it as "used" */
 
 	if (!mse) {
 		/* duplicated array in statelist
@@ -513,11 +1048,13 @@ static int check_array(struct state *st, struct mdstat_ent *mdstat,
 		goto disappeared;
 
 	if (!is_container && map_name(pers, mse->level) > 0)
-		redundancy_only_flags |= GET_MISMATCH;
+		redundant = 1;
 
 	sra = sysfs_read(-1, st->devnm, GET_LEVEL | GET_DISKS | GET_DEVS |
-			GET_STATE | redundancy_only_flags);
+			GET_STATE);
 
+	if (!sra && (errno == EMFILE || errno == ENFILE))
+		goto short_of_fds;
 	if (!sra)
 		goto disappeared;
 
@@ -530,6 +1067,7 @@ static int check_array(struct state *st, struct mdstat_ent *mdstat,
 		st->err++;
 		goto out;
 	}
+	watch_array(st, sra);
 
 	/* this array is in /proc/mdstat */
 	if (array.utime == 0)
@@ -585,7 +1123,8 @@ static int check_array(struct state *st, struct mdstat_ent *mdstat,
 		 * If there is a number in /mismatch_cnt,
 		 * we should report that.
 		 */
-		if (sra && sra->mismatch_cnt > 0) {
+		if (redundant && sysfs_load(sra, GET_MISMATCH) == 0 &&
+		    sra->mismatch_cnt > 0) {
 			char cnt[80];
 			snprintf(cnt, sizeof(cnt),
 				 " mismatches found: %d (on raid level %d)",
@@ -669,16 +1208,28 @@ static int check_array(struct state *st, struct mdstat_ent *mdstat,
 		retval = 1;
 
  out:
+	if (st->err)
+		unwatch_array(st);
 	if (sra)
 		sysfs_free(sra);
 	if (fd >= 0)
 		close(fd);
 	return retval;
 
+ short_of_fds:
+	/* The array hasn't gone, we are out of fds: stop watching it, so
+	 * it is polled and there are fds to check it next time.
+	 */
+	unwatch_array(st);
+	st->fired = 1;
+	retval = (st->active < st->raid) && st->spare == 0;
+	goto out;
+
  disappeared:
 	if (!st->err)
 		alert("DeviceDisappeared", dev, NULL, ainfo);
 	st->err++;
+	unwatch_array(st);
 	goto out;
 }
 
@@ -902,13 +1453,63 @@ static dev_t container_choose_spare(struct state *from, struct state *to,
 	return dev;
 }
 
+static int migrate_spare(struct state *from, struct state *to,
+			 struct domainlist *domlist, struct spare_criteria *sc,
+			 struct alert_info *info)
+{
+	dev_t devid;
+
+	if (!check_donor(from, to))
+		return 0;
+	if (from->metadata->ss->external)
+		devid = container_choose_spare(from, to, domlist, sc, 0);
+	else
+		devid = choose_spare(from, to, domlist, sc);
+	if (devid > 0 && move_spare(from->devname, to->devname, devid)) {
+		alert("MoveSpare", to->devname, from->devname, info);
+		return 1;
+	}
+	return 0;
+}
+
 static void try_spare_migration(struct state *statelist, struct alert_info *info)
 {
 	struct state *from;
 	struct state *st;
+	struct state *nogroup = NULL;
+	struct name_index groups;
 	struct spare_criteria sc;
+	int n = 0;
 
 	link_containers_with_subarrays(statelist);
+
+	/* Index the donors by spare_group.  A donor's spare_group is
+	 * added to the domains of its spares, so it can only give to
+	 * an array whose domain list names that group.  Only donors
+	 * without a spare_group need trying against every array.
+	 */
+	for (st = statelist; st; st = st->next)
+		n++;
+	memset(&groups, 0, sizeof(groups));
+	name_index_build(&groups, n);
+	for (st = statelist; st; st = st->next) {
+		if (!check_donor(st, NULL))
+			continue;
+		if (!st->spare_group) {
+			st->next_donor = nogroup;
+			nogroup = st;
+			continue;
+		}
+		from = name_index_find(&groups, st->spare_group);
+		if (from) {
+			st->next_donor = from->next_donor;
+			from->next_donor = st;
+		} else {
+			st->next_donor = NULL;
+			name_index_add(&groups, st->spare_group, st);
+		}
+	}
+
 	for (st = statelist; st; st = st->next)
 		if (st->active < st->raid && st->spare == 0 && !st->err) {
 			struct domainlist *domlist = NULL;
@@ -948,26 +1549,24 @@ static void try_spare_migration(struct state *statelist, struct alert_info *info
 			 */
 			if (!domlist)
 				continue;
-			for (from=statelist ; from ; from=from->next) {
-				dev_t devid;
-				if (!check_donor(from, to))
-					continue;
-				if (from->metadata->ss->external)
-					devid = container_choose_spare(
-						from, to, domlist, &sc, 0);
-				else
-					devid = choose_spare(from, to, domlist,
-							     &sc);
-				if (devid > 0 &&
-				    move_spare(from->devname, to->devname,
-					       devid)) {
-					alert("MoveSpare", to->devname,
-					      from->devname, info);
+			for (from = nogroup; from; from = from->next_donor)
+				if (migrate_spare(from, to, domlist, &sc, info))
 					break;
-				}
+			if (!from) {
+				struct domainlist *dl;
+
+				for (dl = domlist; dl && !from; dl = dl->next)
+					for (from = name_index_find(&groups,
+								    (char *)dl->dom);
+					     from; from = from->next_donor)
+						if (migrate_spare(from, to,
+								  domlist, &sc,
+								  info))
+							break;
 			}
 			domain_free(domlist);
 		}
+	free(groups.slots);
 }
 
 /* search the statelist to connect external
@@ -980,20 +1579,270 @@ static void link_containers_with_subarrays(struct state *list)
 {
 	struct state *st;
 	struct state *cont;
+	struct name_index containers;
+	int n = 0;
+
+	memset(&containers, 0, sizeof(containers));
 	for (st = list; st; st = st->next) {
 		st->parent = NULL;
 		st->subarray = NULL;
+		n++;
 	}
+	name_index_build(&containers, n);
 	for (st = list; st; st = st->next)
-		if (st->parent_devnm[0])
-			for (cont = list; cont; cont = cont->next)
-				if (!cont->err && cont->parent_devnm[0] == 0 &&
-				    strcmp(cont->devnm, st->parent_devnm) == 0) {
-					st->parent = cont;
-					st->subarray = cont->subarray;
-					cont->subarray = st;
-					break;
-				}
+		if (!st->err && st->parent_devnm[0] == 0)
+			name_index_add(&containers, st->devnm, st);
+	for (st = list; st; st = st->next)
+		if (st->parent_devnm[0]) {
+			cont = name_index_find(&containers, st->parent_devnm);
+			if (cont) {
+				st->parent = cont;
+				st->subarray = cont->subarray;
+				cont->subarray = st;
+			}
+		}
+	free(containers.slots);
+}
+
+static unsigned int name_hash(char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name)
+		h = h * 33 + (unsigned char)*name++;
+	return h;
+}
+
+/* Empty 'ix', making room for 'n' items at no more than half full */
+static void name_index_build(struct name_index *ix, int n)
+{
+	unsigned int size = 16;
+
+	while (size < 2 * (unsigned int)n)
+		size <<= 1;
+	if (size > ix->size) {
+		free(ix->slots);
+		ix->slots = xmalloc(size * sizeof(ix->slots[0]));
+		ix->size = size;
+	}
+	memset(ix->slots, 0, ix->size * sizeof(ix->slots[0]));
+}
+
+/* The first item added with a given name is the one found */
+static void name_index_add(struct name_index *ix, char *name, void *item)
+{
+	unsigned int i = name_hash(name) & (ix->size - 1);
+
+	for (; ix->slots[i].name; i = (i + 1) & (ix->size - 1))
+		if (strcmp(ix->slots[i].name, name) == 0)
+			return;
+	ix->slots[i].name = name;
+	ix->slots[i].item = item;
+}
+
+static void *name_index_find(struct name_index *ix, char *name)
+{
+	unsigned int i = name_hash(name) & (ix->size - 1);
+
+	for (; ix->slots[i].name; i = (i + 1) & (ix->size - 1))
+		if (strcmp(ix->slots[i].name, name) == 0)
+			return ix->slots[i].item;
+	return NULL;
+}
+
+static const struct {
+	char *name, *type, *help;
+} metric_info[NR_METRICS] = {
+	[M_DISKS] = { "mdadm_array_disks", "gauge",
+		      "Member devices of the array by role or state." },
+	[M_DEGRADED] = { "mdadm_array_degraded", "gauge",
+			 "Number of devices the array is missing." },
+	[M_SYNC_ACTION] = { "mdadm_array_sync_action", "gauge",
+			    "The array's current sync_action is 1." },
+	[M_SYNC_COMPLETED] = { "mdadm_array_sync_completed_ratio", "gauge",
+			       "Fraction of the current resync, recovery or check done." },
+	[M_SYNC_SPEED] = { "mdadm_array_sync_speed_kbytes", "gauge",
+			   "Current resync speed in KiB/sec." },
+	[M_MISMATCH] = { "mdadm_array_mismatch_cnt", "gauge",
+			 "Sectors found inconsistent by the last check or repair." },
+	[M_MEMBER_STATE] = { "mdadm_member_state", "gauge",
+			     "Each flag in the member's state is 1." },
+	[M_MEMBER_ERRORS] = { "mdadm_member_errors_total", "counter",
+			      "Read errors corrected on the member." },
+	[M_MEMBER_BAD_BLOCKS] = { "mdadm_member_bad_blocks", "gauge",
+				  "Ranges in the member's bad block list." },
+};
+
+static void metrics_header(FILE *f, char *name, char *type, char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void free_metrics(struct state *st)
+{
+	int m;
+
+	for (m = 0; m < NR_METRICS; m++) {
+		free(st->metrics[m]);
+		st->metrics[m] = NULL;
+	}
+	st->metrics_fresh = 0;
+}
+
+/*
+ * Re-read the attributes behind st's lines of each metric.  The lines
+ * of one metric must be together in the file, so each is kept apart
+ * until write_metrics() puts them in order.
+ */
+static void read_metrics(struct state *st)
+{
+	FILE *f[NR_METRICS];
+	struct mdinfo *sra, *d;
+	char buf[4097];
+	unsigned long long v1, v2;
+	size_t len;
+	int m;
+
+	free_metrics(st);
+	sra = sysfs_read(-1, st->devnm, GET_DEVS);
+	if (!sra)
+		return;
+	for (m = 0; m < NR_METRICS; m++) {
+		f[m] = open_memstream(&st->metrics[m], &len);
+		if (!f[m]) {
+			while (m-- > 0)
+				fclose(f[m]);
+			free_metrics(st);
+			sysfs_free(sra);
+			return;
+		}
+	}
+
+	fprintf(f[M_DISKS], "mdadm_array_disks{device=\"%s\",state=\"raid\"} %d\n",
+		st->devnm, st->raid);
+	fprintf(f[M_DISKS], "mdadm_array_disks{device=\"%s\",state=\"active\"} %d\n",
+		st->devnm, st->active);
+	fprintf(f[M_DISKS], "mdadm_array_disks{device=\"%s\",state=\"working\"} %d\n",
+		st->devnm, st->working);
+	fprintf(f[M_DISKS], "mdadm_array_disks{device=\"%s\",state=\"failed\"} %d\n",
+		st->devnm, st->failed);
+	fprintf(f[M_DISKS], "mdadm_array_disks{device=\"%s\",state=\"spare\"} %d\n",
+		st->devnm, st->spare);
+
+	if (sysfs_get_ll(sra, NULL, "degraded", &v1) == 0)
+		fprintf(f[M_DEGRADED], "mdadm_array_degraded{device=\"%s\"} %llu\n",
+			st->devnm, v1);
+
+	if (sysfs_get_str(sra, NULL, "sync_action", buf, 32) > 0)
+		fprintf(f[M_SYNC_ACTION], "mdadm_array_sync_action{device=\"%s\",action=\"%.*s\"} 1\n",
+			st->devnm, (int)strcspn(buf, "\n"), buf);
+
+	if (sysfs_get_two(sra, NULL, "sync_completed", &v1, &v2) == 2 && v2)
+		fprintf(f[M_SYNC_COMPLETED], "mdadm_array_sync_completed_ratio{device=\"%s\"} %.4f\n",
+			st->devnm, (double)v1 / v2);
+
+	if (sysfs_get_ll(sra, NULL, "sync_speed", &v1) == 0)
+		fprintf(f[M_SYNC_SPEED], "mdadm_array_sync_speed_kbytes{device=\"%s\"} %llu\n",
+			st->devnm, v1);
+
+	if (sysfs_get_ll(sra, NULL, "mismatch_cnt", &v1) == 0)
+		fprintf(f[M_MISMATCH], "mdadm_array_mismatch_cnt{device=\"%s\"} %llu\n",
+			st->devnm, v1);
+
+	for (d = sra->devs; d; d = d->next) {
+		char *cp, *flag;
+		int blen, cnt = 0;
+
+		if (sysfs_get_str(sra, d, "state", buf, 256) > 0)
+			for (cp = buf; (flag = strsep(&cp, ",\n")) != NULL; )
+				if (*flag)
+					fprintf(f[M_MEMBER_STATE], "mdadm_member_state{device=\"%s\",member=\"%s\",state=\"%s\"} 1\n",
+						st->devnm, d->sys_name + 4,
+						flag);
+
+		if (sysfs_get_ll(sra, d, "errors", &v1) == 0)
+			fprintf(f[M_MEMBER_ERRORS], "mdadm_member_errors_total{device=\"%s\",member=\"%s\"} %llu\n",
+				st->devnm, d->sys_name + 4, v1);
+
+		blen = sysfs_get_str(sra, d, "bad_blocks", buf, sizeof(buf));
+		if (blen < 0)
+			continue;
+		while (blen > 0)
+			if (buf[--blen] == '\n')
+				cnt++;
+		fprintf(f[M_MEMBER_BAD_BLOCKS], "mdadm_member_bad_blocks{device=\"%s\",member=\"%s\"} %d\n",
+			st->devnm, d->sys_name + 4, cnt);
+	}
+
+	for (m = 0; m < NR_METRICS; m++)
+		fclose(f[m]);
+	sysfs_free(sra);
+	st->metrics_fresh = 1;
+}
+
+static void write_metrics(char *file, struct state *statelist)
+{
+	static time_t last_full;
+	time_t now = time(0);
+	int full = now - last_full >= METRICS_INTERVAL;
+	struct state *st;
+	struct name_index names;
+	struct alert_count *ac;
+	char tmp[PATH_MAX];
+	FILE *f;
+	int fd, n = 0, i, m;
+
+	if (full)
+		last_full = now;
+	for (st = statelist; st; st = st->next)
+		n++;
+	memset(&names, 0, sizeof(names));
+	name_index_build(&names, n);
+	for (st = statelist; st; st = st->next) {
+		if (st->devnm[0])
+			name_index_add(&names, st->devname, st);
+		if (!st->devnm[0] || st->err) {
+			free_metrics(st);
+			continue;
+		}
+		if (full || !st->metrics_fresh)
+			read_metrics(st);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	f = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!f) {
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+
+	for (m = 0; m < NR_METRICS; m++) {
+		metrics_header(f, metric_info[m].name, metric_info[m].type,
+			       metric_info[m].help);
+		for (st = statelist; st; st = st->next)
+			if (st->metrics[m])
+				fputs(st->metrics[m], f);
+	}
+
+	metrics_header(f, "mdadm_alerts_total", "counter",
+		       "Events reported by this monitor.");
+	for (i = 0; i < 256; i++)
+		for (ac = alert_counts[i]; ac; ac = ac->next) {
+			st = name_index_find(&names, ac->dev);
+			if (st)
+				fprintf(f, "mdadm_alerts_total{device=\"%s\",event=\"%s\"} %lu\n",
+					st->devnm, ac->event, ac->count);
+		}
+
+	if (fflush(f) == 0 && ferror(f) == 0)
+		rename(tmp, file);
+	else
+		unlink(tmp);
+	fclose(f);
+ out:
+	free(names.slots);
 }
 
 /* Not really Monitor but ... */
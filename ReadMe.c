@@ -202,6 +202,7 @@ struct option long_options[] = {
     {"pid-file",  1, 0, 'i'},
     {"syslog",    0, 0, 'y'},
     {"no-sharing", 0, 0, NoSharing},
+    {"metrics",   1, 0, MetricsFile},
 
     /* For Grow */
     {"backup-file", 1,0, BackupFile},
@@ -553,6 +554,7 @@ char Help_monitor[] =
 "  --pid-file=   -i   : In daemon mode write pid to specified file instead of stdout\n"
 "  --oneshot     -1   : Check for degraded arrays, then exit\n"
 "  --test        -t   : Generate a TestMessage event against each array at startup\n"
+"  --metrics=         : Keep array and member statistics in this file\n"
 ;
 
 char Help_grow[] =
@@ -73,6 +73,7 @@ typedef struct bitmap_info_s {
 	bitmap_super_t sb;
 	unsigned long long total_bits;
 	unsigned long long dirty_bits;
+	char *bits;		/* only if asked for */
 } bitmap_info_t;
 
 /* count the dirty bits in the first num_bits of byte */
@@ -108,7 +109,7 @@ static int count_dirty_bits(char *buf, int num_bits)
 	return num;
 }
 
-static bitmap_info_t *bitmap_fd_read(int fd, int brief)
+static bitmap_info_t *bitmap_fd_read(int fd, int brief, int keep_bits)
 {
 	/* Note: fd might be open O_DIRECT, so we must be
 	 * careful to align reads properly
@@ -125,6 +126,7 @@ static bitmap_info_t *bitmap_fd_read(int fd, int brief)
 	n = read(fd, buf, 8192);
 
 	info = xmalloc(sizeof(*info));
+	info->bits = NULL;
 
 	if (n < sizeof(info->sb)) {
 		pr_err("failed to read superblock of bitmap file: %s\n", strerror(errno));
@@ -148,6 +150,11 @@ static bitmap_info_t *bitmap_fd_read(int fd, int brief)
 	 *    data in the file
 	 */
 	total_bits = bitmap_bits(info->sb.sync_size, info->sb.chunksize);
+	if (keep_bits) {
+		/* anything we fail to read counts as dirty */
+		info->bits = xmalloc((total_bits + 7) / 8);
+		memset(info->bits, 0xff, (total_bits + 7) / 8);
+	}
 
 	while(read_bits < total_bits) {
 		unsigned long long remaining = total_bits - read_bits;
@@ -162,6 +169,9 @@ static bitmap_info_t *bitmap_fd_read(int fd, int brief)
 			remaining = (n-skip) * 8;
 
 		dirty_bits += count_dirty_bits(buf+skip, remaining);
+		if (info->bits)
+			memcpy(info->bits + read_bits / 8, buf+skip,
+			       (remaining + 7) / 8);
 
 		read_bits += remaining;
 		n = 0;
@@ -253,7 +263,7 @@ int ExamineBitmap(char *filename, int brief, struct supertype *st)
 	if (fd < 0)
 		return rv;
 
-	info = bitmap_fd_read(fd, brief);
+	info = bitmap_fd_read(fd, brief, 0);
 	if (!info)
 		return rv;
 	sb = &info->sb;
@@ -338,7 +348,7 @@ int ExamineBitmap(char *filename, int brief, struct supertype *st)
 
 				continue;
 			}
-			info = bitmap_fd_read(fd, brief);
+			info = bitmap_fd_read(fd, brief, 0);
 			if (!info) {
 				close(fd);
 				printf("   Unable to read bitmap on node: %i\n", i);
@@ -368,6 +378,89 @@ free_info:
 	return rv;
 }
 
+/*
+ * Add the regions of the members which the bitmap in 'filename' - a
+ * bitmap file, or a member with an internal bitmap - marks as dirty to
+ * the sorted list in *rangesp, merging as we go.  Offsets are in bytes
+ * from the start of the member data.  A stale bitmap marks everything.
+ * Returns the new number of ranges, or -1 if the bitmap cannot be read.
+ */
+int bitmap_dirty_ranges(char *filename, struct supertype *st,
+			struct bitmap_range **rangesp, int nranges)
+{
+	struct bitmap_range *ranges = *rangesp;
+	int node = 0, nodes = 1;
+
+	for (node = 0; node < nodes; node++) {
+		struct supertype *nst = st;
+		bitmap_info_t *info;
+		unsigned long long bit, chunk, size;
+		int fd;
+
+		fd = bitmap_file_open(filename, &nst, node);
+		if (fd < 0)
+			return -1;
+		info = bitmap_fd_read(fd, 0, 1);
+		close(fd);
+		if (!info)
+			return -1;
+		if (info->sb.magic != BITMAP_MAGIC || !info->bits) {
+			pr_err("invalid bitmap magic 0x%x, the bitmap file appears to be corrupted\n",
+			       info->sb.magic);
+			free(info->bits);
+			free(info);
+			return -1;
+		}
+		if (info->sb.nodes > 1)
+			nodes = info->sb.nodes;
+		chunk = info->sb.chunksize;
+		size = info->sb.sync_size * 512;
+		for (bit = 0; bit < info->total_bits; bit++) {
+			struct bitmap_range r;
+			int i;
+
+			if (bit % 8 == 0 && info->bits[bit/8] == 0 &&
+			    !(info->sb.state & BITMAP_STALE)) {
+				bit += 7;
+				continue;
+			}
+			if (!(info->bits[bit/8] & (1 << (bit % 8))) &&
+			    !(info->sb.state & BITMAP_STALE))
+				continue;
+			r.start = bit * chunk;
+			r.end = r.start + chunk < size ? r.start + chunk : size;
+			/* find the first range that might touch this one */
+			for (i = nranges; i > 0 && ranges[i-1].end >= r.start; i--)
+				;
+			if (i < nranges && ranges[i].start <= r.end) {
+				if (r.start < ranges[i].start)
+					ranges[i].start = r.start;
+				if (r.end > ranges[i].end)
+					ranges[i].end = r.end;
+				/* and absorb any it now reaches */
+				while (i + 1 < nranges &&
+				       ranges[i+1].start <= ranges[i].end) {
+					if (ranges[i+1].end > ranges[i].end)
+						ranges[i].end = ranges[i+1].end;
+					memmove(&ranges[i+1], &ranges[i+2],
+						(nranges - i - 2) * sizeof(*ranges));
+					nranges--;
+				}
+				continue;
+			}
+			ranges = xrealloc(ranges, (nranges + 1) * sizeof(*ranges));
+			memmove(&ranges[i+1], &ranges[i],
+				(nranges - i) * sizeof(*ranges));
+			ranges[i] = r;
+			nranges++;
+		}
+		free(info->bits);
+		free(info);
+	}
+	*rangesp = ranges;
+	return nranges;
+}
+
 int CreateBitmap(char *filename, int force, char uuid[16],
 		 unsigned long chunksize, unsigned long daemon_sleep,
 		 unsigned long write_behind,
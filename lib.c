@@ -25,6 +25,7 @@
 #include	"mdadm.h"
 #include	"dlink.h"
 #include	<ctype.h>
+#include	<dirent.h>
 
 /* This fill contains various 'library' style function.  They
  * have no dependency on anything outside this file.
@@ -193,9 +194,236 @@ void udev_unblock(void)
 
 /*
  * convert a major/minor pair for a block device into a name in /dev, if possible.
- * On the first call, walk /dev collecting name.
- * Put them in a simple linked listfor now.
+ * The kernel's name comes from /sys/dev/block/MAJ:MIN/uevent and any
+ * symlinks from the udev database, and are remembered in a hash table.
+ * Only if that finds nothing do we walk /dev collecting names, once,
+ * for systems without udev.
  */
+#define DEVNAMES_HASH	256
+
+struct devnames {
+	struct devnames *next;	/* hash chain */
+	int major, minor;
+	int cnt, size;
+	char **names;
+	/* The names before the last re-read.  Callers hold on to what
+	 * map_dev() returned, so one generation is kept rather than freed.
+	 */
+	int old_cnt;
+	char **old_names;
+};
+static struct devnames *devnames_hash[DEVNAMES_HASH];
+
+static unsigned int devnames_slot(int major, int minor)
+{
+	return ((unsigned int)major * 31 + minor) % DEVNAMES_HASH;
+}
+
+static int devnames_match(char *name, int major, int minor)
+{
+	struct stat stb;
+
+	return stat(name, &stb) == 0 && S_ISBLK(stb.st_mode) &&
+		stb.st_rdev == makedev(major, minor);
+}
+
+/* Remember dir/name if it really is this device */
+static void devnames_add(struct devnames *dn, char *dir, char *name)
+{
+	int len = strlen(name);
+	char *path;
+
+	while (len && name[len-1] == '\n')
+		name[--len] = 0;
+	if (!len)
+		return;
+	path = xmalloc(strlen(dir) + len + 1);
+	strcpy(strcpy(path, dir) + strlen(dir), name);
+	if (!devnames_match(path, dn->major, dn->minor)) {
+		free(path);
+		return;
+	}
+	if (dn->cnt == dn->size) {
+		dn->size = dn->size * 2 + 4;
+		dn->names = xrealloc(dn->names, dn->size * sizeof(char *));
+	}
+	dn->names[dn->cnt++] = path;
+}
+
+/*
+ * The block devices in /dev/md by st_rdev.  That directory is read
+ * whole, so it is only read again once its mtime says a link was
+ * added or removed.
+ */
+struct mdlink {
+	struct mdlink *next;
+	dev_t rdev;
+	char *name;
+};
+static struct mdlink *mdlinks_hash[DEVNAMES_HASH];
+static struct timespec mdlinks_mtime;
+static int mdlinks_valid;
+
+static void mdlinks_refresh(void)
+{
+	struct stat stb;
+	struct mdlink *ml;
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *de;
+	int i;
+
+	if (stat("/dev/md", &stb) != 0)
+		memset(&stb, 0, sizeof(stb));
+	else if (mdlinks_valid &&
+		 stb.st_mtim.tv_sec == mdlinks_mtime.tv_sec &&
+		 stb.st_mtim.tv_nsec == mdlinks_mtime.tv_nsec)
+		return;
+
+	for (i = 0; i < DEVNAMES_HASH; i++)
+		while ((ml = mdlinks_hash[i]) != NULL) {
+			mdlinks_hash[i] = ml->next;
+			free(ml->name);
+			free(ml);
+		}
+	mdlinks_valid = 0;
+	dir = opendir("/dev/md");
+	if (!dir)
+		return;
+	mdlinks_mtime = stb.st_mtim;
+	mdlinks_valid = 1;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/dev/md/%s", de->d_name);
+		if (stat(path, &stb) != 0 || !S_ISBLK(stb.st_mode))
+			continue;
+		ml = xmalloc(sizeof(*ml));
+		ml->rdev = stb.st_rdev;
+		ml->name = xstrdup(de->d_name);
+		i = devnames_slot(major(ml->rdev), minor(ml->rdev));
+		ml->next = mdlinks_hash[i];
+		mdlinks_hash[i] = ml;
+	}
+	closedir(dir);
+}
+
+/* Collect the names of one device without looking through /dev */
+static void devnames_read(struct devnames *dn)
+{
+	char path[64];
+	char line[PATH_MAX];
+	int found_md = 0;
+	FILE *f;
+	struct mdlink *ml;
+	dev_t rdev = makedev(dn->major, dn->minor);
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/uevent",
+		 dn->major, dn->minor);
+	f = fopen(path, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			if (strncmp(line, "DEVNAME=", 8) == 0)
+				devnames_add(dn, "/dev/", line + 8);
+		fclose(f);
+	}
+	snprintf(path, sizeof(path), "/run/udev/data/b%d:%d",
+		 dn->major, dn->minor);
+	f = fopen(path, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			if (strncmp(line, "S:", 2) == 0) {
+				devnames_add(dn, "/dev/", line + 2);
+				if (strncmp(line + 2, "md/", 3) == 0)
+					found_md = 1;
+			}
+		fclose(f);
+	}
+	if (found_md ||
+	    (dn->major != MD_MAJOR && dn->major != get_mdp_major()))
+		return;
+
+	/* mdadm makes the /dev/md/ links itself when udev doesn't */
+	mdlinks_refresh();
+	for (ml = mdlinks_hash[devnames_slot(dn->major, dn->minor)];
+	     ml; ml = ml->next)
+		if (ml->rdev == rdev) {
+			strcpy(line, ml->name);
+			devnames_add(dn, "/dev/md/", line);
+		}
+}
+
+static char *pick_dev_name(char **names, int cnt, char *prefer)
+{
+	char *regular = NULL, *preferred = NULL;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		char *name = names[i];
+
+		if (strncmp(name, "/dev/md/",8) == 0 ||
+		    (prefer && strstr(name, prefer))) {
+			if (preferred == NULL ||
+			    strlen(name) < strlen(preferred))
+				preferred = name;
+		} else {
+			if (regular == NULL ||
+			    strlen(name) < strlen(regular))
+				regular = name;
+		}
+	}
+	return preferred ? preferred : regular;
+}
+
+static char *map_dev_lookup(int major, int minor, char *prefer)
+{
+	unsigned int hash = devnames_slot(major, minor);
+	struct devnames *dn;
+	int cnt, size;
+	char **names;
+	char *name;
+
+	for (dn = devnames_hash[hash]; dn; dn = dn->next)
+		if (dn->major == major && dn->minor == minor)
+			break;
+	if (!dn) {
+		dn = xcalloc(1, sizeof(*dn));
+		dn->major = major;
+		dn->minor = minor;
+		dn->next = devnames_hash[hash];
+		devnames_hash[hash] = dn;
+		devnames_read(dn);
+		return pick_dev_name(dn->names, dn->cnt, prefer);
+	}
+
+	name = pick_dev_name(dn->names, dn->cnt, prefer);
+	if (name && devnames_match(name, major, minor))
+		return name;
+
+	/* The names have changed, or the device has gone.  If it has
+	 * gone, the last names it had are still the best answer.
+	 */
+	cnt = dn->cnt;
+	size = dn->size;
+	names = dn->names;
+	dn->cnt = dn->size = 0;
+	dn->names = NULL;
+	devnames_read(dn);
+	if (!dn->cnt) {
+		free(dn->names);
+		dn->cnt = cnt;
+		dn->size = size;
+		dn->names = names;
+		return name;
+	}
+	while (dn->old_cnt)
+		free(dn->old_names[--dn->old_cnt]);
+	free(dn->old_names);
+	dn->old_cnt = cnt;
+	dn->old_names = names;
+	return pick_dev_name(dn->names, dn->cnt, prefer);
+}
+
 struct devmap {
 	int major, minor;
 	char *name;
@@ -265,12 +493,14 @@ char *map_dev_preferred(int major, int minor, int create,
 {
 	struct devmap *p;
 	char *regular = NULL, *preferred=NULL;
-	int did_check = 0;
 
 	if (major == 0 && minor == 0)
 		return NULL;
 
- retry:
+	preferred = map_dev_lookup(major, minor, prefer);
+	if (preferred)
+		return preferred;
+
 	if (!devlist_ready) {
 		char *dev = "/dev";
 		struct stat stb;
@@ -284,7 +514,6 @@ char *map_dev_preferred(int major, int minor, int create,
 			dev = "/dev/.";
 		nftw(dev, add_dev, 10, FTW_PHYS);
 		devlist_ready=1;
-		did_check = 1;
 	}
 
 	for (p = devlist; p; p = p->next)
@@ -300,10 +529,6 @@ char *map_dev_preferred(int major, int minor, int create,
 					regular = p->name;
 			}
 		}
-	if (!regular && !preferred && !did_check) {
-		devlist_ready = 0;
-		goto retry;
-	}
 	if (create && !regular && !preferred) {
 		static char buf[30];
 		snprintf(buf, sizeof(buf), "%d:%d", major, minor);
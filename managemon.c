@@ -213,6 +213,7 @@ static void replace_array(struct supertype *container,
 	}
 	pending_discard = old;
 	new->replaces = old;
+	monitor_watch_array(new);
 	new->next = container->arrays;
 	container->arrays = new;
 	wakeup_monitor();
@@ -796,7 +797,13 @@ void manage(struct mdstat_ent *mdstat, struct supertype *container)
 		/* Looks like a member of this container */
 		for (a = container->arrays; a; a = a->next) {
 			if (strcmp(mdstat->devnm, a->info.sys_name) == 0) {
-				if (a->container && a->to_remove == 0)
+				/* Unless monitor asked for something,
+				 * only a change in mdstat needs looking at.
+				 */
+				if (a->container && a->to_remove == 0 &&
+				    (mdstat->changed != MDSTAT_SAME ||
+				     a->check_degraded || a->check_reshape ||
+				     sigterm))
 					manage_member(mdstat, a);
 				break;
 			}
@@ -892,30 +899,35 @@ int exit_now = 0;
 int manager_ready = 0;
 void do_manager(struct supertype *container)
 {
-	struct mdstat_ent *mdstat;
+	struct mdstat_snapshot snap;
 	sigset_t set;
 
 	sigprocmask(SIG_UNBLOCK, NULL, &set);
 	sigdelset(&set, SIGUSR1);
 	sigdelset(&set, SIGTERM);
+	sigdelset(&set, SIGUSR2);
+	memset(&snap, 0, sizeof(snap));
 
 	do {
 
 		if (exit_now)
 			exit(0);
 
+		if (dump_latency) {
+			dump_latency = 0;
+			monitor_dump_latency(container->devnm);
+		}
+
 		/* Can only 'manage' things if 'monitor' is not making
 		 * structural changes to metadata, so need to check
 		 * update_queue
 		 */
 		if (update_queue == NULL) {
-			mdstat = mdstat_read(1, 0);
+			mdstat_snapshot_read(&snap, 1);
 
-			manage(mdstat, container);
+			manage(snap.ents, container);
 
 			read_sock(container);
-
-			free_mdstat(mdstat);
 		}
 		remove_old();
 
@@ -88,6 +88,7 @@ int main(int argc, char *argv[])
 	int increments = 20;
 	int daemonise = 0;
 	char *pidfile = NULL;
+	char *metrics = NULL;
 	int oneshot = 0;
 	int spare_sharing = 1;
 	struct supertype *ss = NULL;
@@ -107,6 +108,7 @@ int main(int argc, char *argv[])
 	int locked = 0;
 
 	srandom(time(0) ^ getpid());
+	sysfs_cache_enable();
 
 	ident.uuid_set = 0;
 	ident.level = UnSet;
@@ -952,6 +954,13 @@ int main(int argc, char *argv[])
 		case O(MONITOR, NoSharing):
 			spare_sharing = 0;
 			continue;
+		case O(MONITOR, MetricsFile):
+			if (metrics)
+				pr_err("only specify one metrics file. %s ignored.\n",
+					optarg);
+			else
+				metrics = optarg;
+			continue;
 
 			/* now the general management options.  Some are applicable
 			 * to other modes. None have arguments.
@@ -1665,7 +1674,7 @@ int main(int argc, char *argv[])
 		rv = Monitor(devlist, mailaddr, program,
 			     &c, daemonise, oneshot,
 			     dosyslog, pidfile, increments,
-			     spare_sharing);
+			     spare_sharing, metrics);
 		break;
 
 	case GROW:
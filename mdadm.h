@@ -347,6 +347,7 @@ struct mdinfo {
 	char		sys_name[32];
 	struct mdinfo *devs;
 	struct mdinfo *next;
+	unsigned long	loaded;	/* GET_* details read by sysfs_load() */
 
 	/* Device info for mdmon: */
 	int recovery_fd;
@@ -484,6 +485,7 @@ enum special_options {
 	ClusterConfirm,
 	WriteJournal,
 	ConsistencyPolicy,
+	MetricsFile,
 };
 
 enum prefix_standard {
@@ -623,6 +625,32 @@ struct mdstat_ent {
 		struct dev_member	*next;
 	}		*members;
 	struct mdstat_ent *next;
+	unsigned long	fingerprint; /* hash of the whole line */
+	int		changed; /* MDSTAT_* since the previous snapshot */
+	struct mdstat_arena *arena; /* shared by one mdstat_read() */
+};
+
+enum mdstat_changes {
+	MDSTAT_SAME = 0,
+	MDSTAT_CHANGED,
+	MDSTAT_ADDED,
+};
+
+/* What an array looked like in the previous snapshot */
+struct mdstat_print {
+	char		devnm[32];
+	unsigned long	fingerprint;
+	int		seen;
+};
+
+struct mdstat_snapshot {
+	struct mdstat_ent *ents;	/* latest read, ->changed is set */
+	struct mdstat_print *removed;	/* arrays gone since the last read */
+	int nremoved;
+	int changes;			/* arrays added, changed or removed */
+	/* private */
+	struct mdstat_print *prints, *spare;
+	int nprints, prints_size, spare_size, removed_size;
 };
 
 extern struct mdstat_ent *mdstat_read(int hold, int start);
@@ -630,9 +658,13 @@ extern void mdstat_close(void);
 extern void free_mdstat(struct mdstat_ent *ms);
 extern void mdstat_wait(int seconds);
 extern void mdstat_wait_fd(int fd, const sigset_t *sigmask);
+struct pollfd;
+extern int mdstat_poll(struct pollfd *fds, int nfds, int msec);
 extern int mddev_busy(char *devnm);
 extern struct mdstat_ent *mdstat_by_component(char *name);
 extern struct mdstat_ent *mdstat_by_subdev(char *subdev, char *container);
+extern int mdstat_snapshot_read(struct mdstat_snapshot *snap, int hold);
+extern void mdstat_snapshot_free(struct mdstat_snapshot *snap);
 
 struct map_ent {
 	struct map_ent *next;
@@ -689,6 +721,7 @@ extern int sysfs_init(struct mdinfo *mdi, int fd, char *devnm);
 extern void sysfs_init_dev(struct mdinfo *mdi, dev_t devid);
 extern void sysfs_free(struct mdinfo *sra);
 extern struct mdinfo *sysfs_read(int fd, char *devnm, unsigned long options);
+extern int sysfs_load(struct mdinfo *sra, unsigned long options);
 extern int sysfs_attr_match(const char *attr, const char *str);
 extern int sysfs_match_word(const char *word, char **list);
 extern int sysfs_set_str(struct mdinfo *sra, struct mdinfo *dev,
@@ -719,6 +752,8 @@ extern int sysfs_unique_holder(char *devnm, long rdev);
 extern int sysfs_freeze_array(struct mdinfo *sra);
 extern int sysfs_wait(int fd, int *msec);
 extern int load_sys(char *path, char *buf, int len);
+extern void sysfs_cache_enable(void);
+extern void sysfs_cache_size(int fds);
 extern int zero_disk_range(int fd, unsigned long long sector, size_t count);
 extern int reshape_prepare_fdlist(char *devname,
 				  struct mdinfo *sra,
@@ -744,16 +779,104 @@ extern unsigned long compute_backup_blocks(int nchunk, int ochunk,
 extern char *locate_backup(char *name);
 extern char *make_backup(char *name);
 
+struct stripe_io;
+extern struct stripe_io *stripe_io_new(int raid_disks, int chunk_size,
+				       int level, int layout, int nwrites,
+				       unsigned long long stripes);
+extern void stripe_io_free(struct stripe_io *sio);
 extern int save_stripes(int *source, unsigned long long *offsets,
 			int raid_disks, int chunk_size, int level, int layout,
 			int nwrites, int *dest,
 			unsigned long long start, unsigned long long length,
-			char *buf);
+			char *buf, struct stripe_io *sio);
 extern int restore_stripes(int *dest, unsigned long long *offsets,
 			   int raid_disks, int chunk_size, int level, int layout,
 			   int source, unsigned long long read_offset,
 			   unsigned long long start, unsigned long long length,
-			   char *src_buf);
+			   char *src_buf, struct stripe_io *sio);
+extern int fsync_fds(struct stripe_io *sio, int *fds, int nr);
+extern int direct_io_fallback(int fd);
+extern void drop_cache(int fd, off_t offset, off_t len);
+
+/* Placement of blocks within one stripe, see stripe_map_get() */
+struct stripe_layout {
+	int pdisk;		/* -1 if there is no parity */
+	int qdisk;		/* -1 if there is no Q syndrome */
+	int *data;		/* logical block -> disk */
+	int *slot;		/* syndrome slot -> disk, -1 for a zero block */
+	int *role;		/* disk -> logical block, -1 for P, -2 for Q */
+};
+
+struct stripe_map {
+	struct stripe_map *next;
+	int level, layout, raid_disks;
+	int data_disks;
+	int syndrome_disks;	/* number of blocks P and Q cover */
+	int period;		/* layout repeats after this many stripes */
+	struct stripe_layout *rows;
+};
+
+extern int geo_map(int block, unsigned long long stripe, int raid_disks,
+		   int level, int layout);
+extern int is_ddf(int layout);
+extern struct stripe_map *stripe_map_get(int level, int layout, int raid_disks);
+
+static inline struct stripe_layout *stripe_layout(struct stripe_map *sm,
+						  unsigned long long stripe)
+{
+	return &sm->rows[stripe % sm->period];
+}
+
+/* Parity kernels from restripe.c */
+struct xor_algo {
+	const char *name;
+	int (*valid)(void);	/* NULL means always usable */
+	void (*do_xor)(char *target, char **sources, int disks, int size);
+};
+extern struct xor_algo xor_algos[];
+extern struct xor_algo *xor_select(void);
+extern void xor_blocks(char *target, char **sources, int disks, int size);
+
+struct raid6_algo {
+	const char *name;
+	int (*valid)(void);	/* NULL means always usable */
+	void (*gen_syndrome)(uint8_t *p, uint8_t *q, uint8_t **sources,
+			     int disks, int size);
+};
+/* Size of the test stripe raid6_select() times each algorithm on */
+#define RAID6_BENCH_DISKS	8
+#define RAID6_BENCH_SIZE	4096
+#define RAID6_BENCH_NSEC	2000000L
+extern struct raid6_algo raid6_algos[];
+extern struct raid6_algo *raid6_select(void);
+extern unsigned long long raid6_algo_speed(struct raid6_algo *a, uint8_t **bufs,
+					   int disks, int size, long nsec);
+extern void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources,
+		      int disks, int size);
+
+struct raid6_recov_algo {
+	const char *name;
+	int (*valid)(void);	/* NULL means always usable */
+	void (*recov_2data)(size_t bytes, uint8_t *p, uint8_t *q,
+			    uint8_t *dp, uint8_t *dq, uint8_t pbc, uint8_t qc);
+	void (*recov_datap)(size_t bytes, uint8_t *p, uint8_t *q,
+			    uint8_t *dq, uint8_t qc);
+};
+extern struct raid6_recov_algo raid6_recov_algos[];
+extern struct raid6_recov_algo *raid6_recov_select(void);
+/* GF(2^8) tables, generated by mktables into raid6tables.c */
+extern const uint8_t raid6_gfmul[256][256];
+extern const uint8_t raid6_vgfmul[256][32];
+extern const uint8_t raid6_gfexp[256];
+extern const uint8_t raid6_gfinv[256];
+extern const uint8_t raid6_gfexi[256];
+extern const uint8_t raid6_gflog[256];
+extern const uint8_t raid6_gfilog[256];
+extern void ensure_zero_has_size(int chunk_size);
+extern void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
+			      uint8_t **ptrs, int neg_offset);
+extern void raid6_datap_recov(int disks, size_t bytes, int faila,
+			      uint8_t **ptrs, int neg_offset);
 
 #ifndef Sendmail
 #define Sendmail "/usr/lib/sendmail -t"
@@ -1427,7 +1550,7 @@ extern int Monitor(struct mddev_dev *devlist,
 		   struct context *c,
 		   int daemonise, int oneshot,
 		   int dosyslog, char *pidfile, int increments,
-		   int share);
+		   int share, char *metrics);
 
 extern int Kill(char *dev, struct supertype *st, int force, int verbose, int noexcl);
 extern int Kill_subarray(char *dev, char *subarray, int verbose);
@@ -1447,6 +1570,11 @@ extern int CreateBitmap(char *filename, int force, char uuid[16],
 			unsigned long long array_size,
 			int major);
 extern int ExamineBitmap(char *filename, int brief, struct supertype *st);
+struct bitmap_range {
+	unsigned long long start, end;	/* bytes from start of member data */
+};
+extern int bitmap_dirty_ranges(char *filename, struct supertype *st,
+			       struct bitmap_range **rangesp, int nranges);
 extern int Write_rules(char *rule_name);
 extern int bitmap_update_uuid(int fd, int *uuid, int swap);
 
@@ -52,6 +52,7 @@
 #include	<sys/mman.h>
 #include	<sys/syscall.h>
 #include	<sys/wait.h>
+#include	<sys/resource.h>
 #include	<stdio.h>
 #include	<errno.h>
 #include	<string.h>
@@ -75,6 +76,7 @@ struct active_array *pending_discard;
 int mon_tid, mgr_tid;
 
 int sigterm;
+int dump_latency;
 
 #ifdef USE_PTHREADS
 static void *run_child(void *v)
@@ -264,6 +266,32 @@ static void wake_me(int sig)
 
 }
 
+static void dump_me(int sig)
+{
+	dump_latency = 1;
+}
+
+/*
+ * A container can hold more members than the usual soft limit of
+ * 1024 fds allows, so take what the hard limit permits before the
+ * monitor sizes its tables from it.  RLIM_INFINITY is refused by the
+ * kernel, so stop at the default nr_open instead.
+ */
+#define MAX_MDMON_FDS (1 << 20)
+static void raise_fd_limit(void)
+{
+	struct rlimit lim;
+
+	if (getrlimit(RLIMIT_NOFILE, &lim) != 0)
+		return;
+	if (lim.rlim_max > MAX_MDMON_FDS)
+		lim.rlim_max = MAX_MDMON_FDS;
+	if (lim.rlim_cur >= lim.rlim_max)
+		return;
+	lim.rlim_cur = lim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &lim);
+}
+
 /* if we are debugging and starting mdmon by hand then don't fork */
 static int do_fork(void)
 {
@@ -486,12 +514,15 @@ static int mdmon(char *devnm, int must_fork, int takeover)
 	sigemptyset(&set);
 	sigaddset(&set, SIGUSR1);
 	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR2);
 	sigprocmask(SIG_BLOCK, &set, NULL);
 	act.sa_handler = wake_me;
 	act.sa_flags = 0;
 	sigaction(SIGUSR1, &act, NULL);
 	act.sa_handler = term;
 	sigaction(SIGTERM, &act, NULL);
+	act.sa_handler = dump_me;
+	sigaction(SIGUSR2, &act, NULL);
 	act.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &act, NULL);
 
@@ -533,6 +564,11 @@ static int mdmon(char *devnm, int must_fork, int takeover)
 
 	mlockall(MCL_CURRENT | MCL_FUTURE);
 
+	raise_fd_limit();
+	if (monitor_init() < 0) {
+		pr_err("failed to create epoll set: %s\n", strerror(errno));
+		exit(2);
+	}
 	if (clone_monitor(container) < 0) {
 		pr_err("failed to start monitor process: %s\n",
 			strerror(errno));
@@ -579,7 +615,7 @@ int restore_stripes(int *dest, unsigned long long *offsets,
 		    int raid_disks, int chunk_size, int level, int layout,
 		    int source, unsigned long long read_offset,
 		    unsigned long long start, unsigned long long length,
-		    char *src_buf)
+		    char *src_buf, struct stripe_io *sio)
 {
 	return 1;
 }
@@ -588,11 +624,22 @@ int save_stripes(int *source, unsigned long long *offsets,
 		 int raid_disks, int chunk_size, int level, int layout,
 		 int nwrites, int *dest,
 		 unsigned long long start, unsigned long long length,
-		 char *buf)
+		 char *buf, struct stripe_io *sio)
 {
 	return 0;
 }
 
+struct stripe_io *stripe_io_new(int raid_disks, int chunk_size,
+				int level, int layout, int nwrites,
+				unsigned long long stripes)
+{
+	return NULL;
+}
+
+void stripe_io_free(struct stripe_io *sio)
+{
+}
+
 struct superswitch super0 = {
 	.name = "0.90",
 };
@@ -50,6 +50,8 @@ struct active_array {
 
 	int check_degraded; /* flag set by mon, read by manage */
 	int check_reshape; /* flag set by mon, read by manage */
+	struct wp_latency *latency; /* set by manage, counted by mon */
+	int busy; /* last read_and_act() returned ARRAY_BUSY, for mon */
 };
 
 /*
@@ -74,8 +76,12 @@ extern struct md_generic_cmd *active_cmd;
 
 void remove_pidfile(char *devname);
 void do_monitor(struct supertype *container);
+int monitor_init(void);
+void monitor_watch_array(struct active_array *a);
+void monitor_dump_latency(char *devnm);
 void do_manager(struct supertype *container);
 extern int sigterm;
+extern int dump_latency;
 
 int read_dev_state(int fd);
 int is_container_member(struct mdstat_ent *mdstat, char *container);
@@ -73,28 +73,141 @@
  *   pattern of failed drives (so need number of drives)
  *   percent resync complete
  *
- * As continuation is indicated by leading space, we use
- *  conf_line from config.c to read logical lines
+ * As continuation is indicated by leading space, logical lines are
+ * found the same way as conf_line() in config.c finds them.
  *
  */
 
 #include	"mdadm.h"
-#include	"dlink.h"
-#include	<sys/select.h>
+#include	<poll.h>
 #include	<ctype.h>
 
-static void free_member_devnames(struct dev_member *m)
+/*
+ * /proc/mdstat is read whole into one buffer which is kept for the
+ * next read, and split into words in place.  All the entries, members
+ * and strings returned by one mdstat_read() come from a single arena,
+ * which is freed once free_mdstat() has been called for every entry
+ * in it - callers may split the list and free the parts separately.
+ */
+struct mdstat_arena {
+	int	refs;		/* entries not yet freed */
+	char	*next;		/* first unused byte */
+};
+
+static char *mdstat_buf;
+static size_t mdstat_size;
+static char **mdstat_words;
+static int mdstat_nwords;
+
+static void *arena_alloc(struct mdstat_arena *a, size_t size)
 {
-	while(m) {
-		struct dev_member *t = m;
+	void *p = a->next;
+
+	a->next += (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	return p;
+}
 
-		m = m->next;
-		free(t->name);
-		free(t);
+static char *arena_strndup(struct mdstat_arena *a, char *s, size_t len)
+{
+	char *p = arena_alloc(a, len + 1);
+
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+/* Read all of fd into mdstat_buf, returning the length or -1 */
+static long mdstat_load(int fd)
+{
+	size_t len = 0;
+
+	while (1) {
+		ssize_t n;
+
+		if (len + 1 >= mdstat_size) {
+			mdstat_size = mdstat_size ? mdstat_size * 2 : 8192;
+			mdstat_buf = xrealloc(mdstat_buf, mdstat_size);
+		}
+		n = read(fd, mdstat_buf + len, mdstat_size - len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		len += n;
 	}
+	mdstat_buf[len] = '\0';
+	return len;
 }
 
-static int add_member_devname(struct dev_member **m, char *name)
+/*
+ * Split the next logical line at *pos into mdstat_words, terminating
+ * each word in place, and return the number of words.  As with
+ * conf_line(), a line starting with a blank continues the previous one
+ * and blank lines are ignored.
+ */
+static int mdstat_line(char **pos, char *end)
+{
+	char *p = *pos;
+	int nw = 0;
+
+	while (p < end) {
+		char *w, c;
+
+		if (*p == ' ' || *p == '\t') {
+			p++;
+			continue;
+		}
+		if (*p == '\n') {
+			while (p < end && *p == '\n')
+				p++;
+			if (nw && p < end && *p != ' ' && *p != '\t')
+				break;
+			continue;
+		}
+		if (nw == mdstat_nwords) {
+			mdstat_nwords = mdstat_nwords ? mdstat_nwords * 2 : 64;
+			mdstat_words = xrealloc(mdstat_words,
+						mdstat_nwords * sizeof(char *));
+		}
+		w = p;
+		mdstat_words[nw++] = w;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\n')
+			p++;
+		if (p == end)
+			break;
+		c = *p;
+		*p++ = '\0';
+		if (c == '\n') {
+			while (p < end && *p == '\n')
+				p++;
+			if (p < end && *p != ' ' && *p != '\t')
+				break;
+		}
+	}
+	*pos = p;
+	return nw;
+}
+
+/* FNV-1a hash of the words of one line, for spotting changed arrays */
+static unsigned long mdstat_fingerprint(char **words, int nw)
+{
+	unsigned long h = 2166136261UL;
+	int i;
+
+	for (i = 0; i < nw; i++) {
+		unsigned char *c;
+
+		for (c = (unsigned char *)words[i]; *c; c++)
+			h = (h ^ *c) * 16777619UL;
+		h = (h ^ ' ') * 16777619UL;
+	}
+	return h;
+}
+
+static int add_member_devname(struct mdstat_arena *a,
+			      struct dev_member **m, char *name)
 {
 	struct dev_member *new;
 	char *t;
@@ -103,8 +216,8 @@ static int add_member_devname(struct dev_member **m, char *name)
 		/* not a device */
 		return 0;
 
-	new = xmalloc(sizeof(*new));
-	new->name = strndup(name, t - name);
+	new = arena_alloc(a, sizeof(*new));
+	new->name = arena_strndup(a, name, t - name);
 	new->next = *m;
 	*m = new;
 	return 1;
@@ -113,23 +226,22 @@ static int add_member_devname(struct dev_member **m, char *name)
 void free_mdstat(struct mdstat_ent *ms)
 {
 	while (ms) {
-		struct mdstat_ent *t;
-		free(ms->level);
-		free(ms->pattern);
-		free(ms->metadata_version);
-		free_member_devnames(ms->members);
-		t = ms;
+		struct mdstat_ent *t = ms;
+
 		ms = ms->next;
-		free(t);
+		if (--t->arena->refs == 0)
+			free(t->arena);
 	}
 }
 
 static int mdstat_fd = -1;
 struct mdstat_ent *mdstat_read(int hold, int start)
 {
-	FILE *f;
+	struct mdstat_arena *arena;
 	struct mdstat_ent *all, *rv, **end, **insert_here;
-	char *line;
+	char *p, *bufend;
+	size_t lines = 1, members = 0;
+	long len;
 	int fd;
 
 	if (hold && mdstat_fd != -1) {
@@ -138,40 +250,62 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 			mdstat_close();
 			return NULL;
 		}
-		fd = dup(mdstat_fd);
-		if (fd >= 0)
-			f = fdopen(fd, "r");
-		else
+		fd = mdstat_fd;
+	} else {
+		fd = open("/proc/mdstat", O_RDONLY);
+		if (fd < 0)
 			return NULL;
-	} else
-		f = fopen("/proc/mdstat", "r");
-	if (f == NULL)
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	len = mdstat_load(fd);
+	if (fd != mdstat_fd) {
+		if (hold && mdstat_fd == -1 && len >= 0)
+			mdstat_fd = fd;
+		else
+			close(fd);
+	}
+	if (len < 0)
 		return NULL;
-	else
-		fcntl(fileno(f), F_SETFD, FD_CLOEXEC);
+	bufend = mdstat_buf + len;
+
+	/* Every entry needs a line and every member a '[', and the
+	 * strings are no longer than the text they are copied from.
+	 * Allow for rounding each allocation up to a pointer.
+	 */
+	for (p = mdstat_buf; p < bufend; p++)
+		if (*p == '\n')
+			lines++;
+		else if (*p == '[')
+			members++;
+	arena = xmalloc(sizeof(*arena) + len + 1 +
+			lines * (sizeof(struct mdstat_ent) + 4 * sizeof(void *)) +
+			members * (sizeof(struct dev_member) + 2 * sizeof(void *)));
+	arena->refs = 0;
+	arena->next = (char *)(arena + 1);
 
 	all = NULL;
 	end = &all;
-	for (; (line = conf_line(f)) ; free_line(line)) {
+	p = mdstat_buf;
+	while (p < bufend) {
 		struct mdstat_ent *ent;
-		char *w;
-		char devnm[32];
+		char *line, *w;
 		int in_devs = 0;
+		int nw, i;
+
+		nw = mdstat_line(&p, bufend);
+		if (nw == 0)
+			break;
+		line = mdstat_words[0];
 
-		if (strcmp(line, "Personalities") == 0)
-			continue;
-		if (strcmp(line, "read_ahead") == 0)
-			continue;
-		if (strcmp(line, "unused") == 0)
-			continue;
 		insert_here = NULL;
-		/* Better be an md line.. */
+		/* Better be an md line..  This also skips "Personalities",
+		 * "read_ahead" and "unused".
+		 */
 		if (strncmp(line, "md", 2)!= 0 || strlen(line) >= 32 ||
 		    (line[2] != '_' && !isdigit(line[2])))
 			continue;
-		strcpy(devnm, line);
 
-		ent = xmalloc(sizeof(*ent));
+		ent = arena_alloc(arena, sizeof(*ent));
 		ent->level = ent->pattern= NULL;
 		ent->next = NULL;
 		ent->percent = RESYNC_NONE;
@@ -181,28 +315,36 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 		ent->raid_disks = 0;
 		ent->devcnt = 0;
 		ent->members = NULL;
+		ent->fingerprint = mdstat_fingerprint(mdstat_words, nw);
+		ent->changed = MDSTAT_ADDED;
+		ent->arena = arena;
+		arena->refs++;
 
-		strcpy(ent->devnm, devnm);
+		strcpy(ent->devnm, line);
 
-		for (w=dl_next(line); w!= line ; w=dl_next(w)) {
-			int l = strlen(w);
+		for (i = 1; i < nw; i++) {
+			int l;
 			char *eq;
-			if (strcmp(w, "active") == 0)
+
+			w = mdstat_words[i];
+			l = strlen(w);
+			if (w[0] == 'a' && strcmp(w, "active") == 0)
 				ent->active = 1;
-			else if (strcmp(w, "inactive") == 0) {
+			else if (w[0] == 'i' && strcmp(w, "inactive") == 0) {
 				ent->active = 0;
 				in_devs = 1;
 			} else if (ent->active > 0 &&
 				 ent->level == NULL &&
 				 w[0] != '(' /*readonly*/) {
-				ent->level = xstrdup(w);
+				ent->level = arena_strndup(arena, w, l);
 				in_devs = 1;
 			} else if (in_devs && strcmp(w, "blocks") == 0)
 				in_devs = 0;
 			else if (in_devs) {
 				char *ep = strchr(w, '[');
 				ent->devcnt +=
-					add_member_devname(&ent->members, w);
+					add_member_devname(arena,
+							   &ent->members, w);
 				if (ep && strncmp(w, "md", 2) == 0) {
 					/* This has an md device as a component.
 					 * If that device is already in the
@@ -219,16 +361,17 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 						ih = & (*ih)->next;
 					insert_here = ih;
 				}
-			} else if (strcmp(w, "super") == 0 &&
-				   dl_next(w) != line) {
-				w = dl_next(w);
-				ent->metadata_version = xstrdup(w);
+			} else if (w[0] == 's' && strcmp(w, "super") == 0 &&
+				   i + 1 < nw) {
+				w = mdstat_words[++i];
+				ent->metadata_version =
+					arena_strndup(arena, w, strlen(w));
 			} else if (w[0] == '[' && isdigit(w[1])) {
 				ent->raid_disks = atoi(w+1);
 			} else if (!ent->pattern &&
 				   w[0] == '[' &&
 				   (w[1] == 'U' || w[1] == '_')) {
-				ent->pattern = xstrdup(w+1);
+				ent->pattern = arena_strndup(arena, w+1, l-1);
 				if (ent->pattern[l-2] == ']')
 					ent->pattern[l-2] = '\0';
 			} else if (ent->percent == RESYNC_NONE &&
@@ -274,11 +417,8 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 			end = &ent->next;
 		}
 	}
-	if (hold && mdstat_fd == -1) {
-		mdstat_fd = dup(fileno(f));
-		fcntl(mdstat_fd, F_SETFD, FD_CLOEXEC);
-	}
-	fclose(f);
+	if (!all)
+		free(arena);
 
 	/* If we might want to start array,
 	 * reverse the order, so that components comes before composites
@@ -305,28 +445,25 @@ void mdstat_close(void)
 
 void mdstat_wait(int seconds)
 {
-	fd_set fds;
-	struct timeval tm;
-	int maxfd = 0;
-	FD_ZERO(&fds);
-	if (mdstat_fd >= 0) {
-		FD_SET(mdstat_fd, &fds);
-		maxfd = mdstat_fd;
-	}
-	tm.tv_sec = seconds;
-	tm.tv_usec = 0;
-	select(maxfd + 1, NULL, NULL, &fds, &tm);
+	struct pollfd pfd;
+
+	pfd.fd = mdstat_fd;
+	pfd.events = POLLPRI;
+	poll(&pfd, 1, seconds * 1000);
 }
 
+/*
+ * poll() rather than select(), as mdmon raises RLIMIT_NOFILE and
+ * 'fd' can be beyond FD_SETSIZE.
+ */
 void mdstat_wait_fd(int fd, const sigset_t *sigmask)
 {
-	fd_set fds, rfds;
-	int maxfd = 0;
+	struct pollfd pfd[2];
 
-	FD_ZERO(&fds);
-	FD_ZERO(&rfds);
-	if (mdstat_fd >= 0)
-		FD_SET(mdstat_fd, &fds);
+	pfd[0].fd = mdstat_fd;
+	pfd[0].events = POLLPRI;
+	pfd[1].fd = fd;
+	pfd[1].events = POLLIN;
 
 	if (fd >= 0) {
 		struct stat stb;
@@ -336,19 +473,28 @@ void mdstat_wait_fd(int fd, const sigset_t *sigmask)
 			 * POLLPRI
 			 * i.e. an 'exceptional' event.
 			 */
-			FD_SET(fd, &fds);
-		else
-			FD_SET(fd, &rfds);
+			pfd[1].events = POLLPRI;
+	}
 
-		if (fd > maxfd)
-			maxfd = fd;
+	ppoll(pfd, 2, NULL, sigmask);
+}
 
-	}
-	if (mdstat_fd > maxfd)
-		maxfd = mdstat_fd;
+/*
+ * Like mdstat_wait(), but also wake when any of fds[1..nfds-1], which
+ * are sysfs attributes, report POLLPRI, or report any events the
+ * caller already set.  fds[0] is filled in here for /proc/mdstat.
+ * 'msec' is as for poll(), and so is the return value.
+ */
+int mdstat_poll(struct pollfd *fds, int nfds, int msec)
+{
+	int i;
 
-	pselect(maxfd + 1, &rfds, NULL, &fds,
-		NULL, sigmask);
+	fds[0].fd = mdstat_fd;
+	for (i = 0; i < nfds; i++) {
+		fds[i].events |= POLLPRI;
+		fds[i].revents = 0;
+	}
+	return poll(fds, nfds, msec);
 }
 
 int mddev_busy(char *devnm)
@@ -421,3 +567,90 @@ struct mdstat_ent *mdstat_by_subdev(char *subdev, char *container)
 	}
 	return NULL;
 }
+
+/*
+ * Read /proc/mdstat and compare it with the previous read into 'snap',
+ * which must start out zeroed.  Each entry in snap->ents is marked as
+ * MDSTAT_ADDED, MDSTAT_CHANGED or MDSTAT_SAME by comparing the
+ * fingerprint of its line, and snap->removed lists the arrays that
+ * have gone.  The previous entries are freed, so callers must not
+ * keep them.  Returns the number of arrays added, changed or removed.
+ */
+int mdstat_snapshot_read(struct mdstat_snapshot *snap, int hold)
+{
+	struct mdstat_ent *ents = mdstat_read(hold, 0);
+	struct mdstat_ent *e;
+	struct mdstat_print *prev = snap->prints;
+	int nprev = snap->nprints;
+	int cur = 0;
+	int n = 0;
+	int i;
+
+	for (e = ents; e; e = e->next)
+		n++;
+	if (n > snap->spare_size) {
+		snap->spare_size = n;
+		snap->spare = xrealloc(snap->spare,
+				       n * sizeof(snap->spare[0]));
+	}
+	snap->changes = 0;
+
+	for (e = ents, n = 0; e; e = e->next, n++) {
+		/* Arrays are usually listed in the same order as last time */
+		if (cur >= nprev || strcmp(prev[cur].devnm, e->devnm) != 0)
+			for (cur = 0; cur < nprev; cur++)
+				if (!prev[cur].seen &&
+				    strcmp(prev[cur].devnm, e->devnm) == 0)
+					break;
+		if (cur >= nprev)
+			e->changed = MDSTAT_ADDED;
+		else {
+			prev[cur].seen = 1;
+			if (prev[cur].fingerprint == e->fingerprint)
+				e->changed = MDSTAT_SAME;
+			else
+				e->changed = MDSTAT_CHANGED;
+			cur++;
+		}
+		if (e->changed != MDSTAT_SAME)
+			snap->changes++;
+		strcpy(snap->spare[n].devnm, e->devnm);
+		snap->spare[n].fingerprint = e->fingerprint;
+		snap->spare[n].seen = 0;
+	}
+
+	snap->nremoved = 0;
+	for (i = 0; i < nprev; i++) {
+		if (prev[i].seen)
+			continue;
+		if (snap->nremoved == snap->removed_size) {
+			snap->removed_size = snap->removed_size * 2 + 8;
+			snap->removed = xrealloc(snap->removed,
+						 snap->removed_size *
+						 sizeof(snap->removed[0]));
+		}
+		snap->removed[snap->nremoved++] = prev[i];
+		snap->changes++;
+	}
+
+	/* The new prints become the old ones for next time */
+	snap->prints = snap->spare;
+	snap->spare = prev;
+	snap->nprints = n;
+	i = snap->spare_size;
+	snap->spare_size = snap->prints_size;
+	snap->prints_size = i;
+
+	free_mdstat(snap->ents);
+	snap->ents = ents;
+	return snap->changes;
+}
+
+void mdstat_snapshot_free(struct mdstat_snapshot *snap)
+{
+	free_mdstat(snap->ents);
+	free(snap->prints);
+	free(snap->spare);
+	free(snap->removed);
+	memset(snap, 0, sizeof(*snap));
+}
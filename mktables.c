@@ -0,0 +1,159 @@
+/*
+ * mktables - generate the GF(2^8) tables used by restripe.c
+ *
+ * Copyright (C) 2002-2007 H. Peter Anvin
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Based on linux/lib/raid6/mktables.c.  This is run on the build host
+ * to write raid6tables.c, so that the tables are const data shared
+ * between all processes rather than being computed by each one.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+static uint8_t gfmul(uint8_t a, uint8_t b)
+{
+	uint8_t v = 0;
+
+	while (b) {
+		if (b & 1)
+			v ^= a;
+		a = (a << 1) ^ (a & 0x80 ? 0x1d : 0);
+		b >>= 1;
+	}
+
+	return v;
+}
+
+static uint8_t gfpow(uint8_t a, int b)
+{
+	uint8_t v = 1;
+
+	b %= 255;
+	if (b < 0)
+		b += 255;
+
+	while (b) {
+		if (b & 1)
+			v = gfmul(v, a);
+		a = gfmul(a, a);
+		b >>= 1;
+	}
+
+	return v;
+}
+
+static void print_table(const char *name, uint8_t *t)
+{
+	int i, j;
+
+	printf("\nconst uint8_t %s[256] = {\n", name);
+	for (i = 0; i < 256; i += 8) {
+		printf("\t");
+		for (j = 0; j < 8; j++)
+			printf("0x%02x,%c", t[i + j], (j == 7) ? '\n' : ' ');
+	}
+	printf("};\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i, j, k;
+	uint8_t v;
+	uint8_t exptbl[256], invtbl[256], exitbl[256];
+	uint8_t logtbl[256], ilogtbl[256];
+	uint32_t b, log;
+
+	printf("/* Generated by mktables - do not edit */\n\n");
+	printf("#include <stdint.h>\n");
+
+	/* Compute multiplication table */
+	printf("\nconst uint8_t raid6_gfmul[256][256] = {\n");
+	for (i = 0; i < 256; i++) {
+		printf("\t{\n");
+		for (j = 0; j < 256; j += 8) {
+			printf("\t\t");
+			for (k = 0; k < 8; k++)
+				printf("0x%02x,%c", gfmul(i, j + k),
+				       (k == 7) ? '\n' : ' ');
+		}
+		printf("\t},\n");
+	}
+	printf("};\n");
+
+	/* Compute the nibble tables for vector multiplication:
+	 * c times every low nibble, then c times every high nibble.
+	 */
+	printf("\nconst uint8_t __attribute__((aligned(32)))\n"
+	       "raid6_vgfmul[256][32] = {\n");
+	for (i = 0; i < 256; i++) {
+		printf("\t{\n");
+		for (j = 0; j < 16; j += 8) {
+			printf("\t\t");
+			for (k = 0; k < 8; k++)
+				printf("0x%02x,%c", gfmul(i, j + k),
+				       (k == 7) ? '\n' : ' ');
+		}
+		for (j = 0; j < 16; j += 8) {
+			printf("\t\t");
+			for (k = 0; k < 8; k++)
+				printf("0x%02x,%c", gfmul(i, (j + k) << 4),
+				       (k == 7) ? '\n' : ' ');
+		}
+		printf("\t},\n");
+	}
+	printf("};\n");
+
+	/* Compute power-of-2 table (exponent) */
+	v = 1;
+	for (i = 0; i < 256; i++) {
+		exptbl[i] = v;
+		v = gfmul(v, 2);
+		if (v == 1)
+			v = 0;	/* For entry 255, not a real entry */
+	}
+	print_table("raid6_gfexp", exptbl);
+
+	/* Compute inverse table x^-1 == x^254 */
+	for (i = 0; i < 256; i++)
+		invtbl[i] = gfpow(i, 254);
+	print_table("raid6_gfinv", invtbl);
+
+	/* Compute inv(2^x + 1) (exponent-xor-inverse) table */
+	for (i = 0; i < 256; i ++)
+		exitbl[i] = invtbl[exptbl[i] ^ 1];
+	print_table("raid6_gfexi", exitbl);
+
+	/* Compute log and inverse log */
+	/* Modified code from:
+	 *    https://web.eecs.utk.edu/~plank/plank/papers/CS-96-332.html
+	 */
+	b = 1;
+	logtbl[0] = 0;
+	ilogtbl[255] = 0;
+
+	for (log = 0; log < 255; log++) {
+		logtbl[b] = (uint8_t) log;
+		ilogtbl[log] = (uint8_t) b;
+		b = b << 1;
+		if (b & 256) b = b ^ 0435;
+	}
+	print_table("raid6_gflog", logtbl);
+	print_table("raid6_gfilog", ilogtbl);
+
+	return 0;
+}
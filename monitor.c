@@ -21,7 +21,8 @@
 #include "mdadm.h"
 #include "mdmon.h"
 #include <sys/syscall.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <signal.h>
 
 static char *array_states[] = {
@@ -41,22 +42,215 @@ static int write_attr(char *attr, int fd)
 	return write(fd, attr, strlen(attr));
 }
 
-static void add_fd(fd_set *fds, int *maxfd, int fd)
+/*
+ * The monitor waits on one epoll set holding the sysfs fds of every
+ * array.  The manager adds an array's fds before handing it over in
+ * replace_array(), and closing an fd takes it out again.  Each entry
+ * carries the fd, so that a wakeup only needs read_and_act() on the
+ * arrays owning an fd that something happened to.  fd_fired[] is
+ * sized to RLIMIT_NOFILE before the monitor starts, as the monitor
+ * must not allocate; an fd beyond it just means every array is read.
+ */
+#define MAX_EVENTS 64
+#define MAX_FIRED_FDS (1 << 20)
+static int epfd = -1;
+static unsigned char *fd_fired;
+static int fd_fired_size, all_fired;
+
+int monitor_init(void)
 {
-	struct stat st;
-	if (fd < 0)
-		return;
-	if (fstat(fd, &st) == -1) {
-		dprintf("Invalid fd %d\n", fd);
+	struct rlimit lim;
+
+	fd_fired_size = MAX_FIRED_FDS;
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 &&
+	    lim.rlim_cur < MAX_FIRED_FDS)
+		fd_fired_size = lim.rlim_cur;
+	fd_fired = xcalloc(fd_fired_size, 1);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	return epfd;
+}
+
+static void watch_fd(int fd, int member)
+{
+	struct epoll_event ev;
+
+	if (fd < 0 || member < 0)
 		return;
+	ev.events = EPOLLPRI;
+	ev.data.fd = fd;
+	/* EEXIST just means a duplicate_aa() shares the fd */
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static struct wp_latency *get_latency(struct active_array *a);
+
+/* Called by the manager, from replace_array() */
+void monitor_watch_array(struct active_array *a)
+{
+	int member = a->info.container_member;
+	struct mdinfo *mdi;
+
+	a->latency = get_latency(a);
+
+	watch_fd(a->info.state_fd, member);
+	watch_fd(a->action_fd, member);
+	watch_fd(a->sync_completed_fd, member);
+	for (mdi = a->info.devs ; mdi ; mdi = mdi->next) {
+		watch_fd(mdi->state_fd, member);
+		watch_fd(mdi->bb_fd, member);
+		watch_fd(mdi->ubb_fd, member);
 	}
-	if (st.st_nlink == 0) {
-		dprintf("fd %d was deleted\n", fd);
-		return;
+}
+
+static void note_events(struct epoll_event *events, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		int fd = events[i].data.fd;
+		struct stat st;
+
+		if (fd < fd_fired_size)
+			fd_fired[fd] = 1;
+		else
+			all_fired = 1;
+		/* A removed attribute would report an event forever */
+		if (fstat(fd, &st) == 0 && st.st_nlink == 0) {
+			dprintf("fd %d was deleted\n", fd);
+			epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+		}
 	}
-	if (fd > *maxfd)
-		*maxfd = fd;
-	FD_SET(fd, fds);
+}
+
+static void forget_events(struct epoll_event *events, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		if (events[i].data.fd < fd_fired_size)
+			fd_fired[events[i].data.fd] = 0;
+	all_fired = 0;
+}
+
+/*
+ * md holds back writes while array_state is write-pending, until we
+ * have marked the metadata dirty and set it 'active'.  For each array
+ * we keep histograms of how long that took from the wakeup which found
+ * it, and of the set_array_state() and sync_metadata() calls within.
+ * They are kept per container_member, so they outlive duplicate_aa(),
+ * and never freed.  The manager allocates them in monitor_watch_array()
+ * and hands them over in the active_array, so the monitor only counts,
+ * and the list and names are only touched by the manager.
+ * Bucket 'b' counts times under 2^b microseconds, the last one the rest.
+ */
+#define LAT_BUCKETS 24
+enum { LAT_TOTAL, LAT_SET_STATE, LAT_SYNC, LAT_STAGES };
+static char *lat_stages[] = { "total", "set_array_state", "sync_metadata" };
+
+struct wp_latency {
+	struct wp_latency *next;
+	int member;
+	char sys_name[32];
+	unsigned long count[LAT_STAGES];
+	unsigned long long max_us[LAT_STAGES];
+	unsigned long hist[LAT_STAGES][LAT_BUCKETS];
+};
+static struct wp_latency *latencies;
+static struct timespec wake_time;
+
+static unsigned long long usec_since(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000ULL +
+		now.tv_nsec / 1000 - start->tv_nsec / 1000;
+}
+
+static struct wp_latency *get_latency(struct active_array *a)
+{
+	struct wp_latency *l;
+
+	for (l = latencies; l; l = l->next)
+		if (l->member == a->info.container_member)
+			break;
+	if (!l) {
+		l = xcalloc(1, sizeof(*l));
+		l->member = a->info.container_member;
+		l->next = latencies;
+		latencies = l;
+	}
+	strcpy(l->sys_name, a->info.sys_name);
+	return l;
+}
+
+static void record_latency(struct wp_latency *l, int stage,
+			   unsigned long long us)
+{
+	int b = 0;
+
+	while (b < LAT_BUCKETS - 1 && (1ULL << b) <= us)
+		b++;
+	l->hist[stage][b]++;
+	l->count[stage]++;
+	if (us > l->max_us[stage])
+		l->max_us[stage] = us;
+}
+
+/* Called by the manager on SIGUSR2; the counts may be a little stale */
+void monitor_dump_latency(char *devnm)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct wp_latency *l;
+	FILE *f;
+	int s, b;
+
+	snprintf(path, sizeof(path), "%s/%s.latency", MDMON_DIR, devnm);
+	snprintf(tmp, sizeof(tmp), "%s/%s.latency.tmp", MDMON_DIR, devnm);
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+	fprintf(f, "write-pending latency in %s, in microseconds\n", devnm);
+	for (l = latencies; l; l = l->next)
+		for (s = 0; s < LAT_STAGES; s++) {
+			fprintf(f, "%s %s: count %lu max %llu\n", l->sys_name,
+				lat_stages[s], l->count[s], l->max_us[s]);
+			for (b = 0; b < LAT_BUCKETS; b++) {
+				if (!l->hist[s][b])
+					continue;
+				if (b < LAT_BUCKETS - 1)
+					fprintf(f, "  < %llu: %lu\n",
+						1ULL << b, l->hist[s][b]);
+				else
+					fprintf(f, "  >= %llu: %lu\n",
+						1ULL << (b - 1), l->hist[s][b]);
+			}
+		}
+	if (fclose(f) == 0)
+		rename(tmp, path);
+	else
+		unlink(tmp);
+}
+
+static int fired(int fd)
+{
+	return all_fired || (fd >= 0 && fd < fd_fired_size && fd_fired[fd]);
+}
+
+static int array_fired(struct active_array *a)
+{
+	struct mdinfo *mdi;
+
+	/* Arrays without a member number are not watched */
+	if (a->info.container_member < 0 ||
+	    fired(a->info.state_fd) || fired(a->action_fd) ||
+	    fired(a->sync_completed_fd))
+		return 1;
+	for (mdi = a->info.devs; mdi; mdi = mdi->next)
+		if (fired(mdi->state_fd) || fired(mdi->bb_fd) ||
+		    fired(mdi->ubb_fd))
+			return 1;
+	return 0;
 }
 
 static int read_attr(char *buf, int len, int fd)
@@ -400,7 +594,7 @@ static void signal_manager(void)
 
 #define ARRAY_DIRTY 1
 #define ARRAY_BUSY 2
-static int read_and_act(struct active_array *a, fd_set *fds)
+static int read_and_act(struct active_array *a)
 {
 	unsigned long long sync_completed;
 	int check_degraded = 0;
@@ -410,6 +604,8 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 	int ret = 0;
 	int count = 0;
 	struct timeval tv;
+	struct timespec ts;
+	struct wp_latency *lat = NULL;
 
 	a->next_state = bad_word;
 	a->next_action = bad_action;
@@ -442,7 +638,7 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 		    (process_dev_ubb(a, mdi) > 0)) {
 			mdi->next_state |= DS_UNBLOCK;
 		}
-		if (FD_ISSET(mdi->bb_fd, fds))
+		if (fired(mdi->bb_fd))
 			check_for_cleared_bb(a, mdi);
 	}
 
@@ -465,7 +661,11 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 		deactivate = 1;
 	}
 	if (a->curr_state == write_pending) {
+		lat = a->latency;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
 		a->container->ss->set_array_state(a, 0);
+		if (lat)
+			record_latency(lat, LAT_SET_STATE, usec_since(&ts));
 		a->next_state = active;
 		ret |= ARRAY_DIRTY;
 	}
@@ -611,7 +811,11 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 	if (sync_completed >= a->info.component_size)
 		a->last_checkpoint = 0;
 
+	if (lat)
+		clock_gettime(CLOCK_MONOTONIC, &ts);
 	a->container->ss->sync_metadata(a->container);
+	if (lat)
+		record_latency(lat, LAT_SYNC, usec_since(&ts));
 	dprintf("(%d): state:%s action:%s next(", a->info.container_member,
 		array_states[a->curr_state], sync_actions[a->curr_action]);
 
@@ -620,6 +824,8 @@ static int read_and_act(struct active_array *a, fd_set *fds)
 		dprintf_cont(" state:%s", array_states[a->next_state]);
 		write_attr(array_states[a->next_state], a->info.state_fd);
 	}
+	if (lat)
+		record_latency(lat, LAT_TOTAL, usec_since(&wake_time));
 	if (a->next_action != bad_action) {
 		write_attr(sync_actions[a->next_action], a->action_fd);
 		dprintf_cont(" action:%s", sync_actions[a->next_action]);
@@ -710,7 +916,7 @@ static void reconcile_failed(struct active_array *aa, struct mdinfo *failed)
 }
 
 #ifdef DEBUG
-static void dprint_wake_reasons(fd_set *fds)
+static void dprint_wake_reasons(struct epoll_event *events, int cnt)
 {
 	int i;
 	char proc_path[256];
@@ -719,21 +925,20 @@ static void dprint_wake_reasons(fd_set *fds)
 	int rv;
 
 	fprintf(stderr, "monitor: wake ( ");
-	for (i = 0; i < FD_SETSIZE; i++) {
-		if (FD_ISSET(i, fds)) {
-			sprintf(proc_path, "/proc/%d/fd/%d",
-				(int) getpid(), i);
-
-			rv = readlink(proc_path, link, sizeof(link) - 1);
-			if (rv < 0) {
-				fprintf(stderr, "%d:unknown ", i);
-				continue;
-			}
-			link[rv] = '\0';
-			basename = strrchr(link, '/');
-			fprintf(stderr, "%d:%s ",
-				i, basename ? ++basename : link);
+	for (i = 0; i < cnt; i++) {
+		int fd = events[i].data.fd;
+
+		sprintf(proc_path, "/proc/%d/fd/%d", (int) getpid(), fd);
+
+		rv = readlink(proc_path, link, sizeof(link) - 1);
+		if (rv < 0) {
+			fprintf(stderr, "%d:unknown ", fd);
+			continue;
 		}
+		link[rv] = '\0';
+		basename = strrchr(link, '/');
+		fprintf(stderr, "%d:%s ",
+			fd, basename ? ++basename : link);
 	}
 	fprintf(stderr, ")\n");
 }
@@ -743,16 +948,14 @@ int monitor_loop_cnt;
 
 static int wait_and_act(struct supertype *container, int nowait)
 {
-	fd_set rfds;
-	int maxfd = 0;
+	struct epoll_event events[MAX_EVENTS];
+	int nevents = 0;
 	struct active_array **aap = &container->arrays;
 	struct active_array *a, **ap;
 	int rv;
 	struct mdinfo *mdi;
 	static unsigned int dirty_arrays = ~0; /* start at some non-zero value */
 
-	FD_ZERO(&rfds);
-
 	for (ap = aap ; *ap ;) {
 		a = *ap;
 		/* once an array has been deactivated we want to
@@ -770,15 +973,6 @@ static int wait_and_act(struct supertype *container, int nowait)
 			continue;
 		}
 
-		add_fd(&rfds, &maxfd, a->info.state_fd);
-		add_fd(&rfds, &maxfd, a->action_fd);
-		add_fd(&rfds, &maxfd, a->sync_completed_fd);
-		for (mdi = a->info.devs ; mdi ; mdi = mdi->next) {
-			add_fd(&rfds, &maxfd, mdi->state_fd);
-			add_fd(&rfds, &maxfd, mdi->bb_fd);
-			add_fd(&rfds, &maxfd, mdi->ubb_fd);
-		}
-
 		ap = &(*ap)->next;
 	}
 
@@ -814,34 +1008,36 @@ static int wait_and_act(struct supertype *container, int nowait)
 
 	if (!nowait) {
 		sigset_t set;
-		struct timespec ts;
-		ts.tv_sec = 24*3600;
-		ts.tv_nsec = 0;
+		int msec = 24*3600*1000;
 		if (*aap == NULL || container->retry_soon) {
 			/* just waiting to get O_EXCL access */
-			ts.tv_sec = 0;
-			ts.tv_nsec = 20000000ULL;
+			msec = 20;
 		}
 		sigprocmask(SIG_UNBLOCK, NULL, &set);
 		sigdelset(&set, SIGUSR1);
 		monitor_loop_cnt |= 1;
-		rv = pselect(maxfd+1, NULL, NULL, &rfds, &ts, &set);
+		rv = epoll_pwait(epfd, events, MAX_EVENTS, msec, &set);
 		monitor_loop_cnt += 1;
 		if (rv == -1) {
 			if (errno == EINTR) {
 				rv = 0;
-				FD_ZERO(&rfds);
 				dprintf("monitor: caught signal\n");
 			} else
-				dprintf("monitor: error %d in pselect\n",
+				dprintf("monitor: error %d in epoll_pwait\n",
 					errno);
+		} else if (rv > 0) {
+			/* Only the arrays which fired need looking at.
+			 * Signals and timeouts still look at them all.
+			 */
+			nevents = rv;
+			note_events(events, nevents);
+			#ifdef DEBUG
+			dprint_wake_reasons(events, nevents);
+			#endif
 		}
-		#ifdef DEBUG
-		else
-			dprint_wake_reasons(&rfds);
-		#endif
 		container->retry_soon = 0;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &wake_time);
 
 	if (update_queue) {
 		struct metadata_update *this;
@@ -871,8 +1067,9 @@ static int wait_and_act(struct supertype *container, int nowait)
 			/* FIXME check if device->state_fd need to be cleared?*/
 			signal_manager();
 		}
-		if (a->container && !a->to_remove) {
-			int ret = read_and_act(a, &rfds);
+		if (a->container && !a->to_remove &&
+		    (!nevents || sigterm || a->busy || array_fired(a))) {
+			int ret = read_and_act(a);
 			rv |= 1;
 			dirty_arrays += !!(ret & ARRAY_DIRTY);
 			/* when terminating stop manipulating the array after it
@@ -881,7 +1078,9 @@ static int wait_and_act(struct supertype *container, int nowait)
 			 */
 			if (sigterm && !(ret & ARRAY_DIRTY))
 				a->container = NULL; /* stop touching this array */
-			if (ret & ARRAY_BUSY)
+			/* Retry even if only other arrays fire meanwhile */
+			a->busy = !!(ret & ARRAY_BUSY);
+			if (a->busy)
 				container->retry_soon = 1;
 		}
 	}
@@ -895,6 +1094,7 @@ static int wait_and_act(struct supertype *container, int nowait)
 				reconcile_failed(*aap, mdi);
 	}
 
+	forget_events(events, nevents);
 	return rv;
 }
 
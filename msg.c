@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -36,15 +37,13 @@ static const __u32 end_magic = 0xa5a55a5a;
 
 static int send_buf(int fd, const void* buf, int len, int tmo)
 {
-	fd_set set;
+	struct pollfd pfd;
 	int rv;
-	struct timeval timeout = {tmo, 0};
-	struct timeval *ptmo = tmo ? &timeout : NULL;
 
 	while (len) {
-		FD_ZERO(&set);
-		FD_SET(fd, &set);
-		rv = select(fd+1, NULL, &set, NULL, ptmo);
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		rv = poll(&pfd, 1, tmo ? tmo * 1000 : -1);
 		if (rv <= 0)
 			return -1;
 		rv = write(fd, buf, len);
@@ -58,15 +57,13 @@ static int send_buf(int fd, const void* buf, int len, int tmo)
 
 static int recv_buf(int fd, void* buf, int len, int tmo)
 {
-	fd_set set;
+	struct pollfd pfd;
 	int rv;
-	struct timeval timeout = {tmo, 0};
-	struct timeval *ptmo = tmo ? &timeout : NULL;
 
 	while (len) {
-		FD_ZERO(&set);
-		FD_SET(fd, &set);
-		rv = select(fd+1, &set, NULL, NULL, ptmo);
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		rv = poll(&pfd, 1, tmo ? tmo * 1000 : -1);
 		if (rv <= 0)
 			return -1;
 		rv = read(fd, buf, len);
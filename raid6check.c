@@ -25,11 +25,22 @@
 #include "mdadm.h"
 #include <stdint.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 #define CHECK_PAGE_BITS (12)
 #define CHECK_PAGE_SIZE (1 << CHECK_PAGE_BITS)
 
+/* Memory for stripes in flight through the check pipeline */
+#define CHECK_RING_BYTES (64 * 1024 * 1024)
+#define CHECK_RING_MAX 64
+#define CHECK_MAX_WORKERS 16
+/* The check threads only read and compute, so need little stack */
+#define CHECK_STACK_SIZE (128 * 1024)
+
+/* Default limit on how long a window of stripes stays suspended */
+#define CHECK_SUSPEND_MSEC 50
+
 char const Name[] = "raid6check";
 
 enum repair {
@@ -38,17 +49,24 @@ enum repair {
 	AUTO_REPAIR
 };
 
-int geo_map(int block, unsigned long long stripe, int raid_disks,
-	    int level, int layout);
-int is_ddf(int layout);
-void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size);
-void make_tables(void);
-void ensure_zero_has_size(int chunk_size);
-void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs,
-		       int neg_offset);
-void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
-		       uint8_t **ptrs, int neg_offset);
-void xor_blocks(char *target, char **sources, int disks, int size);
+/* Save the checkpoint at most this often */
+#define CHECK_CHECKPOINT_SECS 10
+
+struct check_options {
+	int window;		/* stripes suspended at once, 0 for default */
+	int max_suspend;	/* msec before the window is shrunk, 0 never */
+	int speed_max;		/* KiB/sec read from each member, 0 unlimited */
+	int iops_max;		/* reads/sec from all members, 0 unlimited */
+	int progress;		/* seconds between progress lines, 0 none */
+	char *checkpoint;	/* file recording the next stripe to check */
+	int uuid[4];		/* of the array, recorded in the checkpoint */
+	int bitmap;		/* only check 'ranges', from the bitmap */
+	struct bitmap_range *ranges;
+	int nranges;
+};
+
+/* Set by SIGTERM/SIGINT/SIGQUIT: stop after the current window */
+static volatile sig_atomic_t stop_check;
 
 /* Collect per stripe consistency information */
 void raid6_collect(int chunk_size, uint8_t *p, uint8_t *q,
@@ -57,7 +75,6 @@ void raid6_collect(int chunk_size, uint8_t *p, uint8_t *q,
 	int i;
 	int data_id;
 	uint8_t Px, Qx;
-	extern uint8_t raid6_gflog[];
 
 	for(i = 0; i < chunk_size; i++) {
 		Px = (uint8_t)chunkP[i] ^ (uint8_t)p[i];
@@ -119,32 +136,78 @@ int raid6_stats_blk(int *results, int raid_disks)
 	return curr_broken_disk;
 }
 
-/* Collect disks status for a strip in CHECK_PAGE_SIZE page size blocks */
-void raid6_stats(int *disk, int *results, int raid_disks, int chunk_size)
+/* Collect disks status for a strip in CHECK_PAGE_SIZE page size blocks.
+ * Pages whose P and Q match are almost always all there is, so compare
+ * those whole first, and only look for the broken disk byte by byte in
+ * a page which does not match.  'results' holds one page worth.
+ */
+void raid6_stats(int *disk, uint8_t *p, uint8_t *q,
+		 char *chunkP, char *chunkQ, int *results,
+		 int raid_disks, int chunk_size)
 {
 	int i, j;
 
 	for(i = 0, j = 0; i < chunk_size; i += CHECK_PAGE_SIZE, j++) {
-		disk[j] = raid6_stats_blk(&results[i], raid_disks);
+		if (memcmp(p + i, chunkP + i, CHECK_PAGE_SIZE) == 0 &&
+		    memcmp(q + i, chunkQ + i, CHECK_PAGE_SIZE) == 0) {
+			disk[j] = -255;
+			continue;
+		}
+		raid6_collect(CHECK_PAGE_SIZE, p + i, q + i,
+			      chunkP + i, chunkQ + i, results);
+		disk[j] = raid6_stats_blk(results, raid_disks);
 	}
 }
 
-int lock_stripe(struct mdinfo *info, unsigned long long start,
-		int chunk_size, int data_disks, sighandler_t *sig) {
-	int rv;
+static void stop_handler(int sig)
+{
+	stop_check = 1;
+}
+
+/* RAID5 parity can tell that a page is wrong, but not which disk is */
+void raid5_stats(int *disk, uint8_t *p, char *chunkP, int chunk_size)
+{
+	int i, j;
+
+	for(i = 0, j = 0; i < chunk_size; i += CHECK_PAGE_SIZE, j++)
+		disk[j] = memcmp(p + i, chunkP + i, CHECK_PAGE_SIZE) == 0 ?
+			-255 : -65535;
+}
+
+/* Lock memory and catch signals for the whole run, so that we cannot
+ * be swapped or killed while stripes are suspended.  A signal stops
+ * the check cleanly at the end of the current window.
+ */
+int lock_memory(sighandler_t *sig) {
 	if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
 		return 2;
 	}
 
-	sig[0] = signal(SIGTERM, SIG_IGN);
-	sig[1] = signal(SIGINT, SIG_IGN);
-	sig[2] = signal(SIGQUIT, SIG_IGN);
+	sig[0] = signal(SIGTERM, stop_handler);
+	sig[1] = signal(SIGINT, stop_handler);
+	sig[2] = signal(SIGQUIT, stop_handler);
+	return 0;
+}
+
+/* Suspend 'count' stripes from 'start'.  Raising suspend_lo first
+ * releases the previous window, which is expected to end at 'start'.
+ */
+int suspend_stripes(struct mdinfo *info, unsigned long long start,
+		    unsigned long long count, int chunk_size, int data_disks) {
+	int rv;
 
 	rv = sysfs_set_num(info, NULL, "suspend_lo", start * chunk_size * data_disks);
-	rv |= sysfs_set_num(info, NULL, "suspend_hi", (start + 1) * chunk_size * data_disks);
+	rv |= sysfs_set_num(info, NULL, "suspend_hi", (start + count) * chunk_size * data_disks);
 	return rv * 256;
 }
 
+/* Release everything below 'start', leaving nothing suspended */
+int release_stripes(struct mdinfo *info, unsigned long long start,
+		    int chunk_size, int data_disks) {
+	return sysfs_set_num(info, NULL, "suspend_lo",
+			     start * chunk_size * data_disks) * 256;
+}
+
 int unlock_all_stripes(struct mdinfo *info, sighandler_t *sig) {
 	int rv;
 	rv = sysfs_set_num(info, NULL, "suspend_lo", 0x7FFFFFFFFFFFFFFFULL);
@@ -206,10 +269,10 @@ int autorepair(int *disk, unsigned long long start, int chunk_size,
 		for(j = 0; j < (chunk_size >> CHECK_PAGE_BITS); j++) {
 			if(page_to_write[j] == 1) {
 				int slot = block_index_for_slot[disk[j]];
-				lseek64(source[slot], offsets[slot] + start * chunk_size + j * CHECK_PAGE_SIZE, SEEK_SET);
-				write_res += write(source[slot],
-						   blocks[disk[j]] + j * CHECK_PAGE_SIZE,
-						   CHECK_PAGE_SIZE);
+				write_res += pwrite(source[slot],
+						    blocks[disk[j]] + j * CHECK_PAGE_SIZE,
+						    CHECK_PAGE_SIZE,
+						    offsets[slot] + start * chunk_size + j * CHECK_PAGE_SIZE);
 			}
 		}
 
@@ -278,227 +341,681 @@ int manual_repair(int chunk_size, int syndrome_disks,
 		}
 	}
 
+	/* Readers may be busy with other stripes on the same devices,
+	 * so write at an explicit offset rather than seeking.
+	 */
 	int write_res1, write_res2;
-	off64_t seek_res;
 
-	seek_res = lseek64(source[fd1],
-			   offsets[fd1] + start * chunk_size, SEEK_SET);
-	if (seek_res < 0) {
-		fprintf(stderr, "lseek failed for failed_disk1\n");
-		return -1;
+	write_res1 = pwrite(source[fd1], blocks[failed_slot1], chunk_size,
+			    offsets[fd1] + start * chunk_size);
+	write_res2 = pwrite(source[fd2], blocks[failed_slot2], chunk_size,
+			    offsets[fd2] + start * chunk_size);
+
+	if (write_res1 != chunk_size || write_res2 != chunk_size) {
+		fprintf(stderr, "Failed to write a complete chunk.\n");
+		return -2;
 	}
-	write_res1 = write(source[fd1], blocks[failed_slot1], chunk_size);
 
-	seek_res = lseek64(source[fd2],
-			   offsets[fd2] + start * chunk_size, SEEK_SET);
-	if (seek_res < 0) {
-		fprintf(stderr, "lseek failed for failed_disk2\n");
+	return 0;
+}
+
+/*
+ * check_stripes() runs a window of stripes at a time through a
+ * pipeline: one reader thread per member reads its chunk of each
+ * stripe into a ring slot, a pool of workers computes P and Q and
+ * finds the broken disk of each page, and the main thread reports
+ * and repairs the stripes in order.  The whole window is suspended
+ * while it is in the pipeline.
+ * The threads are started once, before memory is locked, and wait
+ * for each new window: nothing is allocated while stripes are
+ * suspended.
+ * If a window stays suspended for longer than 'max_suspend' msec -
+ * because the stripes are slow to read, or foreground I/O is slow to
+ * drain when suspending - the next window is halved, and it grows
+ * back slowly while windows take less than half of that.
+ * Between windows the check is throttled to opts->speed_max and
+ * opts->iops_max, progress is reported and the checkpoint saved.
+ * With opts->bitmap, stripes outside opts->ranges are skipped.
+ */
+struct check_slot {
+	char **stripes;		/* chunks from each device, by raid_disk */
+	/* blocks[] is indexed by syndrome number and points to either
+	 * one of the chunks from 'stripes[]', or to a chunk of zeros.
+	 * -1 and -2 are P and Q
+	 */
+	char **blocks;
+	/* block_index_for_slot[] provides the reverse mapping from
+	 * blocks to stripes.  The index is a syndrome position, the
+	 * content is a raid_disk number.  indicies -1 and -2 work,
+	 * and are P and Q disks
+	 */
+	int *block_index_for_slot;
+	/* 'p' and 'q' contain calcualted P and Q, to be compared with
+	 * blocks[-1] and blocks[-2];
+	 */
+	uint8_t *p;
+	uint8_t *q;
+	int *results;		/* raid6_collect() of one mismatched page */
+	/* The syndrome number of the broken disk is recorded in
+	 * 'disk[]' which allows a different broken disk for each page.
+	 */
+	int *disk;
+	int read;		/* members read so far */
+	int read_error;		/* member which could not be read, or -1 */
+	int checked;
+};
+
+struct check_pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct stripe_map *sm;
+	int *source;
+	unsigned long long *offsets;
+	char **name;
+	int raid_disks;
+	int chunk_size;
+	char *zero;
+	struct check_slot *slots;
+	unsigned long long first;	/* first stripe of the window */
+	int count;			/* stripes in the window */
+	int next_work;			/* next slot for a worker */
+	int abort;
+	int window;			/* counts windows started */
+	int idle;			/* threads done with this window */
+	int quit;			/* no more windows */
+};
+
+struct check_reader {
+	struct check_pipeline *cp;
+	int disk;
+};
+
+/* With cp->lock held, wait for the window after 'window'.
+ * Returns 0 when there will be no more.
+ */
+static int wait_window(struct check_pipeline *cp, int *window)
+{
+	while (cp->window == *window && !cp->quit)
+		pthread_cond_wait(&cp->cond, &cp->lock);
+	*window = cp->window;
+	return !cp->quit;
+}
+
+/* With cp->lock held, report that this thread is done with the window */
+static void window_done(struct check_pipeline *cp)
+{
+	cp->idle++;
+	pthread_cond_broadcast(&cp->cond);
+}
+
+static void read_window(struct check_reader *cr)
+{
+	struct check_pipeline *cp = cr->cp;
+	int chunk_size = cp->chunk_size;
+	int disk = cr->disk;
+	int k;
+
+	for (k = 0; k < cp->count && !cp->abort; k++) {
+		struct check_slot *cs = &cp->slots[k];
+		off_t offset = cp->offsets[disk] + (cp->first + k) * chunk_size;
+		ssize_t read_res = pread(cp->source[disk], cs->stripes[disk],
+					 chunk_size, offset);
+
+		if (read_res < 0 && direct_io_fallback(cp->source[disk])) {
+			fprintf(stderr, "%s does not support O_DIRECT, using buffered reads\n",
+				cp->name[disk]);
+			read_res = pread(cp->source[disk], cs->stripes[disk],
+					 chunk_size, offset);
+		}
+		if (read_res == chunk_size)
+			drop_cache(cp->source[disk], offset, chunk_size);
+
+		pthread_mutex_lock(&cp->lock);
+		if (read_res < chunk_size && cs->read_error < 0)
+			cs->read_error = disk;
+		if (++cs->read == cp->raid_disks)
+			pthread_cond_broadcast(&cp->cond);
+		pthread_mutex_unlock(&cp->lock);
+	}
+}
+
+static void *check_reader(void *v)
+{
+	struct check_reader *cr = v;
+	struct check_pipeline *cp = cr->cp;
+	int window = 0;
+
+	pthread_mutex_lock(&cp->lock);
+	while (wait_window(cp, &window)) {
+		pthread_mutex_unlock(&cp->lock);
+		read_window(cr);
+		pthread_mutex_lock(&cp->lock);
+		window_done(cp);
+	}
+	pthread_mutex_unlock(&cp->lock);
+	return NULL;
+}
+
+static void check_slot(struct check_pipeline *cp, struct check_slot *cs,
+		       unsigned long long stripe)
+{
+	struct stripe_layout *sl = stripe_layout(cp->sm, stripe);
+	int syndrome_disks = cp->sm->syndrome_disks;
+	int chunk_size = cp->chunk_size;
+	int i;
+
+	cs->block_index_for_slot[-1] = sl->pdisk;
+	cs->blocks[-1] = cs->stripes[sl->pdisk];
+	cs->block_index_for_slot[-2] = sl->qdisk;
+	cs->blocks[-2] = sl->qdisk < 0 ? NULL : cs->stripes[sl->qdisk];
+
+	/* The syndrome-order of disks starts immediately after 'Q'
+	 * but skips P, or for DDF exactly follows raid-disk numbers
+	 * with ZERO in place of P and Q.
+	 */
+	for (i = 0 ; i < syndrome_disks ; i++) {
+		int d = sl->slot[i];
+		cs->blocks[i] = d < 0 ? cp->zero : cs->stripes[d];
+		cs->block_index_for_slot[i] = d;
+	}
+
+	if (cp->sm->level == 5) {
+		xor_blocks((char*)cs->p, cs->blocks, syndrome_disks, chunk_size);
+		raid5_stats(cs->disk, cs->p, cs->blocks[-1], chunk_size);
+		return;
+	}
+
+	qsyndrome(cs->p, cs->q, (uint8_t**)cs->blocks, syndrome_disks, chunk_size);
+
+	raid6_stats(cs->disk, cs->p, cs->q, cs->blocks[-1], cs->blocks[-2],
+		    cs->results, cp->raid_disks, chunk_size);
+}
+
+static void *check_worker(void *v)
+{
+	struct check_pipeline *cp = v;
+	int window = 0;
+
+	pthread_mutex_lock(&cp->lock);
+	while (wait_window(cp, &window)) {
+		while (!cp->abort && cp->next_work < cp->count) {
+			int k = cp->next_work++;
+			struct check_slot *cs = &cp->slots[k];
+
+			while (!cp->abort && cs->read < cp->raid_disks)
+				pthread_cond_wait(&cp->cond, &cp->lock);
+			if (cp->abort)
+				break;
+			pthread_mutex_unlock(&cp->lock);
+
+			if (cs->read_error < 0)
+				check_slot(cp, cs, cp->first + k);
+
+			pthread_mutex_lock(&cp->lock);
+			cs->checked = 1;
+			pthread_cond_broadcast(&cp->cond);
+		}
+		window_done(cp);
+	}
+	pthread_mutex_unlock(&cp->lock);
+	return NULL;
+}
+
+/* The checkpoint records the next stripe to check and the end of
+ * the check, together with the array UUID and geometry so that it
+ * cannot be used on a different array.  It is replaced atomically.
+ */
+int write_checkpoint(char *file, unsigned long long next,
+		     unsigned long long end, int raid_disks,
+		     int chunk_size, int layout, int uuid[4])
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	int rv = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	f = fopen(tmp, "w");
+	if (!f)
 		return -1;
+	fprintf(f, "next=%llu end=%llu disks=%d chunk=%d layout=%d uuid=%08x:%08x:%08x:%08x\n",
+		next, end, raid_disks, chunk_size, layout,
+		uuid[0], uuid[1], uuid[2], uuid[3]);
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+		rv = -1;
+	if (fclose(f) != 0)
+		rv = -1;
+	if (rv == 0 && rename(tmp, file) != 0)
+		rv = -1;
+	if (rv != 0) {
+		fprintf(stderr, "Failed to write checkpoint %s\n", file);
+		unlink(tmp);
 	}
-	write_res2 = write(source[fd2], blocks[failed_slot2], chunk_size);
+	return rv;
+}
 
-	if (write_res1 != chunk_size || write_res2 != chunk_size) {
-		fprintf(stderr, "Failed to write a complete chunk.\n");
+int read_checkpoint(char *file, unsigned long long *next,
+		    unsigned long long *end, int raid_disks,
+		    int chunk_size, int layout, int uuid[4])
+{
+	FILE *f = fopen(file, "r");
+	int disks, chunk, lay;
+	unsigned int id[4];
+	int n;
+
+	if (!f)
+		return -1;
+	n = fscanf(f, "next=%llu end=%llu disks=%d chunk=%d layout=%d uuid=%x:%x:%x:%x",
+		   next, end, &disks, &chunk, &lay,
+		   &id[0], &id[1], &id[2], &id[3]);
+	fclose(f);
+	if (n != 9 || disks != raid_disks || chunk != chunk_size ||
+	    lay != layout || *next > *end ||
+	    memcmp(id, uuid, sizeof(id)) != 0)
 		return -2;
+	return 0;
+}
+
+/* The array UUID, to tell apart the checkpoints of different arrays.
+ * The map file has it for anything mdadm started, else ask the
+ * superblock of a member.
+ */
+int get_array_uuid(char *devnm, int *fds, int raid_disks, int uuid[4])
+{
+	struct map_ent *map = NULL, *me;
+	int i;
+
+	me = map_by_devnm(&map, devnm);
+	if (me)
+		memcpy(uuid, me->uuid, 4 * sizeof(int));
+	map_free(map);
+	if (me)
+		return 0;
+
+	for (i = 0; i < raid_disks; i++) {
+		struct supertype *st = guess_super(fds[i]);
+		int rv;
+
+		if (!st)
+			continue;
+		rv = st->ss->load_super(st, fds[i], NULL);
+		if (rv == 0) {
+			st->ss->uuid_from_super(st, uuid);
+			st->ss->free_super(st);
+		}
+		free(st);
+		if (rv == 0)
+			return 0;
 	}
+	return -1;
+}
 
-	return 0;
+static void print_progress(unsigned long long stripe, unsigned long long end,
+			   unsigned long long done, int raid_disks,
+			   int chunk_size, long long msec)
+{
+	double secs = msec / 1000.0;
+	double rate = secs > 0 ? done / secs : 0;
+	unsigned long long eta = rate > 0 ? (end - stripe) / rate : 0;
+
+	fprintf(stderr, "Checked stripe %llu of %llu, %.1f MB/s, ETA %llu:%02llu:%02llu\n",
+		stripe, end,
+		rate * chunk_size * raid_disks / (1024 * 1024),
+		eta / 3600, (eta / 60) % 60, eta % 60);
+}
+
+static long long elapsed_msec(struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000LL +
+		(now.tv_nsec - since->tv_nsec) / 1000000;
 }
 
 int check_stripes(struct mdinfo *info, int *source, unsigned long long *offsets,
 		  int raid_disks, int chunk_size, int level, int layout,
 		  unsigned long long start, unsigned long long length, char *name[],
-		  enum repair repair, int failed_disk1, int failed_disk2)
+		  enum repair repair, int failed_disk1, int failed_disk2,
+		  struct check_options *opts)
 {
 	/* read the data and p and q blocks, and check we got them right */
-	int data_disks = raid_disks - 2;
-	int syndrome_disks = data_disks + is_ddf(layout) * 2;
+	struct stripe_map *sm = stripe_map_get(level, layout, raid_disks);
+	int data_disks = sm ? sm->data_disks : raid_disks - 2;
+	int syndrome_disks = sm ? sm->syndrome_disks : data_disks;
+	int pages = chunk_size >> CHECK_PAGE_BITS;
+	struct check_pipeline cp;
+	struct check_reader *readers;
+	pthread_t *reader_threads, *worker_threads;
+	pthread_attr_t attr;
+	int nslots, nworkers;
+	int started_readers = 0, started_workers = 0;
 	char *stripe_buf;
 
-	/* stripes[] is indexed by raid_disk and holds chunks from each device */
-	char **stripes = xmalloc(raid_disks * sizeof(char*));
-
-	/* blocks[] is indexed by syndrome number and points to either one of the
-	 * chunks from 'stripes[]', or to a chunk of zeros. -1 and -2 are
-	 * P and Q */
-	char **blocks = xmalloc((syndrome_disks + 2) * sizeof(char*));
-
 	/* blocks_page[] is a temporary index to just one page of the chunks
 	 * that blocks[] points to. */
 	char **blocks_page = xmalloc((syndrome_disks + 2) * sizeof(char*));
 
-	/* block_index_for_slot[] provides the reverse mapping from blocks to stripes.
-	 * The index is a syndrome position, the content is a raid_disk number.
-	 * indicies -1 and -2 work, and are P and Q disks */
-	int *block_index_for_slot = xmalloc((syndrome_disks+2) * sizeof(int));
-
-	/* 'p' and 'q' contain calcualted P and Q, to be compared with
-	 * blocks[-1] and blocks[-2];
-	 */
-	uint8_t *p = xmalloc(chunk_size);
-	uint8_t *q = xmalloc(chunk_size);
-	char *zero = xmalloc(chunk_size);
-	int *results = xmalloc(chunk_size * sizeof(int));
 	sighandler_t *sig = xmalloc(3 * sizeof(sighandler_t));
 
-	int i, j;
-	int diskP, diskQ, diskD;
+	int i, j, k;
 	int err = 0;
+	int window = opts->window;
+	unsigned long long end = start + length;
+	unsigned long long done = 0;
+	struct timespec began;
+	long long last_progress = 0, last_checkpoint = 0;
+	long long msec, want;
+	int report, save;
+	int range = 0;
+
+	if (!sm) {
+		fprintf(stderr, "Unsupported layout %d\n", layout);
+		exit(4);
+	}
 
-	extern int tables_ready;
-
-	if (!tables_ready)
-		make_tables();
-
-	if (posix_memalign((void**)&stripe_buf, 4096, raid_disks * chunk_size) != 0)
+	nslots = CHECK_RING_BYTES / ((raid_disks + 2) * chunk_size);
+	if (nslots > CHECK_RING_MAX)
+		nslots = CHECK_RING_MAX;
+	if (opts->window > 0 && opts->window < nslots)
+		nslots = opts->window;
+	if ((unsigned long long)nslots > length)
+		nslots = length;
+	if (nslots < 1)
+		nslots = 1;
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers > CHECK_MAX_WORKERS)
+		nworkers = CHECK_MAX_WORKERS;
+	if (nworkers > nslots)
+		nworkers = nslots;
+	if (nworkers < 1)
+		nworkers = 1;
+
+	if (posix_memalign((void**)&stripe_buf, 4096,
+			   (size_t)nslots * raid_disks * chunk_size) != 0)
 		exit(4);
-	block_index_for_slot += 2;
-	blocks += 2;
+	memset(&cp, 0, sizeof(cp));
+	pthread_mutex_init(&cp.lock, NULL);
+	pthread_cond_init(&cp.cond, NULL);
+	cp.sm = sm;
+	cp.source = source;
+	cp.offsets = offsets;
+	cp.name = name;
+	cp.raid_disks = raid_disks;
+	cp.chunk_size = chunk_size;
+	cp.zero = xcalloc(1, chunk_size);
+	cp.slots = xcalloc(nslots, sizeof(*cp.slots));
+	for (k = 0; k < nslots; k++) {
+		struct check_slot *cs = &cp.slots[k];
+
+		cs->stripes = xmalloc(raid_disks * sizeof(char*));
+		for (i = 0 ; i < raid_disks ; i++)
+			cs->stripes[i] = stripe_buf +
+				((size_t)k * raid_disks + i) * chunk_size;
+		cs->blocks = xmalloc((syndrome_disks + 2) * sizeof(char*));
+		cs->blocks += 2;
+		cs->block_index_for_slot = xmalloc((syndrome_disks+2) * sizeof(int));
+		cs->block_index_for_slot += 2;
+		cs->p = xmalloc(chunk_size);
+		cs->q = xmalloc(chunk_size);
+		cs->results = xmalloc(CHECK_PAGE_SIZE * sizeof(int));
+		cs->disk = xmalloc(pages * sizeof(int));
+	}
+	readers = xmalloc(raid_disks * sizeof(*readers));
+	reader_threads = xmalloc(raid_disks * sizeof(pthread_t));
+	worker_threads = xmalloc(nworkers * sizeof(pthread_t));
 	blocks_page += 2;
+	window = nslots;
+	if (repair == MANUAL_REPAIR)
+		ensure_zero_has_size(chunk_size);
 
-	memset(zero, 0, chunk_size);
-	for ( i = 0 ; i < raid_disks ; i++)
-		stripes[i] = stripe_buf + i * chunk_size;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, CHECK_STACK_SIZE);
+	for (i = 0; i < raid_disks; i++) {
+		readers[i].cp = &cp;
+		readers[i].disk = i;
+		if (pthread_create(&reader_threads[i], &attr,
+				   check_reader, &readers[i]) != 0)
+			break;
+		started_readers++;
+	}
+	for (i = 0; i < nworkers && started_readers == raid_disks; i++) {
+		if (pthread_create(&worker_threads[i], &attr,
+				   check_worker, &cp) != 0)
+			break;
+		started_workers++;
+	}
+	pthread_attr_destroy(&attr);
+	if (started_readers < raid_disks || started_workers == 0) {
+		fprintf(stderr, "Failed to start check threads\n");
+		err = -1;
+		goto exitCheck;
+	}
 
-	while (length > 0) {
-		/* The syndrome number of the broken disk is recorded
-		 * in 'disk[]' which allows a different broken disk for
-		 * each page.
-		 */
-		int disk[chunk_size >> CHECK_PAGE_BITS];
+	err = lock_memory(sig);
+	if (err != 0)
+		goto exitCheck;
+	clock_gettime(CLOCK_MONOTONIC, &began);
+
+	while (length > 0 && !stop_check) {
+		int count = window;
+		struct timespec suspended;
+
+		if (opts->bitmap) {
+			/* Skip to the next stripes the bitmap marks dirty */
+			unsigned long long rs, re = 0;
+
+			while (range < opts->nranges &&
+			       (re = (opts->ranges[range].end + chunk_size - 1)
+				/ chunk_size) <= start)
+				range++;
+			rs = range < opts->nranges ?
+				opts->ranges[range].start / chunk_size : end;
+			if (rs > start) {
+				if (rs - start >= length)
+					rs = start + length;
+				length -= rs - start;
+				start = rs;
+				if (length == 0)
+					break;
+			}
+			if ((unsigned long long)count > re - start)
+				count = re - start;
+		}
+		if ((unsigned long long)count > length)
+			count = length;
 
-		err = lock_stripe(info, start, chunk_size, data_disks, sig);
+		clock_gettime(CLOCK_MONOTONIC, &suspended);
+		err = suspend_stripes(info, start, count, chunk_size, data_disks);
 		if(err != 0) {
-			if (err != 2)
-				unlock_all_stripes(info, sig);
+			unlock_all_stripes(info, sig);
 			goto exitCheck;
 		}
-		for (i = 0 ; i < raid_disks ; i++) {
-			off64_t seek_res = lseek64(source[i], offsets[i] + start * chunk_size,
-						   SEEK_SET);
-			if (seek_res < 0) {
-				fprintf(stderr, "lseek to source %d failed\n", i);
-				unlock_all_stripes(info, sig);
+
+		pthread_mutex_lock(&cp.lock);
+		cp.first = start;
+		cp.count = count;
+		cp.next_work = 0;
+		cp.abort = 0;
+		cp.idle = 0;
+		for (k = 0; k < count; k++) {
+			cp.slots[k].read = 0;
+			cp.slots[k].read_error = -1;
+			cp.slots[k].checked = 0;
+		}
+		cp.window++;
+		pthread_cond_broadcast(&cp.cond);
+		pthread_mutex_unlock(&cp.lock);
+
+		/* Report and repair in stripe order */
+		for (k = 0; k < count && err == 0; k++) {
+			struct check_slot *cs = &cp.slots[k];
+			int *disk = cs->disk;
+
+			pthread_mutex_lock(&cp.lock);
+			while (!cs->checked)
+				pthread_cond_wait(&cp.cond, &cp.lock);
+			pthread_mutex_unlock(&cp.lock);
+
+			if (cs->read_error >= 0) {
+				fprintf(stderr, "Failed to read complete chunk disk %d, aborting\n",
+					cs->read_error);
 				err = -1;
-				goto exitCheck;
+				break;
 			}
-			int read_res = read(source[i], stripes[i], chunk_size);
-			if (read_res < chunk_size) {
-				fprintf(stderr, "Failed to read complete chunk disk %d, aborting\n", i);
-				unlock_all_stripes(info, sig);
-				err = -1;
-				goto exitCheck;
+
+			for(j = 0; j < pages; j++) {
+				int role = disk[j];
+				if (role >= -2) {
+					int slot = cs->block_index_for_slot[role];
+					if (slot >= 0)
+						printf("Error detected at stripe %llu, page %d: possible failed disk slot %d: %d --> %s\n",
+						       start, j, role, slot, name[slot]);
+					else
+						printf("Error detected at stripe %llu, page %d: failed slot %d should be zeros\n",
+						       start, j, role);
+				} else if(disk[j] == -65535) {
+					printf("Error detected at stripe %llu, page %d: disk slot unknown\n", start, j);
+				}
 			}
-		}
 
-		diskP = geo_map(-1, start, raid_disks, level, layout);
-		block_index_for_slot[-1] = diskP;
-		blocks[-1] = stripes[diskP];
-
-		diskQ = geo_map(-2, start, raid_disks, level, layout);
-		block_index_for_slot[-2] = diskQ;
-		blocks[-2] = stripes[diskQ];
-
-		if (!is_ddf(layout)) {
-			/* The syndrome-order of disks starts immediately after 'Q',
-			 * but skips P */
-			diskD = diskQ;
-			for (i = 0 ; i < data_disks ; i++) {
-				diskD = diskD + 1;
-				if (diskD >= raid_disks)
-					diskD = 0;
-				if (diskD == diskP)
-					diskD += 1;
-				if (diskD >= raid_disks)
-					diskD = 0;
-				blocks[i] = stripes[diskD];
-				block_index_for_slot[i] = diskD;
+			if(repair == AUTO_REPAIR) {
+				err = autorepair(disk, start, chunk_size,
+						 name, raid_disks, syndrome_disks, blocks_page,
+						 cs->blocks, cs->p, cs->block_index_for_slot,
+						 source, offsets);
+				if(err != 0)
+					break;
 			}
-		} else {
-			/* The syndrome-order exactly follows raid-disk
-			 * numbers, with ZERO in place of P and Q
-			 */
-			for (i = 0 ; i < raid_disks; i++) {
-				if (i == diskP || i == diskQ) {
-					blocks[i] = zero;
-					block_index_for_slot[i] = -1;
-				} else {
-					blocks[i] = stripes[i];
-					block_index_for_slot[i] = i;
+
+			if(repair == MANUAL_REPAIR) {
+				int failed_slot1 = -1, failed_slot2 = -1;
+				for (i = -2; i < syndrome_disks; i++) {
+					if (cs->block_index_for_slot[i] == failed_disk1)
+						failed_slot1 = i;
+					if (cs->block_index_for_slot[i] == failed_disk2)
+						failed_slot2 = i;
 				}
+				err = manual_repair(chunk_size, syndrome_disks,
+						    failed_slot1, failed_slot2,
+						    start, cs->block_index_for_slot,
+						    name, cs->stripes, cs->blocks, cs->p,
+						    source, offsets);
+				if(err != 0)
+					break;
 			}
-		}
 
-		qsyndrome(p, q, (uint8_t**)blocks, syndrome_disks, chunk_size);
+			length--;
+			start++;
+		}
 
-		raid6_collect(chunk_size, p, q, stripes[diskP], stripes[diskQ], results);
-		raid6_stats(disk, results, raid_disks, chunk_size);
+		/* Wait until no thread is using the slots */
+		pthread_mutex_lock(&cp.lock);
+		cp.abort = 1;
+		pthread_cond_broadcast(&cp.cond);
+		while (cp.idle < started_readers + started_workers)
+			pthread_cond_wait(&cp.cond, &cp.lock);
+		pthread_mutex_unlock(&cp.lock);
 
-		for(j = 0; j < (chunk_size >> CHECK_PAGE_BITS); j++) {
-			int role = disk[j];
-			if (role >= -2) {
-				int slot = block_index_for_slot[role];
-				if (slot >= 0)
-					printf("Error detected at stripe %llu, page %d: possible failed disk slot %d: %d --> %s\n",
-					       start, j, role, slot, name[slot]);
-				else
-					printf("Error detected at stripe %llu, page %d: failed slot %d should be zeros\n",
-					       start, j, role);
-			} else if(disk[j] == -65535) {
-				printf("Error detected at stripe %llu, page %d: disk slot unknown\n", start, j);
-			}
+		if (err != 0) {
+			unlock_all_stripes(info, sig);
+			goto exitCheck;
 		}
 
-		if(repair == AUTO_REPAIR) {
-			err = autorepair(disk, start, chunk_size,
-					name, raid_disks, syndrome_disks, blocks_page,
-					blocks, p, block_index_for_slot,
-					source, offsets);
-			if(err != 0) {
-				unlock_all_stripes(info, sig);
-				goto exitCheck;
-			}
-		}
+		if (opts->max_suspend > 0) {
+			long long msec = elapsed_msec(&suspended);
 
-		if(repair == MANUAL_REPAIR) {
-			int failed_slot1 = -1, failed_slot2 = -1;
-			for (i = -2; i < syndrome_disks; i++) {
-				if (block_index_for_slot[i] == failed_disk1)
-					failed_slot1 = i;
-				if (block_index_for_slot[i] == failed_disk2)
-					failed_slot2 = i;
-			}
-			err = manual_repair(chunk_size, syndrome_disks,
-					    failed_slot1, failed_slot2,
-					    start, block_index_for_slot,
-					    name, stripes, blocks, p,
-					    source, offsets);
-			if(err == -1) {
-				unlock_all_stripes(info, sig);
-				goto exitCheck;
-			}
+			if (msec > opts->max_suspend && window > 1)
+				window /= 2;
+			else if (msec < opts->max_suspend / 2 && window < nslots)
+				window += window / 4 + 1;
+			if (window > nslots)
+				window = nslots;
 		}
 
-		err = unlock_all_stripes(info, sig);
-		if(err != 0) {
+		done += count;
+		msec = elapsed_msec(&began);
+		want = 0;
+		if (opts->speed_max > 0)
+			/* Like sync_speed_max */
+			want = done * (chunk_size / 1024) * 1000 /
+				opts->speed_max;
+		if (opts->iops_max > 0 &&
+		    (long long)(done * raid_disks * 1000 / opts->iops_max) > want)
+			want = done * raid_disks * 1000 / opts->iops_max;
+		report = opts->progress > 0 &&
+			msec - last_progress >= opts->progress * 1000LL;
+		save = opts->checkpoint &&
+			msec - last_checkpoint >= CHECK_CHECKPOINT_SECS * 1000LL;
+		if (want <= msec && !report && !save)
+			continue;
+
+		/* Sleeping, writing to the terminal and writing the
+		 * checkpoint - which may live on this very array - must
+		 * all happen with nothing suspended.
+		 */
+		err = release_stripes(info, start, chunk_size, data_disks);
+		if (err != 0) {
+			unlock_all_stripes(info, sig);
 			goto exitCheck;
 		}
+		if (want > msec) {
+			struct timespec ts;
 
-		length--;
-		start++;
+			ts.tv_sec = (want - msec) / 1000;
+			ts.tv_nsec = ((want - msec) % 1000) * 1000000;
+			nanosleep(&ts, NULL);
+		}
+		if (report) {
+			last_progress = elapsed_msec(&began);
+			print_progress(start, end, done, raid_disks, chunk_size,
+				       last_progress);
+		}
+		if (save) {
+			last_checkpoint = elapsed_msec(&began);
+			write_checkpoint(opts->checkpoint, start, end,
+					 raid_disks, chunk_size, layout,
+					 opts->uuid);
+		}
 	}
 
-exitCheck:
+	err = unlock_all_stripes(info, sig);
+	if (opts->checkpoint)
+		write_checkpoint(opts->checkpoint, start, end,
+				 raid_disks, chunk_size, layout, opts->uuid);
+	if (stop_check && length > 0)
+		fprintf(stderr, "Stopped before stripe %llu\n", start);
 
+exitCheck:
+	pthread_mutex_lock(&cp.lock);
+	cp.quit = 1;
+	pthread_cond_broadcast(&cp.cond);
+	pthread_mutex_unlock(&cp.lock);
+	for (i = 0; i < started_readers; i++)
+		pthread_join(reader_threads[i], NULL);
+	for (i = 0; i < started_workers; i++)
+		pthread_join(worker_threads[i], NULL);
+
+	for (k = 0; k < nslots; k++) {
+		struct check_slot *cs = &cp.slots[k];
+
+		free(cs->stripes);
+		free(cs->blocks-2);
+		free(cs->block_index_for_slot-2);
+		free(cs->p);
+		free(cs->q);
+		free(cs->results);
+		free(cs->disk);
+	}
+	free(cp.slots);
+	free(cp.zero);
 	free(stripe_buf);
-	free(stripes);
-	free(blocks-2);
+	free(readers);
+	free(reader_threads);
+	free(worker_threads);
 	free(blocks_page-2);
-	free(block_index_for_slot-2);
-	free(p);
-	free(q);
-	free(results);
 	free(sig);
+	pthread_cond_destroy(&cp.cond);
+	pthread_mutex_destroy(&cp.lock);
 
 	return err;
 }
@@ -525,7 +1042,7 @@ int main(int argc, char *argv[])
 	int active_disks;
 	int chunk_size = 0;
 	int layout = -1;
-	int level = 6;
+	int level;
 	enum repair repair = NO_REPAIR;
 	int failed_disk1 = -1;
 	int failed_disk2 = -1;
@@ -536,6 +1053,11 @@ int main(int argc, char *argv[])
 	char *err = NULL;
 	int exit_err = 0;
 	int close_flag = 0;
+	struct check_options opts = {
+		.max_suspend = CHECK_SUSPEND_MSEC,
+	};
+	int resume = 0;
+	char *bitmap_file = NULL;
 	char *prg = strrchr(argv[0], '/');
 
 	if (prg == NULL)
@@ -543,9 +1065,64 @@ int main(int argc, char *argv[])
 	else
 		prg++;
 
-	if (argc < 4) {
-		fprintf(stderr, "Usage: %s md_device start_stripe length_stripes [autorepair]\n", prg);
-		fprintf(stderr, "   or: %s md_device repair stripe failed_slot_1 failed_slot_2\n", prg);
+	/* Options may appear anywhere, and are removed from argv */
+	for (i = 1; i < argc; ) {
+		if (strncmp(argv[i], "--window=", 9) == 0)
+			opts.window = getnum(argv[i] + 9, &err);
+		else if (strncmp(argv[i], "--max-suspend=", 14) == 0)
+			opts.max_suspend = getnum(argv[i] + 14, &err);
+		else if (strncmp(argv[i], "--speed-max=", 12) == 0)
+			opts.speed_max = getnum(argv[i] + 12, &err);
+		else if (strncmp(argv[i], "--iops-max=", 11) == 0)
+			opts.iops_max = getnum(argv[i] + 11, &err);
+		else if (strcmp(argv[i], "--progress") == 0)
+			opts.progress = 10;
+		else if (strncmp(argv[i], "--progress=", 11) == 0)
+			opts.progress = getnum(argv[i] + 11, &err);
+		else if (strncmp(argv[i], "--checkpoint=", 13) == 0)
+			opts.checkpoint = argv[i] + 13;
+		else if (strcmp(argv[i], "--resume") == 0)
+			resume = 1;
+		else if (strcmp(argv[i], "--bitmap") == 0)
+			opts.bitmap = 1;
+		else if (strncmp(argv[i], "--bitmap=", 9) == 0) {
+			opts.bitmap = 1;
+			bitmap_file = argv[i] + 9;
+		}
+		else {
+			i++;
+			continue;
+		}
+		memmove(&argv[i], &argv[i+1], (argc - i) * sizeof(argv[0]));
+		argc--;
+	}
+
+	if (argc < (resume ? 2 : 4)) {
+		fprintf(stderr, "Usage: %s [options] md_device start_stripe length_stripes [autorepair]\n", prg);
+		fprintf(stderr, "   or: %s [options] --resume md_device [autorepair]\n", prg);
+		fprintf(stderr, "   or: %s [options] md_device repair stripe failed_slot_1 failed_slot_2\n", prg);
+		fprintf(stderr, "Options: --window=stripes       suspend and check this many stripes at once\n");
+		fprintf(stderr, "         --max-suspend=msec     shrink the window if it is suspended for longer\n");
+		fprintf(stderr, "         --speed-max=KiB/sec    limit the rate of reading each device\n");
+		fprintf(stderr, "         --iops-max=reads/sec   limit the rate of reads from all devices\n");
+		fprintf(stderr, "         --progress[=secs]      report progress every 'secs' seconds\n");
+		fprintf(stderr, "         --checkpoint=file      record progress in 'file'\n");
+		fprintf(stderr, "         --resume               continue from the checkpoint\n");
+		fprintf(stderr, "         --bitmap[=file]        only check regions dirty in the bitmap\n");
+		exit_err = 1;
+		goto exitHere;
+	}
+
+	/* The range to check comes from the checkpoint */
+	if (resume && (argc > 3 ||
+		       (argc == 3 && strcmp(argv[2], "autorepair") != 0))) {
+		fprintf(stderr, "%s: --resume takes the stripes to check from the checkpoint\n",
+			prg);
+		exit_err = 1;
+		goto exitHere;
+	}
+	if (resume && !opts.checkpoint) {
+		fprintf(stderr, "%s: --resume needs --checkpoint\n", prg);
 		exit_err = 1;
 		goto exitHere;
 	}
@@ -575,8 +1152,9 @@ int main(int argc, char *argv[])
 		goto exitHere;
 	}
 
-	if(info->array.level != level) {
-		fprintf(stderr, "%s: %s not a RAID-6\n", prg, argv[1]);
+	level = info->array.level;
+	if(level != 5 && level != 6) {
+		fprintf(stderr, "%s: %s not a RAID-5 or RAID-6\n", prg, argv[1]);
 		exit_err = 3;
 		goto exitHere;
 	}
@@ -611,12 +1189,29 @@ int main(int argc, char *argv[])
 	raid_disks = info->array.raid_disks;
 	chunk_size = info->array.chunk_size;
 	layout = info->array.layout;
-	if (strcmp(argv[2], "repair")==0) {
+	if (resume) {
+		/* start and length are set from the checkpoint below */
+		start = length = 0;
+		if (argc == 3) {
+			if (level != 6) {
+				fprintf(stderr, "%s: repair needs a RAID-6\n", prg);
+				exit_err = 3;
+				goto exitHere;
+			}
+			repair = AUTO_REPAIR;
+		}
+	}
+	else if (strcmp(argv[2], "repair")==0) {
 		if (argc < 6) {
 			fprintf(stderr, "For repair mode, call %s md_device repair stripe failed_slot_1 failed_slot_2\n", prg);
 			exit_err = 1;
 			goto exitHere;
 		}
+		if (level != 6) {
+			fprintf(stderr, "%s: repair needs a RAID-6\n", prg);
+			exit_err = 3;
+			goto exitHere;
+		}
 		repair = MANUAL_REPAIR;
 		start = getnum(argv[3], &err);
 		length = 1;
@@ -642,8 +1237,14 @@ int main(int argc, char *argv[])
 	else {
 		start = getnum(argv[2], &err);
 		length = getnum(argv[3], &err);
-		if (argc >= 5 && strcmp(argv[4], "autorepair")==0)
+		if (argc >= 5 && strcmp(argv[4], "autorepair")==0) {
+			if (level != 6) {
+				fprintf(stderr, "%s: repair needs a RAID-6\n", prg);
+				exit_err = 3;
+				goto exitHere;
+			}
 			repair = AUTO_REPAIR;
+		}
 	}
 
 	if (err) {
@@ -679,6 +1280,14 @@ int main(int argc, char *argv[])
 			disk_name[disk_slot] = map_dev(comp->disk.major, comp->disk.minor, 0);
 			offsets[disk_slot] = comp->data_offset * 512;
 			fds[disk_slot] = open(disk_name[disk_slot], O_RDWR | O_DIRECT);
+			if (fds[disk_slot] < 0 && errno == EINVAL) {
+				/* No direct I/O: reads will be dropped
+				 * from the page cache instead.
+				 */
+				fprintf(stderr, "%s: %s does not support O_DIRECT, using buffered reads\n",
+					prg, disk_name[disk_slot]);
+				fds[disk_slot] = open(disk_name[disk_slot], O_RDWR);
+			}
 			if (fds[disk_slot] < 0) {
 				perror(disk_name[disk_slot]);
 				fprintf(stderr,"%s: cannot open %s\n", prg, disk_name[disk_slot]);
@@ -690,9 +1299,71 @@ int main(int argc, char *argv[])
 		comp = comp->next;
 	}
 
+	if (opts.checkpoint &&
+	    get_array_uuid(info->sys_name, fds, raid_disks, opts.uuid) != 0) {
+		fprintf(stderr, "%s: cannot find the UUID of %s for the checkpoint\n",
+			prg, argv[1]);
+		exit_err = 10;
+		goto exitHere;
+	}
+
+	if (resume) {
+		unsigned long long next, end;
+
+		switch (read_checkpoint(opts.checkpoint, &next, &end,
+					raid_disks, chunk_size, layout,
+					opts.uuid)) {
+		case -1:
+			fprintf(stderr, "%s: cannot read checkpoint %s\n",
+				prg, opts.checkpoint);
+			exit_err = 10;
+			goto exitHere;
+		case -2:
+			fprintf(stderr, "%s: checkpoint %s does not match %s\n",
+				prg, opts.checkpoint, argv[1]);
+			exit_err = 10;
+			goto exitHere;
+		}
+		if (next == end) {
+			printf("Check already complete\n");
+			goto exitHere;
+		}
+		printf("Resuming at stripe %llu\n\n", next);
+		start = next;
+		length = end - next;
+	}
+
+	if (opts.bitmap) {
+		int n = 0;
+
+		/* An internal bitmap is on every member: use them all */
+		if (bitmap_file)
+			n = bitmap_dirty_ranges(bitmap_file, NULL, &opts.ranges, 0);
+		else
+			for (i = 0; i < raid_disks && n >= 0; i++)
+				n = bitmap_dirty_ranges(disk_name[i], NULL,
+							&opts.ranges, n);
+		if (n < 0) {
+			fprintf(stderr, "%s: cannot read bitmap of %s\n",
+				prg, bitmap_file ? bitmap_file : argv[1]);
+			exit_err = 11;
+			goto exitHere;
+		}
+		opts.nranges = n;
+		printf("bitmap: %d dirty regions\n\n", n);
+	}
+
+	/* Choose the parity kernels before any check thread can use
+	 * them, so that the benchmark runs alone.
+	 */
+	xor_select();
+	raid6_select();
+	raid6_recov_select();
+
 	int rv = check_stripes(info, fds, offsets,
 			       raid_disks, chunk_size, level, layout,
-			       start, length, disk_name, repair, failed_disk1, failed_disk2);
+			       start, length, disk_name, repair, failed_disk1, failed_disk2,
+			       &opts);
 	if (rv != 0) {
 		fprintf(stderr,	"%s: check_stripes returned %d\n", prg, rv);
 		exit_err = 7;
@@ -708,6 +1379,7 @@ exitHere:
 	free(disk_name);
 	free(fds);
 	free(offsets);
+	free(opts.ranges);
 	free(buf);
 
 	exit(exit_err);
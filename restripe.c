@@ -24,6 +24,30 @@
 
 #include "mdadm.h"
 #include <stdint.h>
+#include <limits.h>
+#include <sys/uio.h>
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+/* The xor and raid6 kernels are picked on first use, and that first
+ * use can come from several save_stripes() or raid6check threads at
+ * once, so the choice is made under pthread_once().
+ */
+#ifdef USE_PTHREADS
+typedef pthread_once_t select_once_t;
+#define SELECT_ONCE_INIT	PTHREAD_ONCE_INIT
+#define select_once(once, fn)	pthread_once(once, fn)
+#else
+typedef int select_once_t;
+#define SELECT_ONCE_INIT	0
+#define select_once(once, fn)	do { if (!*(once)) { *(once) = 1; fn(); } } while (0)
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RESTRIPE_X86
+#include <immintrin.h>
+#endif
 
 /* To restripe, we read from old geometry to a buffer, and
  * read from buffer to new geometry.
@@ -228,7 +252,149 @@ int is_ddf(int layout)
 	}
 }
 
-void xor_blocks(char *target, char **sources, int disks, int size)
+/*
+ * A stripe_map caches geo_map() for one geometry.  Every layout
+ * repeats after 'period' stripes, so one stripe_layout per stripe in
+ * the period gives every mapping save_stripes(), restore_stripes()
+ * and raid6check need without recomputing it for each block.
+ * Maps are built on first use and kept for the life of the process.
+ */
+static struct stripe_map *stripe_maps;
+
+static int stripe_map_period(int level, int layout, int raid_disks)
+{
+	if (level == 0 || level == 4)
+		return 1;
+	switch (layout) {
+	case ALGORITHM_PARITY_0:
+	case ALGORITHM_PARITY_N:
+		return 1;
+	case ALGORITHM_PARITY_0_6:
+		return level == 6 ? 1 : raid_disks;
+	case ALGORITHM_LEFT_ASYMMETRIC_6:
+	case ALGORITHM_RIGHT_ASYMMETRIC_6:
+	case ALGORITHM_LEFT_SYMMETRIC_6:
+	case ALGORITHM_RIGHT_SYMMETRIC_6:
+		/* Q is fixed on the last device, P rotates over the rest */
+		return level == 6 ? raid_disks - 1 : raid_disks;
+	default:
+		return raid_disks;
+	}
+}
+
+static int stripe_map_fill(struct stripe_map *sm, struct stripe_layout *sl,
+			   unsigned long long stripe)
+{
+	int raid_disks = sm->raid_disks;
+	int level = sm->level, layout = sm->layout;
+	int i, j, d;
+
+	for (d = 0; d < raid_disks; d++)
+		sl->role[d] = -3;
+	sl->pdisk = sl->qdisk = -1;
+	if (level >= 4) {
+		sl->pdisk = geo_map(-1, stripe, raid_disks, level, layout);
+		if (sl->pdisk < 0 || sl->pdisk >= raid_disks)
+			return -1;
+		sl->role[sl->pdisk] = -1;
+	}
+	if (level == 6) {
+		sl->qdisk = geo_map(-2, stripe, raid_disks, level, layout);
+		if (sl->qdisk < 0 || sl->qdisk >= raid_disks)
+			return -1;
+		sl->role[sl->qdisk] = -2;
+	}
+	for (i = 0; i < sm->data_disks; i++) {
+		d = geo_map(i, stripe, raid_disks, level, layout);
+		if (d < 0 || d >= raid_disks || sl->role[d] != -3)
+			return -1;
+		sl->data[i] = d;
+		sl->role[d] = i;
+	}
+
+	if (level == 6 && is_ddf(layout)) {
+		/* q over 'raid_disks' blocks, in device order.
+		 * 'p' and 'q' get to be all zero
+		 */
+		for (d = 0; d < raid_disks; d++)
+			sl->slot[d] = sl->role[d] >= 0 ? d : -1;
+	} else if (level >= 4) {
+		/* for md, q is over 'data_disks' blocks, starting
+		 * immediately after 'q' (or after 'p' for raid4/5).
+		 * Note that for the '_6' variety, the p block
+		 * makes a hole that we need to be careful of.
+		 */
+		int first = level == 6 ? sl->qdisk : sl->pdisk;
+		for (i = 0, j = 0; j < raid_disks; j++) {
+			d = (first + 1 + j) % raid_disks;
+			if (sl->role[d] >= 0)
+				sl->slot[i++] = d;
+		}
+	} else
+		for (i = 0; i < sm->data_disks; i++)
+			sl->slot[i] = sl->data[i];
+	return 0;
+}
+
+struct stripe_map *stripe_map_get(int level, int layout, int raid_disks)
+{
+	struct stripe_map *sm;
+	int *ints;
+	int per_row;
+	int s;
+
+	for (sm = stripe_maps; sm; sm = sm->next)
+		if (sm->level == level && sm->layout == layout &&
+		    sm->raid_disks == raid_disks)
+			return sm;
+
+	if (raid_disks < 1 ||
+	    (level != 0 && level != 4 && level != 5 && level != 6))
+		return NULL;
+	sm = xcalloc(1, sizeof(*sm));
+	sm->level = level;
+	sm->layout = layout;
+	sm->raid_disks = raid_disks;
+	sm->data_disks = raid_disks - (level == 0 ? 0 : level <= 5 ? 1 : 2);
+	sm->syndrome_disks = (level == 6 && is_ddf(layout)) ?
+		raid_disks : sm->data_disks;
+	sm->period = stripe_map_period(level, layout, raid_disks);
+	if (sm->data_disks < 1 || sm->period < 1) {
+		free(sm);
+		return NULL;
+	}
+	sm->rows = xcalloc(sm->period, sizeof(*sm->rows));
+	per_row = sm->data_disks + sm->syndrome_disks + raid_disks;
+	ints = xcalloc(sm->period * per_row, sizeof(int));
+	for (s = 0; s < sm->period; s++) {
+		struct stripe_layout *sl = &sm->rows[s];
+
+		sl->data = ints + s * per_row;
+		sl->slot = sl->data + sm->data_disks;
+		sl->role = sl->slot + sm->syndrome_disks;
+		if (stripe_map_fill(sm, sl, s) != 0) {
+			free(ints);
+			free(sm->rows);
+			free(sm);
+			return NULL;
+		}
+	}
+	sm->next = stripe_maps;
+	stripe_maps = sm;
+	return sm;
+}
+
+/*
+ * XOR of 'disks' source blocks into 'target'.
+ *
+ * xor_blocks_bytes() is the original byte-at-a-time loop and is kept
+ * as the reference that the word and vector routines are checked
+ * against.  The routine actually used is chosen once, on first call,
+ * from those the CPU supports, preferring the widest.
+ * None of the routines require any particular alignment, and the
+ * target may be one of the sources.
+ */
+static void xor_blocks_bytes(char *target, char **sources, int disks, int size)
 {
 	int i, j;
 	/* Amazingly inefficient... */
@@ -240,7 +406,190 @@ void xor_blocks(char *target, char **sources, int disks, int size)
 	}
 }
 
-void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+static void xor_blocks_long(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+	uint64_t w, s;
+
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&w, sources[0] + i, 8);
+		for (j = 1; j < disks; j++) {
+			memcpy(&s, sources[j] + i, 8);
+			w ^= s;
+		}
+		memcpy(target + i, &w, 8);
+	}
+	if (i < size) {
+		char *tail[disks];
+		for (j = 0; j < disks; j++)
+			tail[j] = sources[j] + i;
+		xor_blocks_bytes(target + i, tail, disks, size - i);
+	}
+}
+
+#ifdef RESTRIPE_X86
+static __attribute__((target("sse2")))
+void xor_blocks_sse2(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		__m128i a = _mm_loadu_si128((__m128i *)(sources[0] + i));
+		__m128i b = _mm_loadu_si128((__m128i *)(sources[0] + i + 16));
+		for (j = 1; j < disks; j++) {
+			a = _mm_xor_si128(a, _mm_loadu_si128(
+					(__m128i *)(sources[j] + i)));
+			b = _mm_xor_si128(b, _mm_loadu_si128(
+					(__m128i *)(sources[j] + i + 16)));
+		}
+		_mm_storeu_si128((__m128i *)(target + i), a);
+		_mm_storeu_si128((__m128i *)(target + i + 16), b);
+	}
+	if (i < size) {
+		char *tail[disks];
+		for (j = 0; j < disks; j++)
+			tail[j] = sources[j] + i;
+		xor_blocks_long(target + i, tail, disks, size - i);
+	}
+}
+
+static __attribute__((target("avx2")))
+void xor_blocks_avx2(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 64 <= size; i += 64) {
+		__m256i a = _mm256_loadu_si256((__m256i *)(sources[0] + i));
+		__m256i b = _mm256_loadu_si256((__m256i *)(sources[0] + i + 32));
+		for (j = 1; j < disks; j++) {
+			a = _mm256_xor_si256(a, _mm256_loadu_si256(
+					(__m256i *)(sources[j] + i)));
+			b = _mm256_xor_si256(b, _mm256_loadu_si256(
+					(__m256i *)(sources[j] + i + 32)));
+		}
+		_mm256_storeu_si256((__m256i *)(target + i), a);
+		_mm256_storeu_si256((__m256i *)(target + i + 32), b);
+	}
+	_mm256_zeroupper();
+	if (i < size) {
+		char *tail[disks];
+		for (j = 0; j < disks; j++)
+			tail[j] = sources[j] + i;
+		xor_blocks_long(target + i, tail, disks, size - i);
+	}
+}
+
+static __attribute__((target("avx512f")))
+void xor_blocks_avx512(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 128 <= size; i += 128) {
+		__m512i a = _mm512_loadu_si512(sources[0] + i);
+		__m512i b = _mm512_loadu_si512(sources[0] + i + 64);
+		for (j = 1; j < disks; j++) {
+			a = _mm512_xor_si512(a,
+					     _mm512_loadu_si512(sources[j] + i));
+			b = _mm512_xor_si512(b,
+					     _mm512_loadu_si512(sources[j] + i + 64));
+		}
+		_mm512_storeu_si512(target + i, a);
+		_mm512_storeu_si512(target + i + 64, b);
+	}
+	_mm256_zeroupper();
+	if (i < size) {
+		char *tail[disks];
+		for (j = 0; j < disks; j++)
+			tail[j] = sources[j] + i;
+		xor_blocks_long(target + i, tail, disks, size - i);
+	}
+}
+
+static int cpu_has_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static int cpu_has_ssse3(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int cpu_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static int cpu_has_avx512f(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+
+static int cpu_has_avx512bw(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512bw");
+}
+#endif /* RESTRIPE_X86 */
+
+/* In order of preference.  The last entry must always be usable. */
+struct xor_algo xor_algos[] = {
+#ifdef RESTRIPE_X86
+	{ "avx512", cpu_has_avx512f, xor_blocks_avx512 },
+	{ "avx2", cpu_has_avx2, xor_blocks_avx2 },
+	{ "sse2", cpu_has_sse2, xor_blocks_sse2 },
+#endif
+	{ "long", NULL, xor_blocks_long },
+	{ "bytes", NULL, xor_blocks_bytes },
+	{ NULL, NULL, NULL }
+};
+
+static struct xor_algo *xor_algo;
+static select_once_t xor_once = SELECT_ONCE_INIT;
+
+static void xor_pick(void)
+{
+	struct xor_algo *a;
+
+	for (a = xor_algos; a->name; a++)
+		if (!a->valid || a->valid())
+			break;
+	xor_algo = a;
+}
+
+struct xor_algo *xor_select(void)
+{
+	select_once(&xor_once, xor_pick);
+	return xor_algo;
+}
+
+void xor_blocks(char *target, char **sources, int disks, int size)
+{
+	if (disks < 1) {
+		memset(target, 0, size);
+		return;
+	}
+	xor_select()->do_xor(target, sources, disks, size);
+}
+
+/*
+ * RAID6 P and Q syndrome over 'disks' source blocks.
+ *
+ * As with xor_blocks(), qsyndrome_bytes() is the original byte loop
+ * and serves as the reference.  The word and vector versions follow
+ * linux/lib/raid6: Q is multiplied by {02} in GF(2^8) for each source
+ * by shifting every byte left and xoring 0x1d into bytes whose top
+ * bit was set.  Which version qsyndrome() uses is decided by timing
+ * each usable one on first call, as raid6_select_algo() does in the
+ * kernel.
+ */
+static void qsyndrome_bytes(uint8_t *p, uint8_t *q, uint8_t **sources,
+			    int disks, int size)
 {
 	int d, z;
 	uint8_t wq0, wp0, wd0, w10, w20;
@@ -260,93 +609,303 @@ void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
 	}
 }
 
-/*
- * The following was taken from linux/drivers/md/mktables.c, and modified
- * to create in-memory tables rather than C code
- */
-static uint8_t gfmul(uint8_t a, uint8_t b)
+/* Finish the last 'size - done' bytes with a narrower routine */
+static void qsyndrome_tail(void (*gen)(uint8_t *p, uint8_t *q,
+				       uint8_t **sources, int disks, int size),
+			   uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int done, int size)
+{
+	uint8_t *tail[disks];
+	int z;
+
+	if (done >= size)
+		return;
+	for (z = 0; z < disks; z++)
+		tail[z] = sources[z] + done;
+	gen(p + done, q + done, tail, disks, size - done);
+}
+
+#define NBYTES(x) ((x) * 0x0101010101010101ULL)
+
+static inline uint64_t gf_mul2_long(uint64_t v)
+{
+	uint64_t hi = v & NBYTES(0x80);
+
+	/* 0xff in each byte that had its top bit set */
+	hi = (hi << 1) - (hi >> 7);
+	return ((v << 1) & NBYTES(0xfe)) ^ (hi & NBYTES(0x1d));
+}
+
+static void qsyndrome_long(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int size)
+{
+	int d, z;
+	uint64_t wp, wq, wd;
+
+	for (d = 0; d + 8 <= size; d += 8) {
+		memcpy(&wq, sources[disks-1] + d, 8);
+		wp = wq;
+		for (z = disks-2; z >= 0; z--) {
+			memcpy(&wd, sources[z] + d, 8);
+			wp ^= wd;
+			wq = gf_mul2_long(wq) ^ wd;
+		}
+		memcpy(p + d, &wp, 8);
+		memcpy(q + d, &wq, 8);
+	}
+	qsyndrome_tail(qsyndrome_bytes, p, q, sources, disks, d, size);
+}
+
+#ifdef RESTRIPE_X86
+static __attribute__((target("sse2")))
+void qsyndrome_sse2x1(uint8_t *p, uint8_t *q, uint8_t **sources,
+		      int disks, int size)
+{
+	const __m128i x1d = _mm_set1_epi8(0x1d);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i wp, wq, wd, w2;
+	int d, z;
+
+	for (d = 0; d + 16 <= size; d += 16) {
+		wq = wp = _mm_loadu_si128((__m128i *)(sources[disks-1] + d));
+		for (z = disks-2; z >= 0; z--) {
+			wd = _mm_loadu_si128((__m128i *)(sources[z] + d));
+			wp = _mm_xor_si128(wp, wd);
+			w2 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq), x1d);
+			wq = _mm_xor_si128(_mm_add_epi8(wq, wq), w2);
+			wq = _mm_xor_si128(wq, wd);
+		}
+		_mm_storeu_si128((__m128i *)(p + d), wp);
+		_mm_storeu_si128((__m128i *)(q + d), wq);
+	}
+	qsyndrome_tail(qsyndrome_long, p, q, sources, disks, d, size);
+}
+
+static __attribute__((target("sse2")))
+void qsyndrome_sse2x2(uint8_t *p, uint8_t *q, uint8_t **sources,
+		      int disks, int size)
 {
-	uint8_t v = 0;
+	const __m128i x1d = _mm_set1_epi8(0x1d);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i wp0, wq0, wd0, wp1, wq1, wd1, w2;
+	int d, z;
 
-	while (b) {
-		if (b & 1)
-			v ^= a;
-		a = (a << 1) ^ (a & 0x80 ? 0x1d : 0);
-		b >>= 1;
+	for (d = 0; d + 32 <= size; d += 32) {
+		wq0 = wp0 = _mm_loadu_si128((__m128i *)(sources[disks-1] + d));
+		wq1 = wp1 = _mm_loadu_si128((__m128i *)(sources[disks-1] + d + 16));
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm_loadu_si128((__m128i *)(sources[z] + d));
+			wd1 = _mm_loadu_si128((__m128i *)(sources[z] + d + 16));
+			wp0 = _mm_xor_si128(wp0, wd0);
+			wp1 = _mm_xor_si128(wp1, wd1);
+			w2 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq0), x1d);
+			wq0 = _mm_xor_si128(_mm_add_epi8(wq0, wq0), w2);
+			wq0 = _mm_xor_si128(wq0, wd0);
+			w2 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq1), x1d);
+			wq1 = _mm_xor_si128(_mm_add_epi8(wq1, wq1), w2);
+			wq1 = _mm_xor_si128(wq1, wd1);
+		}
+		_mm_storeu_si128((__m128i *)(p + d), wp0);
+		_mm_storeu_si128((__m128i *)(p + d + 16), wp1);
+		_mm_storeu_si128((__m128i *)(q + d), wq0);
+		_mm_storeu_si128((__m128i *)(q + d + 16), wq1);
 	}
+	qsyndrome_tail(qsyndrome_sse2x1, p, q, sources, disks, d, size);
+}
 
-	return v;
+static __attribute__((target("avx2")))
+void qsyndrome_avx2x1(uint8_t *p, uint8_t *q, uint8_t **sources,
+		      int disks, int size)
+{
+	const __m256i x1d = _mm256_set1_epi8(0x1d);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i wp, wq, wd, w2;
+	int d, z;
+
+	for (d = 0; d + 32 <= size; d += 32) {
+		wq = wp = _mm256_loadu_si256((__m256i *)(sources[disks-1] + d));
+		for (z = disks-2; z >= 0; z--) {
+			wd = _mm256_loadu_si256((__m256i *)(sources[z] + d));
+			wp = _mm256_xor_si256(wp, wd);
+			w2 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq), x1d);
+			wq = _mm256_xor_si256(_mm256_add_epi8(wq, wq), w2);
+			wq = _mm256_xor_si256(wq, wd);
+		}
+		_mm256_storeu_si256((__m256i *)(p + d), wp);
+		_mm256_storeu_si256((__m256i *)(q + d), wq);
+	}
+	_mm256_zeroupper();
+	qsyndrome_tail(qsyndrome_long, p, q, sources, disks, d, size);
 }
 
-static uint8_t gfpow(uint8_t a, int b)
+static __attribute__((target("avx2")))
+void qsyndrome_avx2x2(uint8_t *p, uint8_t *q, uint8_t **sources,
+		      int disks, int size)
 {
-	uint8_t v = 1;
+	const __m256i x1d = _mm256_set1_epi8(0x1d);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i wp0, wq0, wd0, wp1, wq1, wd1, w2;
+	int d, z;
 
-	b %= 255;
-	if (b < 0)
-		b += 255;
+	for (d = 0; d + 64 <= size; d += 64) {
+		wq0 = wp0 = _mm256_loadu_si256((__m256i *)(sources[disks-1] + d));
+		wq1 = wp1 = _mm256_loadu_si256((__m256i *)(sources[disks-1] + d + 32));
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm256_loadu_si256((__m256i *)(sources[z] + d));
+			wd1 = _mm256_loadu_si256((__m256i *)(sources[z] + d + 32));
+			wp0 = _mm256_xor_si256(wp0, wd0);
+			wp1 = _mm256_xor_si256(wp1, wd1);
+			w2 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq0), x1d);
+			wq0 = _mm256_xor_si256(_mm256_add_epi8(wq0, wq0), w2);
+			wq0 = _mm256_xor_si256(wq0, wd0);
+			w2 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq1), x1d);
+			wq1 = _mm256_xor_si256(_mm256_add_epi8(wq1, wq1), w2);
+			wq1 = _mm256_xor_si256(wq1, wd1);
+		}
+		_mm256_storeu_si256((__m256i *)(p + d), wp0);
+		_mm256_storeu_si256((__m256i *)(p + d + 32), wp1);
+		_mm256_storeu_si256((__m256i *)(q + d), wq0);
+		_mm256_storeu_si256((__m256i *)(q + d + 32), wq1);
+	}
+	_mm256_zeroupper();
+	qsyndrome_tail(qsyndrome_avx2x1, p, q, sources, disks, d, size);
+}
+
+static __attribute__((target("avx512f,avx512bw")))
+void qsyndrome_avx512x1(uint8_t *p, uint8_t *q, uint8_t **sources,
+			int disks, int size)
+{
+	const __m512i x1d = _mm512_set1_epi8(0x1d);
+	__m512i wp, wq, wd, w2;
+	int d, z;
 
-	while (b) {
-		if (b & 1)
-			v = gfmul(v, a);
-		a = gfmul(a, a);
-		b >>= 1;
+	for (d = 0; d + 64 <= size; d += 64) {
+		wq = wp = _mm512_loadu_si512(sources[disks-1] + d);
+		for (z = disks-2; z >= 0; z--) {
+			wd = _mm512_loadu_si512(sources[z] + d);
+			wp = _mm512_xor_si512(wp, wd);
+			w2 = _mm512_maskz_mov_epi8(_mm512_movepi8_mask(wq), x1d);
+			wq = _mm512_xor_si512(_mm512_add_epi8(wq, wq), w2);
+			wq = _mm512_xor_si512(wq, wd);
+		}
+		_mm512_storeu_si512(p + d, wp);
+		_mm512_storeu_si512(q + d, wq);
 	}
+	_mm256_zeroupper();
+	qsyndrome_tail(qsyndrome_long, p, q, sources, disks, d, size);
+}
+
+static __attribute__((target("avx512f,avx512bw")))
+void qsyndrome_avx512x2(uint8_t *p, uint8_t *q, uint8_t **sources,
+			int disks, int size)
+{
+	const __m512i x1d = _mm512_set1_epi8(0x1d);
+	__m512i wp0, wq0, wd0, wp1, wq1, wd1, w2;
+	int d, z;
 
-	return v;
+	for (d = 0; d + 128 <= size; d += 128) {
+		wq0 = wp0 = _mm512_loadu_si512(sources[disks-1] + d);
+		wq1 = wp1 = _mm512_loadu_si512(sources[disks-1] + d + 64);
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm512_loadu_si512(sources[z] + d);
+			wd1 = _mm512_loadu_si512(sources[z] + d + 64);
+			wp0 = _mm512_xor_si512(wp0, wd0);
+			wp1 = _mm512_xor_si512(wp1, wd1);
+			w2 = _mm512_maskz_mov_epi8(_mm512_movepi8_mask(wq0), x1d);
+			wq0 = _mm512_xor_si512(_mm512_add_epi8(wq0, wq0), w2);
+			wq0 = _mm512_xor_si512(wq0, wd0);
+			w2 = _mm512_maskz_mov_epi8(_mm512_movepi8_mask(wq1), x1d);
+			wq1 = _mm512_xor_si512(_mm512_add_epi8(wq1, wq1), w2);
+			wq1 = _mm512_xor_si512(wq1, wd1);
+		}
+		_mm512_storeu_si512(p + d, wp0);
+		_mm512_storeu_si512(p + d + 64, wp1);
+		_mm512_storeu_si512(q + d, wq0);
+		_mm512_storeu_si512(q + d + 64, wq1);
+	}
+	_mm256_zeroupper();
+	qsyndrome_tail(qsyndrome_avx512x1, p, q, sources, disks, d, size);
+}
+#endif /* RESTRIPE_X86 */
+
+struct raid6_algo raid6_algos[] = {
+#ifdef RESTRIPE_X86
+	{ "avx512x2", cpu_has_avx512bw, qsyndrome_avx512x2 },
+	{ "avx512x1", cpu_has_avx512bw, qsyndrome_avx512x1 },
+	{ "avx2x2", cpu_has_avx2, qsyndrome_avx2x2 },
+	{ "avx2x1", cpu_has_avx2, qsyndrome_avx2x1 },
+	{ "sse2x2", cpu_has_sse2, qsyndrome_sse2x2 },
+	{ "sse2x1", cpu_has_sse2, qsyndrome_sse2x1 },
+#endif
+	{ "long", NULL, qsyndrome_long },
+	{ "bytes", NULL, qsyndrome_bytes },
+	{ NULL, NULL, NULL }
+};
+
+static struct raid6_algo *raid6_algo;
+static select_once_t raid6_once = SELECT_ONCE_INIT;
+
+/* Time how many 'disks' x 'size' syndromes 'a' can generate per second */
+unsigned long long raid6_algo_speed(struct raid6_algo *a, uint8_t **bufs,
+				    int disks, int size, long nsec)
+{
+	struct timespec t0, t1;
+	unsigned long long count = 0;
+	long elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		a->gen_syndrome(bufs[disks], bufs[disks+1], bufs, disks, size);
+		count++;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		elapsed = (t1.tv_sec - t0.tv_sec) * 1000000000L +
+			(t1.tv_nsec - t0.tv_nsec);
+	} while (elapsed < nsec);
+	return count * 1000000000ULL / elapsed;
 }
 
-int tables_ready = 0;
-uint8_t raid6_gfmul[256][256];
-uint8_t raid6_gfexp[256];
-uint8_t raid6_gfinv[256];
-uint8_t raid6_gfexi[256];
-uint8_t raid6_gflog[256];
-uint8_t raid6_gfilog[256];
-void make_tables(void)
+static void raid6_pick(void)
 {
-	int i, j;
-	uint8_t v;
-	uint32_t b, log;
-
-	/* Compute multiplication table */
-	for (i = 0; i < 256; i++)
-		for (j = 0; j < 256; j++)
-				raid6_gfmul[i][j] = gfmul(i, j);
-
-	/* Compute power-of-2 table (exponent) */
-	v = 1;
-	for (i = 0; i < 256; i++) {
-		raid6_gfexp[i] = v;
-		v = gfmul(v, 2);
-		if (v == 1)
-			v = 0;	/* For entry 255, not a real entry */
-	}
-
-	/* Compute inverse table x^-1 == x^254 */
-	for (i = 0; i < 256; i++)
-		raid6_gfinv[i] = gfpow(i, 254);
-
-	/* Compute inv(2^x + 1) (exponent-xor-inverse) table */
-	for (i = 0; i < 256; i ++)
-		raid6_gfexi[i] = raid6_gfinv[raid6_gfexp[i] ^ 1];
-
-	/* Compute log and inverse log */
-	/* Modified code from:
-	 *    https://web.eecs.utk.edu/~plank/plank/papers/CS-96-332.html
-	 */
-	b = 1;
-	raid6_gflog[0] = 0;
-	raid6_gfilog[255] = 0;
+	struct raid6_algo *a, *best = NULL;
+	unsigned long long speed, best_speed = 0;
+	uint8_t *bufs[RAID6_BENCH_DISKS + 2];
+	char *mem;
+	int i;
 
-	for (log = 0; log < 255; log++) {
-		raid6_gflog[b] = (uint8_t) log;
-		raid6_gfilog[log] = (uint8_t) b;
-		b = b << 1;
-		if (b & 256) b = b ^ 0435;
+	if (posix_memalign((void**)&mem, 4096,
+			   (RAID6_BENCH_DISKS + 2) * RAID6_BENCH_SIZE) != 0)
+		mem = NULL;
+	for (a = raid6_algos; a->name; a++) {
+		if (a->valid && !a->valid())
+			continue;
+		if (!mem) {
+			/* Can't measure, so trust the ordering */
+			best = a;
+			break;
+		}
+		for (i = 0; i < RAID6_BENCH_DISKS + 2; i++)
+			bufs[i] = (uint8_t *)mem + i * RAID6_BENCH_SIZE;
+		memset(mem, 0x5a, RAID6_BENCH_DISKS * RAID6_BENCH_SIZE);
+		speed = raid6_algo_speed(a, bufs, RAID6_BENCH_DISKS,
+					 RAID6_BENCH_SIZE, RAID6_BENCH_NSEC);
+		if (!best || speed > best_speed) {
+			best = a;
+			best_speed = speed;
+		}
 	}
+	free(mem);
+	raid6_algo = best;
+}
+
+struct raid6_algo *raid6_select(void)
+{
+	select_once(&raid6_once, raid6_pick);
+	return raid6_algo;
+}
 
-	tables_ready = 1;
+void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+{
+	raid6_select()->gen_syndrome(p, q, sources, disks, size);
 }
 
 uint8_t *zero;
@@ -362,6 +921,271 @@ void ensure_zero_has_size(int chunk_size)
 	}
 }
 
+/*
+ * Inner loops of the RAID6 recovery routines below.
+ *
+ * recov_2data: given P, Q and the delta syndromes dp, dq computed with
+ * zeros in place of the two failed blocks, rebuild block B into dq as
+ * pbmul*(P^dp) ^ qmul*(Q^dq) and block A into dp as B^P^dp.
+ * recov_datap: given Q and the delta dq, rebuild the data block into dq
+ * as qmul*(Q^dq) and xor it into P.
+ *
+ * The "bytes" version looks every byte up in raid6_gfmul[] and is the
+ * reference.  The vector versions split each byte into nibbles and
+ * multiply with two 16-entry shuffles from raid6_vgfmul[], as the
+ * kernel's raid6 recov_ssse3/avx2/avx512 do.
+ */
+static void raid6_recov_2data_bytes(size_t bytes, uint8_t *p, uint8_t *q,
+				    uint8_t *dp, uint8_t *dq,
+				    uint8_t pbc, uint8_t qc)
+{
+	const uint8_t *pbmul = raid6_gfmul[pbc];
+	const uint8_t *qmul = raid6_gfmul[qc];
+	uint8_t px, qx, db;
+
+	while ( bytes-- ) {
+		px    = *p ^ *dp;
+		qx    = qmul[*q ^ *dq];
+		*dq++ = db = pbmul[px] ^ qx; /* Reconstructed B */
+		*dp++ = db ^ px; /* Reconstructed A */
+		p++; q++;
+	}
+}
+
+static void raid6_recov_datap_bytes(size_t bytes, uint8_t *p, uint8_t *q,
+				    uint8_t *dq, uint8_t qc)
+{
+	const uint8_t *qmul = raid6_gfmul[qc];
+
+	while ( bytes-- ) {
+		*p++ ^= *dq = qmul[*q ^ *dq];
+		q++; dq++;
+	}
+}
+
+#ifdef RESTRIPE_X86
+static __attribute__((target("ssse3")))
+void raid6_recov_2data_ssse3(size_t bytes, uint8_t *p, uint8_t *q,
+			     uint8_t *dp, uint8_t *dq,
+			     uint8_t pbc, uint8_t qc)
+{
+	const __m128i x0f = _mm_set1_epi8(0x0f);
+	const __m128i pbl = _mm_load_si128((__m128i *)raid6_vgfmul[pbc]);
+	const __m128i pbh = _mm_load_si128((__m128i *)(raid6_vgfmul[pbc] + 16));
+	const __m128i ql = _mm_load_si128((__m128i *)raid6_vgfmul[qc]);
+	const __m128i qh = _mm_load_si128((__m128i *)(raid6_vgfmul[qc] + 16));
+	__m128i px, qx, db;
+
+	for (; bytes >= 16; bytes -= 16) {
+		px = _mm_xor_si128(_mm_loadu_si128((__m128i *)p),
+				   _mm_loadu_si128((__m128i *)dp));
+		qx = _mm_xor_si128(_mm_loadu_si128((__m128i *)q),
+				   _mm_loadu_si128((__m128i *)dq));
+		qx = _mm_xor_si128(
+			_mm_shuffle_epi8(ql, _mm_and_si128(qx, x0f)),
+			_mm_shuffle_epi8(qh, _mm_and_si128(
+						 _mm_srli_epi64(qx, 4), x0f)));
+		db = _mm_xor_si128(
+			_mm_shuffle_epi8(pbl, _mm_and_si128(px, x0f)),
+			_mm_shuffle_epi8(pbh, _mm_and_si128(
+						 _mm_srli_epi64(px, 4), x0f)));
+		db = _mm_xor_si128(db, qx);
+		_mm_storeu_si128((__m128i *)dq, db);
+		_mm_storeu_si128((__m128i *)dp, _mm_xor_si128(db, px));
+		p += 16; q += 16; dp += 16; dq += 16;
+	}
+	raid6_recov_2data_bytes(bytes, p, q, dp, dq, pbc, qc);
+}
+
+static __attribute__((target("ssse3")))
+void raid6_recov_datap_ssse3(size_t bytes, uint8_t *p, uint8_t *q,
+			     uint8_t *dq, uint8_t qc)
+{
+	const __m128i x0f = _mm_set1_epi8(0x0f);
+	const __m128i ql = _mm_load_si128((__m128i *)raid6_vgfmul[qc]);
+	const __m128i qh = _mm_load_si128((__m128i *)(raid6_vgfmul[qc] + 16));
+	__m128i qx;
+
+	for (; bytes >= 16; bytes -= 16) {
+		qx = _mm_xor_si128(_mm_loadu_si128((__m128i *)q),
+				   _mm_loadu_si128((__m128i *)dq));
+		qx = _mm_xor_si128(
+			_mm_shuffle_epi8(ql, _mm_and_si128(qx, x0f)),
+			_mm_shuffle_epi8(qh, _mm_and_si128(
+						 _mm_srli_epi64(qx, 4), x0f)));
+		_mm_storeu_si128((__m128i *)dq, qx);
+		_mm_storeu_si128((__m128i *)p,
+				 _mm_xor_si128(_mm_loadu_si128((__m128i *)p), qx));
+		p += 16; q += 16; dq += 16;
+	}
+	raid6_recov_datap_bytes(bytes, p, q, dq, qc);
+}
+
+static __attribute__((target("avx2")))
+void raid6_recov_2data_avx2(size_t bytes, uint8_t *p, uint8_t *q,
+			    uint8_t *dp, uint8_t *dq,
+			    uint8_t pbc, uint8_t qc)
+{
+	const __m256i x0f = _mm256_set1_epi8(0x0f);
+	const __m256i pbl = _mm256_broadcastsi128_si256(
+		_mm_load_si128((__m128i *)raid6_vgfmul[pbc]));
+	const __m256i pbh = _mm256_broadcastsi128_si256(
+		_mm_load_si128((__m128i *)(raid6_vgfmul[pbc] + 16)));
+	const __m256i ql = _mm256_broadcastsi128_si256(
+		_mm_load_si128((__m128i *)raid6_vgfmul[qc]));
+	const __m256i qh = _mm256_broadcastsi128_si256(
+		_mm_load_si128((__m128i *)(raid6_vgfmul[qc] + 16)));
+	__m256i px, qx, db;
+
+	for (; bytes >= 32; bytes -= 32) {
+		px = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)p),
+				      _mm256_loadu_si256((__m256i *)dp));
+		qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)q),
+				      _mm256_loadu_si256((__m256i *)dq));
+		qx = _mm256_xor_si256(
+			_mm256_shuffle_epi8(ql, _mm256_and_si256(qx, x0f)),
+			_mm256_shuffle_epi8(qh, _mm256_and_si256(
+						    _mm256_srli_epi64(qx, 4), x0f)));
+		db = _mm256_xor_si256(
+			_mm256_shuffle_epi8(pbl, _mm256_and_si256(px, x0f)),
+			_mm256_shuffle_epi8(pbh, _mm256_and_si256(
+						    _mm256_srli_epi64(px, 4), x0f)));
+		db = _mm256_xor_si256(db, qx);
+		_mm256_storeu_si256((__m256i *)dq, db);
+		_mm256_storeu_si256((__m256i *)dp, _mm256_xor_si256(db, px));
+		p += 32; q += 32; dp += 32; dq += 32;
+	}
+	_mm256_zeroupper();
+	raid6_recov_2data_bytes(bytes, p, q, dp, dq, pbc, qc);
+}
+
+static __attribute__((target("avx2")))
+void raid6_recov_datap_avx2(size_t bytes, uint8_t *p, uint8_t *q,
+			    uint8_t *dq, uint8_t qc)
+{
+	const __m256i x0f = _mm256_set1_epi8(0x0f);
+	const __m256i ql = _mm256_broadcastsi128_si256(
+		_mm_load_si128((__m128i *)raid6_vgfmul[qc]));
+	const __m256i qh = _mm256_broadcastsi128_si256(
+		_mm_load_si128((__m128i *)(raid6_vgfmul[qc] + 16)));
+	__m256i qx;
+
+	for (; bytes >= 32; bytes -= 32) {
+		qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)q),
+				      _mm256_loadu_si256((__m256i *)dq));
+		qx = _mm256_xor_si256(
+			_mm256_shuffle_epi8(ql, _mm256_and_si256(qx, x0f)),
+			_mm256_shuffle_epi8(qh, _mm256_and_si256(
+						    _mm256_srli_epi64(qx, 4), x0f)));
+		_mm256_storeu_si256((__m256i *)dq, qx);
+		_mm256_storeu_si256((__m256i *)p,
+				    _mm256_xor_si256(
+					    _mm256_loadu_si256((__m256i *)p), qx));
+		p += 32; q += 32; dq += 32;
+	}
+	_mm256_zeroupper();
+	raid6_recov_datap_bytes(bytes, p, q, dq, qc);
+}
+
+static __attribute__((target("avx512f,avx512bw")))
+void raid6_recov_2data_avx512(size_t bytes, uint8_t *p, uint8_t *q,
+			      uint8_t *dp, uint8_t *dq,
+			      uint8_t pbc, uint8_t qc)
+{
+	const __m512i x0f = _mm512_set1_epi8(0x0f);
+	const __m512i pbl = _mm512_broadcast_i32x4(
+		_mm_load_si128((__m128i *)raid6_vgfmul[pbc]));
+	const __m512i pbh = _mm512_broadcast_i32x4(
+		_mm_load_si128((__m128i *)(raid6_vgfmul[pbc] + 16)));
+	const __m512i ql = _mm512_broadcast_i32x4(
+		_mm_load_si128((__m128i *)raid6_vgfmul[qc]));
+	const __m512i qh = _mm512_broadcast_i32x4(
+		_mm_load_si128((__m128i *)(raid6_vgfmul[qc] + 16)));
+	__m512i px, qx, db;
+
+	for (; bytes >= 64; bytes -= 64) {
+		px = _mm512_xor_si512(_mm512_loadu_si512(p),
+				      _mm512_loadu_si512(dp));
+		qx = _mm512_xor_si512(_mm512_loadu_si512(q),
+				      _mm512_loadu_si512(dq));
+		qx = _mm512_xor_si512(
+			_mm512_shuffle_epi8(ql, _mm512_and_si512(qx, x0f)),
+			_mm512_shuffle_epi8(qh, _mm512_and_si512(
+						    _mm512_srli_epi64(qx, 4), x0f)));
+		db = _mm512_xor_si512(
+			_mm512_shuffle_epi8(pbl, _mm512_and_si512(px, x0f)),
+			_mm512_shuffle_epi8(pbh, _mm512_and_si512(
+						    _mm512_srli_epi64(px, 4), x0f)));
+		db = _mm512_xor_si512(db, qx);
+		_mm512_storeu_si512(dq, db);
+		_mm512_storeu_si512(dp, _mm512_xor_si512(db, px));
+		p += 64; q += 64; dp += 64; dq += 64;
+	}
+	_mm256_zeroupper();
+	raid6_recov_2data_bytes(bytes, p, q, dp, dq, pbc, qc);
+}
+
+static __attribute__((target("avx512f,avx512bw")))
+void raid6_recov_datap_avx512(size_t bytes, uint8_t *p, uint8_t *q,
+			      uint8_t *dq, uint8_t qc)
+{
+	const __m512i x0f = _mm512_set1_epi8(0x0f);
+	const __m512i ql = _mm512_broadcast_i32x4(
+		_mm_load_si128((__m128i *)raid6_vgfmul[qc]));
+	const __m512i qh = _mm512_broadcast_i32x4(
+		_mm_load_si128((__m128i *)(raid6_vgfmul[qc] + 16)));
+	__m512i qx;
+
+	for (; bytes >= 64; bytes -= 64) {
+		qx = _mm512_xor_si512(_mm512_loadu_si512(q),
+				      _mm512_loadu_si512(dq));
+		qx = _mm512_xor_si512(
+			_mm512_shuffle_epi8(ql, _mm512_and_si512(qx, x0f)),
+			_mm512_shuffle_epi8(qh, _mm512_and_si512(
+						    _mm512_srli_epi64(qx, 4), x0f)));
+		_mm512_storeu_si512(dq, qx);
+		_mm512_storeu_si512(p, _mm512_xor_si512(_mm512_loadu_si512(p),
+							qx));
+		p += 64; q += 64; dq += 64;
+	}
+	_mm256_zeroupper();
+	raid6_recov_datap_bytes(bytes, p, q, dq, qc);
+}
+#endif /* RESTRIPE_X86 */
+
+/* In order of preference.  The last entry must always be usable. */
+struct raid6_recov_algo raid6_recov_algos[] = {
+#ifdef RESTRIPE_X86
+	{ "avx512", cpu_has_avx512bw,
+	  raid6_recov_2data_avx512, raid6_recov_datap_avx512 },
+	{ "avx2", cpu_has_avx2,
+	  raid6_recov_2data_avx2, raid6_recov_datap_avx2 },
+	{ "ssse3", cpu_has_ssse3,
+	  raid6_recov_2data_ssse3, raid6_recov_datap_ssse3 },
+#endif
+	{ "bytes", NULL, raid6_recov_2data_bytes, raid6_recov_datap_bytes },
+	{ NULL, NULL, NULL, NULL }
+};
+
+static struct raid6_recov_algo *raid6_recov_algo;
+static select_once_t raid6_recov_once = SELECT_ONCE_INIT;
+
+static void raid6_recov_pick(void)
+{
+	struct raid6_recov_algo *a;
+
+	for (a = raid6_recov_algos; a->name; a++)
+		if (!a->valid || a->valid())
+			break;
+	raid6_recov_algo = a;
+}
+
+struct raid6_recov_algo *raid6_recov_select(void)
+{
+	select_once(&raid6_recov_once, raid6_recov_pick);
+	return raid6_recov_algo;
+}
+
 /* Following was taken from linux/drivers/md/raid6recov.c */
 
 /* Recover two failed data blocks. */
@@ -370,9 +1194,8 @@ void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
 		       uint8_t **ptrs, int neg_offset)
 {
 	uint8_t *p, *q, *dp, *dq;
-	uint8_t px, qx, db;
-	const uint8_t *pbmul;	/* P multiplier table for B data */
-	const uint8_t *qmul;		/* Q multiplier table (for both) */
+	uint8_t pbc;	/* P multiplier for B data */
+	uint8_t qc;	/* Q multiplier (for both) */
 
 	if (faila > failb) {
 		int t = faila;
@@ -402,18 +1225,12 @@ void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
 	ptrs[faila]   = dp;
 	ptrs[failb]   = dq;
 
-	/* Now, pick the proper data tables */
-	pbmul = raid6_gfmul[raid6_gfexi[failb-faila]];
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]^raid6_gfexp[failb]]];
+	/* Now, pick the proper multipliers */
+	pbc = raid6_gfexi[failb-faila];
+	qc  = raid6_gfinv[raid6_gfexp[faila]^raid6_gfexp[failb]];
 
 	/* Now do it... */
-	while ( bytes-- ) {
-		px    = *p ^ *dp;
-		qx    = qmul[*q ^ *dq];
-		*dq++ = db = pbmul[px] ^ qx; /* Reconstructed B */
-		*dp++ = db ^ px; /* Reconstructed A */
-		p++; q++;
-	}
+	raid6_recov_select()->recov_2data(bytes, p, q, dp, dq, pbc, qc);
 }
 
 /* Recover failure of one data block plus the P block */
@@ -421,7 +1238,7 @@ void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs,
 		       int neg_offset)
 {
 	uint8_t *p, *q, *dq;
-	const uint8_t *qmul;		/* Q multiplier table */
+	uint8_t qc;		/* Q multiplier */
 
 	if (neg_offset) {
 		p = ptrs[-1];
@@ -441,14 +1258,11 @@ void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs,
 	/* Restore pointer table */
 	ptrs[faila]   = dq;
 
-	/* Now, pick the proper data tables */
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]]];
+	/* Now, pick the proper multiplier */
+	qc  = raid6_gfinv[raid6_gfexp[faila]];
 
 	/* Now do it... */
-	while ( bytes-- ) {
-		*p++ ^= *dq = qmul[*q ^ *dq];
-		q++; dq++;
-	}
+	raid6_recov_select()->recov_datap(bytes, p, q, dq, qc);
 }
 
 /* Try to find out if a specific disk has a problem */
@@ -462,6 +1276,12 @@ int raid6_check_disks(int data_disks, int start, int chunk_size,
 	int curr_broken_disk = -1;
 	int prev_broken_disk = -1;
 	int broken_status = 0;
+	struct stripe_map *sm = stripe_map_get(level, layout, data_disks + 2);
+	struct stripe_layout *sl;
+
+	if (!sm)
+		return -2;
+	sl = stripe_layout(sm, start/chunk_size);
 
 	for(i = 0; i < chunk_size; i++) {
 		Px = (uint8_t)stripes[diskP][i] ^ (uint8_t)p[i];
@@ -476,8 +1296,14 @@ int raid6_check_disks(int data_disks, int start, int chunk_size,
 		if((Px != 0) && (Qx != 0)) {
 			data_id = (raid6_gflog[Qx] - raid6_gflog[Px]);
 			if(data_id < 0) data_id += 255;
-			diskD = geo_map(data_id, start/chunk_size,
-					data_disks + 2, level, layout);
+			/* data_id is a syndrome slot, which for DDF may
+			 * be a zero-filled one with no disk
+			 */
+			if (data_id < sm->syndrome_disks &&
+			    sl->slot[data_id] >= 0)
+				diskD = sl->slot[data_id];
+			else
+				diskD = data_disks + 2;
 			curr_broken_disk = diskD;
 		}
 
@@ -510,6 +1336,554 @@ int raid6_check_disks(int data_disks, int start, int chunk_size,
 	return curr_broken_disk;
 }
 
+/*
+ * save_stripes() and restore_stripes() move a batch of stripes at a
+ * time.  Consecutive stripes occupy consecutive chunks on every
+ * member, so each member is read or written with a single preadv() or
+ * pwritev() scattered over the batch buffer.  Backup files get one
+ * pwritev() per batch too.  With pthreads every member and backup file
+ * is handled by its own worker thread, and up to IO_BATCHES batches are
+ * in flight: one being read, one being worked on and the rest being
+ * written out.
+ *
+ * The batch buffers and the workers belong to a struct stripe_io.
+ * During a reshape these functions run while part of the array is
+ * suspended and memory is locked, and must neither allocate nor start
+ * threads there: reclaim might need to write to the suspended region.
+ * So the reshape monitor makes its stripe_io with stripe_io_new()
+ * before the first suspend and passes it in.  Other callers may pass
+ * NULL and get a temporary one.
+ */
+#define IO_BATCH_BYTES	(4*1024*1024)
+#define IO_BATCHES	3
+#define IO_STACK_SIZE	(64*1024)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+enum io_op { IO_READ, IO_WRITE, IO_FSYNC };
+
+struct member_io {
+	enum io_op op;
+	int fd;
+	off_t offset;
+	int nr;			/* number of iovecs */
+	struct iovec *iov;
+	char *bad;		/* iov[n] could not be transferred */
+	int failed;
+	int slot;		/* worker which performs it */
+	int pending;		/* queued on or running in that worker */
+	struct member_io *next;	/* worker queue */
+};
+
+struct stripe_batch {
+	char *buf;
+	int stripes;
+	int nio;
+	struct member_io *io;
+	struct iovec *iov;
+	char *bad;
+};
+
+#ifdef USE_PTHREADS
+struct io_worker {
+	struct stripe_io *sio;
+	struct member_io *head, *tail;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+#endif
+
+struct stripe_io {
+	int raid_disks;
+	int chunk_size;
+	int level;
+	int layout;
+	int nwrites;		/* backup files, using slots raid_disks.. */
+	int max_stripes;	/* per batch */
+	int nbatch;
+	struct stripe_batch batch[IO_BATCHES];
+	struct member_io *sync;	/* fsync_fds(), one per backup file */
+	off_t *dpos;		/* where the next backup write goes */
+	int nworkers;		/* slots 0..nworkers-1 have a thread */
+#ifdef USE_PTHREADS
+	struct io_worker *workers;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int stop;
+#endif
+};
+
+/*
+ * Array members are opened O_DIRECT (see dev_open()) so that scanning
+ * them does not fill the page cache, and all buffers here are page
+ * aligned for that.  A device or file which cannot do direct I/O fails
+ * it with EINVAL: then switch the fd to buffered I/O and report that
+ * the I/O is worth retrying.
+ */
+int direct_io_fallback(int fd)
+{
+	int flags;
+
+	if (errno != EINVAL)
+		return 0;
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || !(flags & O_DIRECT))
+		return 0;
+	return fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+}
+
+/* After a buffered read, don't leave the data behind in the page cache */
+void drop_cache(int fd, off_t offset, off_t len)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags >= 0 && !(flags & O_DIRECT))
+		posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+static ssize_t member_iov(struct member_io *mio)
+{
+	if (mio->op == IO_READ)
+		return preadv(mio->fd, mio->iov, mio->nr, mio->offset);
+	return pwritev(mio->fd, mio->iov, mio->nr, mio->offset);
+}
+
+static void do_member_io(struct member_io *mio)
+{
+	ssize_t want = 0, done;
+	off_t offset = mio->offset;
+	int i;
+
+	mio->failed = 0;
+	if (mio->op == IO_FSYNC) {
+		if (fsync(mio->fd) != 0)
+			mio->failed = 1;
+		return;
+	}
+	for (i = 0; i < mio->nr; i++)
+		want += mio->iov[i].iov_len;
+	if (mio->fd >= 0) {
+		done = member_iov(mio);
+		if (done < 0 && direct_io_fallback(mio->fd))
+			done = member_iov(mio);
+		if (done == want) {
+			if (mio->op == IO_READ)
+				drop_cache(mio->fd, mio->offset, want);
+			return;
+		}
+	}
+	/* Retry one iovec at a time so that we know exactly which
+	 * chunks could not be transferred.
+	 */
+	for (i = 0; i < mio->nr; i++) {
+		ssize_t len = mio->iov[i].iov_len;
+
+		if (mio->fd < 0 ||
+		    (mio->op == IO_READ ?
+		     pread(mio->fd, mio->iov[i].iov_base, len, offset) :
+		     pwrite(mio->fd, mio->iov[i].iov_base, len, offset))
+		    != len) {
+			mio->bad[i] = 1;
+			mio->failed = 1;
+		}
+		offset += len;
+	}
+}
+
+#ifdef USE_PTHREADS
+/* Perform the transfers queued for one slot, in order */
+static void *io_worker(void *v)
+{
+	struct io_worker *w = v;
+	struct stripe_io *sio = w->sio;
+	struct member_io *mio;
+
+	pthread_mutex_lock(&sio->lock);
+	for (;;) {
+		mio = w->head;
+		if (!mio) {
+			if (sio->stop)
+				break;
+			pthread_cond_wait(&w->cond, &sio->lock);
+			continue;
+		}
+		w->head = mio->next;
+		if (!w->head)
+			w->tail = NULL;
+		pthread_mutex_unlock(&sio->lock);
+		do_member_io(mio);
+		pthread_mutex_lock(&sio->lock);
+		mio->pending = 0;
+		pthread_cond_broadcast(&sio->done);
+	}
+	pthread_mutex_unlock(&sio->lock);
+	return NULL;
+}
+#endif
+
+static void start_io(struct stripe_io *sio, struct member_io *mio)
+{
+#ifdef USE_PTHREADS
+	if (mio->slot < sio->nworkers) {
+		struct io_worker *w = &sio->workers[mio->slot];
+
+		pthread_mutex_lock(&sio->lock);
+		mio->pending = 1;
+		mio->next = NULL;
+		if (w->tail)
+			w->tail->next = mio;
+		else
+			w->head = mio;
+		w->tail = mio;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&sio->lock);
+		return;
+	}
+#endif
+	do_member_io(mio);
+}
+
+/* Wait for 'nr' transfers started by start_io(), and report
+ * whether any of them failed.
+ */
+static int wait_io(struct stripe_io *sio, struct member_io *mio, int nr)
+{
+	int failed = 0;
+	int i;
+
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&sio->lock);
+	for (i = 0; i < nr; i++)
+		while (mio[i].pending)
+			pthread_cond_wait(&sio->done, &sio->lock);
+	pthread_mutex_unlock(&sio->lock);
+#endif
+	for (i = 0; i < nr; i++)
+		failed |= mio[i].failed;
+	return failed;
+}
+
+/* Flush all of the given backup fds at once; -1 if any flush failed.
+ * Without a stripe_io to do it this is a plain fsync() loop, so it
+ * never allocates.
+ */
+int fsync_fds(struct stripe_io *sio, int *fds, int nr)
+{
+	int i, rv = 0;
+
+	if (!sio || nr > sio->nwrites) {
+		for (i = 0; i < nr; i++)
+			if (fsync(fds[i]) != 0)
+				rv = -1;
+		return rv;
+	}
+	for (i = 0; i < nr; i++) {
+		sio->sync[i].op = IO_FSYNC;
+		sio->sync[i].fd = fds[i];
+		start_io(sio, &sio->sync[i]);
+	}
+	return wait_io(sio, sio->sync, nr) ? -1 : 0;
+}
+
+static int alloc_batch(struct stripe_batch *b, size_t stripe_size,
+		       int nio, int max_stripes)
+{
+	int i;
+
+	if (posix_memalign((void**)&b->buf, 4096, max_stripes * stripe_size)) {
+		b->buf = NULL;
+		return -1;
+	}
+	b->stripes = 0;
+	b->nio = nio;
+	b->io = xcalloc(nio, sizeof(*b->io));
+	b->iov = xcalloc((size_t)nio * max_stripes, sizeof(*b->iov));
+	b->bad = xcalloc((size_t)nio * max_stripes, 1);
+	for (i = 0; i < nio; i++) {
+		b->io[i].iov = b->iov + i * max_stripes;
+		b->io[i].bad = b->bad + i * max_stripes;
+		b->io[i].slot = i;
+	}
+	return 0;
+}
+
+static void free_batch(struct stripe_batch *b)
+{
+	free(b->buf);
+	free(b->io);
+	free(b->iov);
+	free(b->bad);
+}
+
+/* Forget the outcome of transfers made by an earlier call */
+static void reset_batch(struct stripe_batch *b)
+{
+	int i;
+
+	for (i = 0; i < b->nio; i++)
+		b->io[i].failed = 0;
+}
+
+static int batch_stripes(int raid_disks, int chunk_size,
+			 unsigned long long stripes)
+{
+	int max_stripes = IO_BATCH_BYTES / (raid_disks * chunk_size);
+
+	if (max_stripes < 1)
+		max_stripes = 1;
+	if (max_stripes > IOV_MAX)
+		max_stripes = IOV_MAX;
+	if ((unsigned long long)max_stripes > stripes)
+		max_stripes = stripes;
+	return max_stripes;
+}
+
+/*
+ * Prepare for save_stripes() and restore_stripes() calls of up to
+ * 'stripes' stripes at a time in the given geometry, with up to
+ * 'nwrites' backup files: allocate the batches, build the stripe map,
+ * choose the parity kernels and start the workers.
+ */
+struct stripe_io *stripe_io_new(int raid_disks, int chunk_size,
+				int level, int layout, int nwrites,
+				unsigned long long stripes)
+{
+	struct stripe_io *sio;
+	int nio = raid_disks + nwrites;
+	int i;
+#ifdef USE_PTHREADS
+	pthread_attr_t attr;
+#endif
+
+	if (stripes == 0 || !stripe_map_get(level, layout, raid_disks))
+		return NULL;
+	ensure_zero_has_size(chunk_size);
+	if (level >= 4)
+		xor_select();
+	if (level == 6) {
+		raid6_select();
+		raid6_recov_select();
+	}
+
+	sio = xcalloc(1, sizeof(*sio));
+	sio->raid_disks = raid_disks;
+	sio->chunk_size = chunk_size;
+	sio->level = level;
+	sio->layout = layout;
+	sio->nwrites = nwrites;
+#ifdef USE_PTHREADS
+	pthread_mutex_init(&sio->lock, NULL);
+	pthread_cond_init(&sio->done, NULL);
+#endif
+	sio->max_stripes = batch_stripes(raid_disks, chunk_size, stripes);
+	sio->nbatch = (stripes + sio->max_stripes - 1) / sio->max_stripes;
+	if (sio->nbatch > IO_BATCHES)
+		sio->nbatch = IO_BATCHES;
+	for (i = 0; i < sio->nbatch; i++)
+		if (alloc_batch(&sio->batch[i], (size_t)raid_disks * chunk_size,
+				nio, sio->max_stripes)) {
+			stripe_io_free(sio);
+			return NULL;
+		}
+	if (nwrites) {
+		sio->sync = xcalloc(nwrites, sizeof(*sio->sync));
+		sio->dpos = xcalloc(nwrites, sizeof(*sio->dpos));
+		for (i = 0; i < nwrites; i++)
+			sio->sync[i].slot = raid_disks + i;
+	}
+
+#ifdef USE_PTHREADS
+	/* The workers only ever call do_member_io(), so a small stack
+	 * will do, and keeps what mlockall() pins down small.
+	 */
+	sio->workers = xcalloc(nio, sizeof(*sio->workers));
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, IO_STACK_SIZE);
+	for (i = 0; i < nio; i++) {
+		struct io_worker *w = &sio->workers[i];
+
+		w->sio = sio;
+		pthread_cond_init(&w->cond, NULL);
+		if (pthread_create(&w->thread, &attr, io_worker, w) != 0) {
+			/* The remaining slots are done synchronously */
+			pthread_cond_destroy(&w->cond);
+			break;
+		}
+		sio->nworkers++;
+	}
+	pthread_attr_destroy(&attr);
+#endif
+	return sio;
+}
+
+void stripe_io_free(struct stripe_io *sio)
+{
+	int i;
+
+	if (!sio)
+		return;
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&sio->lock);
+	sio->stop = 1;
+	for (i = 0; i < sio->nworkers; i++)
+		pthread_cond_signal(&sio->workers[i].cond);
+	pthread_mutex_unlock(&sio->lock);
+	for (i = 0; i < sio->nworkers; i++) {
+		pthread_join(sio->workers[i].thread, NULL);
+		pthread_cond_destroy(&sio->workers[i].cond);
+	}
+	free(sio->workers);
+	pthread_cond_destroy(&sio->done);
+	pthread_mutex_destroy(&sio->lock);
+#endif
+	for (i = 0; i < sio->nbatch; i++)
+		free_batch(&sio->batch[i]);
+	free(sio->sync);
+	free(sio->dpos);
+	free(sio);
+}
+
+/* Can 'sio' be used for this geometry and number of backups? */
+static int stripe_io_fits(struct stripe_io *sio, int raid_disks,
+			  int chunk_size, int level, int layout, int nwrites)
+{
+	return sio && sio->raid_disks == raid_disks &&
+		sio->chunk_size == chunk_size && sio->level == level &&
+		sio->layout == layout && sio->nwrites >= nwrites;
+}
+
+/* Describe the transfer of chunks of 'stripes' consecutive stripes
+ * starting at 'first' between member 'disk' and the batch buffer.
+ * In the buffer a stripe has the data blocks in order followed by P
+ * and Q when 'by_role', else the members' chunks in device order.
+ */
+static void setup_member_io(struct member_io *mio, enum io_op op,
+			    struct stripe_batch *b, struct stripe_map *sm,
+			    int disk, int fd, unsigned long long offset,
+			    int chunk_size, unsigned long long first,
+			    int stripes, int by_role)
+{
+	int n;
+
+	mio->op = op;
+	mio->fd = fd;
+	mio->offset = offset + first * chunk_size;
+	mio->nr = stripes;
+	for (n = 0; n < stripes; n++) {
+		int pos = disk;
+
+		if (by_role) {
+			int role = stripe_layout(sm, first + n)->role[disk];
+			pos = role >= 0 ? role : sm->data_disks - 1 - role;
+		}
+		mio->iov[n].iov_base = b->buf +
+			((size_t)n * sm->raid_disks + pos) * chunk_size;
+		mio->iov[n].iov_len = chunk_size;
+		mio->bad[n] = 0;
+	}
+}
+
+/* Start reading the batch of stripes from 'first' into 'b' for
+ * save_stripes(), and return the stripe after it.
+ */
+static unsigned long long read_batch(struct stripe_io *sio,
+				     struct stripe_batch *b,
+				     struct stripe_map *sm,
+				     int *source, unsigned long long *offsets,
+				     int chunk_size, unsigned long long first,
+				     unsigned long long last, int max_stripes)
+{
+	int i;
+
+	b->stripes = max_stripes;
+	if (first + b->stripes > last)
+		b->stripes = last - first;
+	for (i = 0; i < sm->raid_disks; i++) {
+		setup_member_io(&b->io[i], IO_READ, b, sm, i, source[i],
+				offsets[i], chunk_size, first, b->stripes, 1);
+		start_io(sio, &b->io[i]);
+	}
+	return first + b->stripes;
+}
+
+/* Reconstruct the missing data blocks of one stripe in 'buf', which
+ * holds the data blocks in order followed by P and Q.
+ * fblock[] lists the positions in 'buf' that could not be read
+ * and fdisk[] the matching members.
+ */
+static int rebuild_stripe(struct stripe_map *sm, struct stripe_layout *sl,
+			  int chunk_size, char *buf,
+			  int failed, int *fdisk, int *fblock)
+{
+	int data_disks = sm->data_disks;
+	int i;
+
+	if (failed == 0 || fblock[0] >= data_disks)
+		/* all data disks are good */
+		;
+	else if (failed == 1 || fblock[1] >= data_disks+1) {
+		/* one failed data disk and good parity */
+		char *bufs[data_disks];
+		for (i=0; i < data_disks; i++)
+			if (fblock[0] == i)
+				bufs[i] = buf + data_disks*chunk_size;
+			else
+				bufs[i] = buf + i*chunk_size;
+
+		xor_blocks(buf + fblock[0]*chunk_size,
+			   bufs, data_disks, chunk_size);
+	} else if (failed > 2 || sm->level != 6)
+		/* too much failure */
+		return -1;
+	else {
+		/* RAID6 computations needed. */
+		uint8_t *bufs[sm->syndrome_disks+2];
+		int snum;
+		int syndrome_disks = sm->syndrome_disks;
+
+		/* For DDF, q is over 'raid_disks' blocks in device
+		 * order and 'p' and 'q' get to be all zero.
+		 * For md, q is over 'data_disks' blocks starting
+		 * immediately after 'q'.
+		 * Either way the stripe map has the order.
+		 */
+		for (snum = 0; snum < syndrome_disks; snum++) {
+			int dnum = sl->slot[snum];
+			if (dnum < 0) {
+				bufs[snum] = zero;
+				continue;
+			}
+			/* i is the logical block number, so is index to 'buf'.
+			 * dnum is physical disk number
+			 * snum is the syndrome number
+			 */
+			i = sl->role[dnum];
+			bufs[snum] = (uint8_t*)buf + chunk_size * i;
+
+			if (fblock[0] == i)
+				fdisk[0] = snum;
+			if (fblock[1] == i)
+				fdisk[1] = snum;
+		}
+
+		/* Place P and Q blocks at end of bufs */
+		bufs[syndrome_disks] = (uint8_t*)buf + chunk_size * data_disks;
+		bufs[syndrome_disks+1] = (uint8_t*)buf + chunk_size * (data_disks+1);
+
+		if (fblock[1] == data_disks)
+			/* One data failed, and parity failed */
+			raid6_datap_recov(syndrome_disks+2, chunk_size,
+					  fdisk[0], bufs, 0);
+		else {
+			/* Two data blocks failed, P,Q OK */
+			raid6_2data_recov(syndrome_disks+2, chunk_size,
+					  fdisk[0], fdisk[1], bufs, 0);
+		}
+	}
+	return 0;
+}
+
 /*******************************************************************************
  * Function:	save_stripes
  * Description:
@@ -533,8 +1907,10 @@ int raid6_check_disks(int data_disks, int start, int chunk_size,
  *			  [bytes]
  *	length	-	: length of data to read (must be stripe-aligned)
  *			  [bytes]
- *	buf		: buffer for data. It is large enough to hold
- *			  one stripe. It is stripe aligned
+ *	buf		: buffer for data. Only used if dest is NULL, when
+ *			  it must be large enough to hold 'length' bytes
+ *	sio		: batch buffers and I/O workers from stripe_io_new(),
+ *			  or NULL to set up temporary ones
  * Returns:
  *	 0 : success
  *	-1 : fail
@@ -543,16 +1919,24 @@ int save_stripes(int *source, unsigned long long *offsets,
 		 int raid_disks, int chunk_size, int level, int layout,
 		 int nwrites, int *dest,
 		 unsigned long long start, unsigned long long length,
-		 char *buf)
+		 char *buf, struct stripe_io *sio)
 {
 	int len;
 	int data_disks = raid_disks - (level == 0 ? 0 : level <=5 ? 1 : 2);
-	int disk;
 	int i;
 	unsigned long long length_test;
-
-	if (!tables_ready)
-		make_tables();
+	unsigned long long stripe, last, next;
+	struct stripe_map *sm = stripe_map_get(level, layout, raid_disks);
+	struct stripe_io *tmp = NULL;
+	struct stripe_batch *batch;
+	off_t *dpos;
+	int nbatch;
+	int cur = 0;
+	int max_stripes;
+	int rv = 0;
+
+	if (!sm)
+		return -1;
 	ensure_zero_has_size(chunk_size);
 
 	len = data_disks * chunk_size;
@@ -567,135 +1951,134 @@ int save_stripes(int *source, unsigned long long *offsets,
 			length_test);
 		abort();
 	}
+	if (length == 0)
+		return 0;
+	if (!dest)
+		nwrites = 0;
+
+	stripe = start/chunk_size/data_disks;
+	last = stripe + length / len;
+	/* Read with io[0..raid_disks-1], write backups with the rest */
+	if (!stripe_io_fits(sio, raid_disks, chunk_size, level, layout,
+			    nwrites)) {
+		sio = tmp = stripe_io_new(raid_disks, chunk_size, level, layout,
+					  nwrites, last - stripe);
+		if (!sio)
+			return -1;
+	}
+	batch = sio->batch;
+	max_stripes = sio->max_stripes;
+	if ((unsigned long long)max_stripes > last - stripe)
+		max_stripes = last - stripe;
+	nbatch = (last - stripe + max_stripes - 1) / max_stripes;
+	if (nbatch > sio->nbatch)
+		nbatch = sio->nbatch;
+	for (i = 0; i < nbatch; i++)
+		reset_batch(&batch[i]);
+	/* Backups are written at explicit offsets so that
+	 * several batches can be in flight at once.
+	 */
+	dpos = sio->dpos;
+	for (i = 0; i < nwrites; i++)
+		dpos[i] = lseek64(dest[i], 0, SEEK_CUR);
+
+	next = read_batch(sio, &batch[0], sm, source, offsets, chunk_size,
+			  stripe, last, max_stripes);
+	while (stripe < last) {
+		struct stripe_batch *b = &batch[cur];
+		int n;
+
+		if (next < last && nbatch > 1) {
+			/* Start reading the next batch while we work on
+			 * this one, once its buffer has been written out.
+			 */
+			struct stripe_batch *nb = &batch[(cur + 1) % nbatch];
+
+			if (wait_io(sio, nb->io + raid_disks, nwrites))
+				rv = -1;
+			next = read_batch(sio, nb, sm, source, offsets,
+					  chunk_size, next, last, max_stripes);
+		}
+		wait_io(sio, b->io, raid_disks);
+		if (rv)
+			break;
 
-	while (length > 0) {
-		int failed = 0;
-		int fdisk[3], fblock[3];
-		for (disk = 0; disk < raid_disks ; disk++) {
-			unsigned long long offset;
-			int dnum;
-
-			offset = (start/chunk_size/data_disks)*chunk_size;
-			dnum = geo_map(disk < data_disks ? disk : data_disks - disk - 1,
-				       start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (dnum < 0) abort();
-			if (source[dnum] < 0 ||
-			    lseek64(source[dnum],
-				    offsets[dnum] + offset, 0) < 0 ||
-			    read(source[dnum], buf+disk * chunk_size,
-				 chunk_size) != chunk_size) {
-				if (failed <= 2) {
+		for (n = 0; n < b->stripes; n++) {
+			struct stripe_layout *sl = stripe_layout(sm, stripe + n);
+			char *sbuf = b->buf + (size_t)n * raid_disks * chunk_size;
+			int failed = 0;
+			int fdisk[3], fblock[3];
+			int disk;
+
+			for (disk = 0; disk < raid_disks ; disk++) {
+				int dnum;
+
+				if (disk < data_disks)
+					dnum = sl->data[disk];
+				else if (disk == data_disks)
+					dnum = sl->pdisk;
+				else
+					dnum = sl->qdisk;
+				if (b->io[dnum].bad[n] && failed <= 2) {
 					fdisk[failed] = dnum;
 					fblock[failed] = disk;
 					failed++;
 				}
 			}
-		}
-		if (failed == 0 || fblock[0] >= data_disks)
-			/* all data disks are good */
-			;
-		else if (failed == 1 || fblock[1] >= data_disks+1) {
-			/* one failed data disk and good parity */
-			char *bufs[data_disks];
-			for (i=0; i < data_disks; i++)
-				if (fblock[0] == i)
-					bufs[i] = buf + data_disks*chunk_size;
-				else
-					bufs[i] = buf + i*chunk_size;
-
-			xor_blocks(buf + fblock[0]*chunk_size,
-				   bufs, data_disks, chunk_size);
-		} else if (failed > 2 || level != 6)
-			/* too much failure */
-			return -1;
-		else {
-			/* RAID6 computations needed. */
-			uint8_t *bufs[data_disks+4];
-			int qdisk;
-			int syndrome_disks;
-			disk = geo_map(-1, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			qdisk = geo_map(-2, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (is_ddf(layout)) {
-				/* q over 'raid_disks' blocks, in device order.
-				 * 'p' and 'q' get to be all zero
-				 */
-				for (i = 0; i < raid_disks; i++)
-					bufs[i] = zero;
-				for (i = 0; i < data_disks; i++) {
-					int dnum = geo_map(i,
-							   start/chunk_size/data_disks,
-							   raid_disks, level, layout);
-					int snum;
-					/* i is the logical block number, so is index to 'buf'.
-					 * dnum is physical disk number
-					 * and thus the syndrome number.
-					 */
-					snum = dnum;
-					bufs[snum] = (uint8_t*)buf + chunk_size * i;
-				}
-				syndrome_disks = raid_disks;
-			} else {
-				/* for md, q is over 'data_disks' blocks,
-				 * starting immediately after 'q'
-				 * Note that for the '_6' variety, the p block
-				 * makes a hole that we need to be careful of.
-				 */
-				int j;
-				int snum = 0;
-				for (j = 0; j < raid_disks; j++) {
-					int dnum = (qdisk + 1 + j) % raid_disks;
-					if (dnum == disk || dnum == qdisk)
-						continue;
-					for (i = 0; i < data_disks; i++)
-						if (geo_map(i,
-							    start/chunk_size/data_disks,
-							    raid_disks, level, layout) == dnum)
-							break;
-					/* i is the logical block number, so is index to 'buf'.
-					 * dnum is physical disk number
-					 * snum is syndrome disk for which 0 is immediately after Q
-					 */
-					bufs[snum] = (uint8_t*)buf + chunk_size * i;
-
-					if (fblock[0] == i)
-						fdisk[0] = snum;
-					if (fblock[1] == i)
-						fdisk[1] = snum;
-					snum++;
-				}
-
-				syndrome_disks = data_disks;
+			if (rebuild_stripe(sm, sl, chunk_size, sbuf,
+					   failed, fdisk, fblock) != 0) {
+				rv = -1;
+				break;
 			}
-
-			/* Place P and Q blocks at end of bufs */
-			bufs[syndrome_disks] = (uint8_t*)buf + chunk_size * data_disks;
-			bufs[syndrome_disks+1] = (uint8_t*)buf + chunk_size * (data_disks+1);
-
-			if (fblock[1] == data_disks)
-				/* One data failed, and parity failed */
-				raid6_datap_recov(syndrome_disks+2, chunk_size,
-						  fdisk[0], bufs, 0);
-			else {
-				/* Two data blocks failed, P,Q OK */
-				raid6_2data_recov(syndrome_disks+2, chunk_size,
-						  fdisk[0], fdisk[1], bufs, 0);
+			if (!dest) {
+				/* build next stripe in buffer */
+				memcpy(buf, sbuf, len);
+				buf += len;
+			}
+		}
+		if (rv)
+			break;
+		for (i = 0; i < nwrites; i++) {
+			struct member_io *mio = &b->io[raid_disks + i];
+
+			mio->op = IO_WRITE;
+			mio->fd = dest[i];
+			mio->offset = dpos[i];
+			mio->nr = b->stripes;
+			for (n = 0; n < b->stripes; n++) {
+				mio->iov[n].iov_base = b->buf +
+					(size_t)n * raid_disks * chunk_size;
+				mio->iov[n].iov_len = len;
+				mio->bad[n] = 0;
 			}
+			dpos[i] += (off_t)b->stripes * len;
+			start_io(sio, mio);
 		}
-		if (dest) {
-			for (i = 0; i < nwrites; i++)
-				if (write(dest[i], buf, len) != len)
-					return -1;
-		} else {
-			/* build next stripe in buffer */
-			buf += len;
+		stripe += b->stripes;
+		cur = (cur + 1) % nbatch;
+		if (next < last && nbatch == 1) {
+			/* A stripe_io made for shorter calls has just
+			 * the one buffer, so no reading ahead.
+			 */
+			if (wait_io(sio, b->io + raid_disks, nwrites)) {
+				rv = -1;
+				break;
+			}
+			next = read_batch(sio, b, sm, source, offsets,
+					  chunk_size, next, last, max_stripes);
 		}
-		length -= len;
-		start += len;
 	}
-	return 0;
+	/* Nothing may still be using the buffers when we return */
+	for (i = 0; i < nbatch; i++) {
+		if (wait_io(sio, batch[i].io + raid_disks, nwrites))
+			rv = -1;
+		wait_io(sio, batch[i].io, raid_disks);
+	}
+	/* Leave the backups positioned after the data, as write() would */
+	for (i = 0; i < nwrites; i++)
+		lseek64(dest[i], dpos[i], SEEK_SET);
+	stripe_io_free(tmp);
+	return rv;
 }
 
 /* Restore data:
@@ -706,136 +2089,135 @@ int save_stripes(int *source, unsigned long long *offsets,
  *  A start and length.
  * The length must be a multiple of the stripe size.
  *
- * We build a full stripe in memory and then write it out.
+ * We build a batch of full stripes in memory and then write them out,
+ * building the next batch while the previous ones are being written.
+ * The batches come from 'sio' if it suits, see stripe_io_new().
  * We assume that there are enough working devices.
  */
 int restore_stripes(int *dest, unsigned long long *offsets,
 		    int raid_disks, int chunk_size, int level, int layout,
 		    int source, unsigned long long read_offset,
 		    unsigned long long start, unsigned long long length,
-		    char *src_buf)
+		    char *src_buf, struct stripe_io *sio)
 {
-	char *stripe_buf;
-	char **stripes = xmalloc(raid_disks * sizeof(char*));
-	char **blocks = xmalloc(raid_disks * sizeof(char*));
+	struct stripe_io *tmp = NULL;
+	struct stripe_batch *batch;
+	char *blocks[raid_disks];
 	int i;
-	int rv;
-
+	int rv = 0;
+	struct stripe_map *sm = stripe_map_get(level, layout, raid_disks);
 	int data_disks = raid_disks - (level == 0 ? 0 : level <= 5 ? 1 : 2);
-
-	if (posix_memalign((void**)&stripe_buf, 4096, raid_disks * chunk_size))
-		stripe_buf = NULL;
-
-	if (zero == NULL || chunk_size > zero_size) {
-		if (zero)
-			free(zero);
-		zero = xcalloc(1, chunk_size);
-		zero_size = chunk_size;
-	}
-
-	if (stripe_buf == NULL || stripes == NULL || blocks == NULL ||
-	    zero == NULL) {
-		rv = -2;
-		goto abort;
+	unsigned int len = data_disks * chunk_size;
+	unsigned long long stripe, last;
+	int max_stripes;
+	int nbatch;
+	int cur = 0;
+
+	if (sm == NULL || length % len)
+		return sm ? -3 : -2;
+	if (length == 0)
+		return 0;
+	ensure_zero_has_size(chunk_size);
+	stripe = start/chunk_size/data_disks;
+	last = stripe + length / len;
+	if (!stripe_io_fits(sio, raid_disks, chunk_size, level, layout, 0)) {
+		sio = tmp = stripe_io_new(raid_disks, chunk_size, level, layout,
+					  0, last - stripe);
+		if (!sio)
+			return -2;
 	}
-	for (i = 0; i < raid_disks; i++)
-		stripes[i] = stripe_buf + i * chunk_size;
-	while (length > 0) {
-		unsigned int len = data_disks * chunk_size;
-		unsigned long long offset;
-		int disk, qdisk;
-		int syndrome_disks;
-		if (length < len) {
-			rv = -3;
-			goto abort;
+	batch = sio->batch;
+	max_stripes = sio->max_stripes;
+	if ((unsigned long long)max_stripes > last - stripe)
+		max_stripes = last - stripe;
+	nbatch = (last - stripe + max_stripes - 1) / max_stripes;
+	if (nbatch > sio->nbatch)
+		nbatch = sio->nbatch;
+	for (i = 0; i < nbatch; i++)
+		reset_batch(&batch[i]);
+
+	while (stripe < last && rv == 0) {
+		struct stripe_batch *b = &batch[cur];
+		int n;
+
+		/* This buffer is free once its last batch is written */
+		if (wait_io(sio, b->io, raid_disks)) {
+			rv = -1;
+			break;
 		}
-		for (i = 0; i < data_disks; i++) {
-			int disk = geo_map(i, start/chunk_size/data_disks,
-					   raid_disks, level, layout);
-			if (src_buf == NULL) {
-				/* read from file */
-				if (lseek64(source, read_offset, 0) !=
-					 (off64_t)read_offset) {
-					rv = -1;
-					goto abort;
-				}
-				if (read(source,
-					 stripes[disk],
-					 chunk_size) != chunk_size) {
-					rv = -1;
-					goto abort;
+		b->stripes = max_stripes;
+		if (stripe + b->stripes > last)
+			b->stripes = last - stripe;
+
+		for (n = 0; n < b->stripes; n++) {
+			struct stripe_layout *sl = stripe_layout(sm, stripe + n);
+			char *sbuf = b->buf + (size_t)n * raid_disks * chunk_size;
+#define CHUNK(disk) (sbuf + (disk) * chunk_size)
+
+			for (i = 0; i < data_disks; i++) {
+				int disk = sl->data[i];
+				if (src_buf == NULL) {
+					/* read from file */
+					if (pread(source, CHUNK(disk), chunk_size,
+						  read_offset) != chunk_size) {
+						rv = -1;
+						break;
+					}
+				} else {
+					/* read from input buffer */
+					memcpy(CHUNK(disk),
+					       src_buf + read_offset,
+					       chunk_size);
 				}
-			} else {
-				/* read from input buffer */
-				memcpy(stripes[disk],
-				       src_buf + read_offset,
-				       chunk_size);
+				read_offset += chunk_size;
 			}
-			read_offset += chunk_size;
-		}
-		/* We have the data, now do the parity */
-		offset = (start/chunk_size/data_disks) * chunk_size;
-		switch (level) {
-		case 4:
-		case 5:
-			disk = geo_map(-1, start/chunk_size/data_disks,
-					   raid_disks, level, layout);
-			for (i = 0; i < data_disks; i++)
-				blocks[i] = stripes[(disk+1+i) % raid_disks];
-			xor_blocks(stripes[disk], blocks, data_disks, chunk_size);
-			break;
-		case 6:
-			disk = geo_map(-1, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			qdisk = geo_map(-2, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (is_ddf(layout)) {
-				/* q over 'raid_disks' blocks, in device order.
-				 * 'p' and 'q' get to be all zero
+			if (rv)
+				break;
+			/* We have the data, now do the parity */
+			switch (level) {
+			case 4:
+			case 5:
+				for (i = 0; i < data_disks; i++)
+					blocks[i] = CHUNK(sl->slot[i]);
+				xor_blocks(CHUNK(sl->pdisk), blocks,
+					   data_disks, chunk_size);
+				break;
+			case 6:
+				/* The stripe map gives the syndrome order:
+				 * device order with zero for 'p' and 'q' for
+				 * DDF, else starting immediately after 'q'
+				 * and skipping 'p'.
 				 */
-				for (i = 0; i < raid_disks; i++)
-					if (i == disk || i == qdisk)
+				for (i = 0; i < sm->syndrome_disks; i++)
+					if (sl->slot[i] < 0)
 						blocks[i] = (char*)zero;
 					else
-						blocks[i] = stripes[i];
-				syndrome_disks = raid_disks;
-			} else {
-				/* for md, q is over 'data_disks' blocks,
-				 * starting immediately after 'q'
-				 */
-				for (i = 0; i < data_disks; i++)
-					blocks[i] = stripes[(qdisk+1+i) % raid_disks];
-
-				syndrome_disks = data_disks;
+						blocks[i] = CHUNK(sl->slot[i]);
+				qsyndrome((uint8_t*)CHUNK(sl->pdisk),
+					  (uint8_t*)CHUNK(sl->qdisk),
+					  (uint8_t**)blocks,
+					  sm->syndrome_disks, chunk_size);
+				break;
 			}
-			qsyndrome((uint8_t*)stripes[disk],
-				  (uint8_t*)stripes[qdisk],
-				  (uint8_t**)blocks,
-				  syndrome_disks, chunk_size);
+#undef CHUNK
+		}
+		if (rv)
 			break;
+		for (i = 0; i < raid_disks; i++) {
+			if (dest[i] < 0)
+				continue;
+			setup_member_io(&b->io[i], IO_WRITE, b, sm, i, dest[i],
+					offsets[i], chunk_size, stripe,
+					b->stripes, 0);
+			start_io(sio, &b->io[i]);
 		}
-		for (i=0; i < raid_disks ; i++)
-			if (dest[i] >= 0) {
-				if (lseek64(dest[i],
-					 offsets[i]+offset, 0) < 0) {
-					rv = -1;
-					goto abort;
-				}
-				if (write(dest[i], stripes[i],
-					 chunk_size) != chunk_size) {
-					rv = -1;
-					goto abort;
-				}
-			}
-		length -= len;
-		start += len;
+		stripe += b->stripes;
+		cur = (cur + 1) % nbatch;
 	}
-	rv = 0;
-
-abort:
-	free(stripe_buf);
-	free(stripes);
-	free(blocks);
+	for (i = 0; i < nbatch; i++)
+		if (wait_io(sio, batch[i].io, raid_disks))
+			rv = -1;
+	stripe_io_free(tmp);
 	return rv;
 }
 
@@ -855,15 +2237,16 @@ int test_stripes(int *source, unsigned long long *offsets,
 	int i;
 	int diskP, diskQ;
 	int data_disks = raid_disks - (level == 5 ? 1: 2);
+	struct stripe_map *sm = stripe_map_get(level, layout, raid_disks);
 
-	if (!tables_ready)
-		make_tables();
-
+	if (!sm)
+		return -1;
 	for ( i = 0 ; i < raid_disks ; i++)
 		stripes[i] = stripe_buf + i * chunk_size;
 
 	while (length > 0) {
 		int disk;
+		struct stripe_layout *sl = stripe_layout(sm, start/chunk_size);
 
 		for (i = 0 ; i < raid_disks ; i++) {
 			if ((lseek64(source[i], offsets[i]+start, 0) < 0) ||
@@ -877,23 +2260,24 @@ int test_stripes(int *source, unsigned long long *offsets,
 				return -1;
 			}
 		}
-		for (i = 0 ; i < data_disks ; i++) {
-			int disk = geo_map(i, start/chunk_size, raid_disks,
-					   level, layout);
-			blocks[i] = stripes[disk];
-			printf("%d->%d\n", i, disk);
-		}
+		for (i = 0 ; i < data_disks ; i++)
+			printf("%d->%d\n", i, sl->data[i]);
 		switch(level) {
 		case 6:
-			qsyndrome(p, q, (uint8_t**)blocks, data_disks, chunk_size);
-			diskP = geo_map(-1, start/chunk_size, raid_disks,
-				       level, layout);
+			ensure_zero_has_size(chunk_size);
+			for (i = 0 ; i < sm->syndrome_disks ; i++)
+				if (sl->slot[i] < 0)
+					blocks[i] = (char*)zero;
+				else
+					blocks[i] = stripes[sl->slot[i]];
+			qsyndrome(p, q, (uint8_t**)blocks, sm->syndrome_disks,
+				  chunk_size);
+			diskP = sl->pdisk;
 			if (memcmp(p, stripes[diskP], chunk_size) != 0) {
 				printf("P(%d) wrong at %llu\n", diskP,
 				       start / chunk_size);
 			}
-			diskQ = geo_map(-2, start/chunk_size, raid_disks,
-				       level, layout);
+			diskQ = sl->qdisk;
 			if (memcmp(q, stripes[diskQ], chunk_size) != 0) {
 				printf("Q(%d) wrong at %llu\n", diskQ,
 				       start / chunk_size);
@@ -915,6 +2299,427 @@ int test_stripes(int *source, unsigned long long *offsets,
 	return 0;
 }
 
+/* Check every xor, syndrome and recovery routine the CPU supports against the
+ * byte-at-a-time references, over a range of sizes, disk counts
+ * and (mis)alignments.
+ */
+int test_kernels(void)
+{
+	static const int sizes[] = { 1, 7, 8, 63, 64, 127, 4096, 4096+72, 65536 };
+	static const int ndisks[] = { 1, 2, 3, 5, 16, 31 };
+	int maxsize = 65536 + 64;
+	char *data[31], *ref, *out, *ref2, *out2;
+	struct xor_algo *xa, *xref = NULL;
+	struct raid6_algo *ra, *rref = NULL;
+	struct raid6_recov_algo *ca, *cref = NULL;
+	unsigned int si, di;
+	int i, j, errors = 0, failed;
+
+	for (xa = xor_algos; xa->name; xa++)
+		if (strcmp(xa->name, "bytes") == 0)
+			xref = xa;
+	srandom(1);
+	for (i = 0; i < 31; i++) {
+		data[i] = xmalloc(maxsize);
+		for (j = 0; j < maxsize; j++)
+			data[i][j] = random();
+	}
+	ref = xmalloc(maxsize);
+	out = xmalloc(maxsize);
+	ref2 = xmalloc(maxsize);
+	out2 = xmalloc(maxsize);
+
+	for (xa = xor_algos; xa->name; xa++) {
+		if (xa->valid && !xa->valid()) {
+			printf("xor %s: not supported\n", xa->name);
+			continue;
+		}
+		failed = errors;
+		for (si = 0; si < sizeof(sizes)/sizeof(sizes[0]); si++)
+		for (di = 0; di < sizeof(ndisks)/sizeof(ndisks[0]); di++) {
+			char *src[31];
+			int misalign = (si + di) % 3;
+
+			for (i = 0; i < ndisks[di]; i++)
+				src[i] = data[i] + misalign + i % 2;
+			xref->do_xor(ref, src, ndisks[di], sizes[si]);
+			xa->do_xor(out + misalign, src, ndisks[di], sizes[si]);
+			if (memcmp(ref, out + misalign, sizes[si]) != 0) {
+				printf("xor %s: wrong result for %d disks, size %d\n",
+				       xa->name, ndisks[di], sizes[si]);
+				errors++;
+			}
+		}
+		if (errors == failed)
+			printf("xor %s: ok\n", xa->name);
+		else
+			printf("xor %s: FAILED\n", xa->name);
+	}
+	printf("xor_blocks uses %s\n", xor_select()->name);
+
+	for (ra = raid6_algos; ra->name; ra++)
+		if (strcmp(ra->name, "bytes") == 0)
+			rref = ra;
+	for (ra = raid6_algos; ra->name; ra++) {
+		if (ra->valid && !ra->valid()) {
+			printf("raid6 %s: not supported\n", ra->name);
+			continue;
+		}
+		failed = errors;
+		for (si = 0; si < sizeof(sizes)/sizeof(sizes[0]); si++)
+		for (di = 0; di < sizeof(ndisks)/sizeof(ndisks[0]); di++) {
+			uint8_t *src[31];
+			int misalign = (si + di) % 3;
+			int size = sizes[si];
+
+			for (i = 0; i < ndisks[di]; i++)
+				src[i] = (uint8_t *)data[i] + misalign + i % 2;
+			rref->gen_syndrome((uint8_t *)ref, (uint8_t *)ref2,
+					   src, ndisks[di], size);
+			ra->gen_syndrome((uint8_t *)out + misalign,
+					 (uint8_t *)out2, src, ndisks[di], size);
+			if (memcmp(ref, out + misalign, size) != 0 ||
+			    memcmp(ref2, out2, size) != 0) {
+				printf("raid6 %s: wrong result for %d disks, size %d\n",
+				       ra->name, ndisks[di], size);
+				errors++;
+			}
+		}
+		if (errors == failed)
+			printf("raid6 %s: ok\n", ra->name);
+		else
+			printf("raid6 %s: FAILED\n", ra->name);
+	}
+	printf("qsyndrome uses %s\n", raid6_select()->name);
+
+	for (ca = raid6_recov_algos; ca->name; ca++)
+		if (strcmp(ca->name, "bytes") == 0)
+			cref = ca;
+	for (ca = raid6_recov_algos; ca->name; ca++) {
+		if (ca->valid && !ca->valid()) {
+			printf("recov %s: not supported\n", ca->name);
+			continue;
+		}
+		failed = errors;
+		for (si = 0; si < sizeof(sizes)/sizeof(sizes[0]); si++)
+		for (j = 0; j < 256; j += 51) {
+			int size = sizes[si];
+			uint8_t pbc = j, qc = 255 - j / 2;
+			int misalign = si % 3;
+
+			memcpy(ref, data[2], size);
+			memcpy(ref2, data[3], size);
+			memcpy(out + misalign, data[2], size);
+			memcpy(out2, data[3], size);
+			memcpy(data[6], data[4], size);
+			cref->recov_2data(size, (uint8_t *)data[4],
+					  (uint8_t *)data[5], (uint8_t *)ref,
+					  (uint8_t *)ref2, pbc, qc);
+			ca->recov_2data(size, (uint8_t *)data[6],
+					(uint8_t *)data[5],
+					(uint8_t *)out + misalign,
+					(uint8_t *)out2, pbc, qc);
+			if (memcmp(ref, out + misalign, size) != 0 ||
+			    memcmp(ref2, out2, size) != 0) {
+				printf("recov %s: wrong 2data result for size %d, %d/%d\n",
+				       ca->name, size, pbc, qc);
+				errors++;
+			}
+
+			memcpy(ref, data[2], size);
+			memcpy(ref2, data[3], size);
+			memcpy(out, data[2], size);
+			memcpy(out2 + misalign, data[3], size);
+			cref->recov_datap(size, (uint8_t *)ref,
+					  (uint8_t *)data[5], (uint8_t *)ref2, qc);
+			ca->recov_datap(size, (uint8_t *)out,
+					(uint8_t *)data[5],
+					(uint8_t *)out2 + misalign, qc);
+			if (memcmp(ref, out, size) != 0 ||
+			    memcmp(ref2, out2 + misalign, size) != 0) {
+				printf("recov %s: wrong datap result for size %d, %d\n",
+				       ca->name, size, qc);
+				errors++;
+			}
+		}
+		if (errors == failed)
+			printf("recov %s: ok\n", ca->name);
+		else
+			printf("recov %s: FAILED\n", ca->name);
+	}
+	printf("raid6 recovery uses %s\n", raid6_recov_select()->name);
+
+	/* Every stripe_map must agree with geo_map() */
+	failed = errors;
+	for (j = 0; j < 4 * 21; j++) {
+		int level = (int[]){0, 4, 5, 6}[j / 21];
+		int layout = j % 21;
+		int raid_disks;
+
+		for (raid_disks = level == 6 ? 4 : 2; raid_disks <= 16;
+		     raid_disks++) {
+			struct stripe_map *sm = stripe_map_get(level, layout,
+							       raid_disks);
+			unsigned long long stripe;
+
+			if (!sm)
+				continue;
+			for (stripe = 0; stripe < 3ULL * raid_disks * raid_disks;
+			     stripe++) {
+				struct stripe_layout *sl = stripe_layout(sm, stripe);
+				int bad = 0;
+
+				for (i = 0; i < sm->data_disks; i++)
+					if (sl->data[i] != geo_map(i, stripe, raid_disks,
+								   level, layout))
+						bad = 1;
+				if (level >= 4 &&
+				    sl->pdisk != geo_map(-1, stripe, raid_disks,
+							 level, layout))
+					bad = 1;
+				if (level == 6 &&
+				    sl->qdisk != geo_map(-2, stripe, raid_disks,
+							 level, layout))
+					bad = 1;
+				if (bad) {
+					printf("stripe map: wrong for level %d layout %d disks %d stripe %llu\n",
+					       level, layout, raid_disks, stripe);
+					errors++;
+					break;
+				}
+			}
+		}
+	}
+	printf("stripe map: %s\n", errors == failed ? "ok" : "FAILED");
+
+	for (i = 0; i < 31; i++)
+		free(data[i]);
+	free(ref);
+	free(out);
+	free(ref2);
+	free(out2);
+	return errors ? -1 : 0;
+}
+
+/* Benchmark mode.
+ * Every result is printed as one line of space separated key=value
+ * pairs so that runs can be compared by script.  Rates are in GB/s of
+ * data (not parity) processed.
+ */
+#define BENCH_NSEC	50000000LL
+
+static long long bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void bench_kernels(void)
+{
+	static const int ndisks[] = { 4, 6, 12, 24 };
+	static const int chunks[] = { 4096, 65536, 524288 };
+	struct xor_algo *xa;
+	struct raid6_algo *ra;
+	struct raid6_recov_algo *ca;
+	unsigned int ci, di;
+	int i;
+
+	for (ci = 0; ci < sizeof(chunks)/sizeof(chunks[0]); ci++)
+	for (di = 0; di < sizeof(ndisks)/sizeof(ndisks[0]); di++) {
+		int chunk = chunks[ci];
+		int disks = ndisks[di];
+		char *mem;
+		char *bufs[disks + 2];
+		long long t0, el, n;
+
+		if (posix_memalign((void**)&mem, 4096, (disks + 2) * chunk))
+			return;
+		for (i = 0; i < (disks + 2) * chunk; i++)
+			mem[i] = random();
+		for (i = 0; i < disks + 2; i++)
+			bufs[i] = mem + i * chunk;
+
+		for (xa = xor_algos; xa->name; xa++) {
+			if (xa->valid && !xa->valid())
+				continue;
+			t0 = bench_now();
+			n = 0;
+			do {
+				xa->do_xor(bufs[disks], bufs, disks, chunk);
+				n++;
+			} while ((el = bench_now() - t0) < BENCH_NSEC);
+			printf("op=xor algo=%s disks=%d chunk=%d gbps=%.3f\n",
+			       xa->name, disks, chunk,
+			       (double)n * disks * chunk / el);
+		}
+		for (ra = raid6_algos; ra->name; ra++) {
+			if (ra->valid && !ra->valid())
+				continue;
+			printf("op=syndrome algo=%s disks=%d chunk=%d gbps=%.3f\n",
+			       ra->name, disks, chunk,
+			       raid6_algo_speed(ra, (uint8_t **)bufs,
+						disks, chunk, BENCH_NSEC)
+			       * disks * chunk / 1e9);
+		}
+		for (ca = raid6_recov_algos; ca->name; ca++) {
+			if (ca->valid && !ca->valid())
+				continue;
+			t0 = bench_now();
+			n = 0;
+			do {
+				ca->recov_2data(chunk, (uint8_t *)bufs[0],
+						(uint8_t *)bufs[1],
+						(uint8_t *)bufs[2],
+						(uint8_t *)bufs[3], 0x8e, 0x47);
+				n++;
+			} while ((el = bench_now() - t0) < BENCH_NSEC);
+			printf("op=recov_2data algo=%s chunk=%d gbps=%.3f\n",
+			       ca->name, chunk, (double)n * 2 * chunk / el);
+			t0 = bench_now();
+			n = 0;
+			do {
+				ca->recov_datap(chunk, (uint8_t *)bufs[0],
+						(uint8_t *)bufs[1],
+						(uint8_t *)bufs[2], 0x8e);
+				n++;
+			} while ((el = bench_now() - t0) < BENCH_NSEC);
+			printf("op=recov_datap algo=%s chunk=%d gbps=%.3f\n",
+			       ca->name, chunk, (double)n * chunk / el);
+		}
+		free(mem);
+	}
+}
+
+/* Restore 'length' bytes into files in 'dir', then save them back,
+ * intact and with one and two members missing, and compare.
+ */
+static int bench_roundtrip(char *dir, int level, int layout, int raid_disks,
+			   int chunk_size)
+{
+	int data_disks = raid_disks - (level == 5 ? 1 : 2);
+	int stripes = (16 << 20) / (data_disks * chunk_size);
+	unsigned long long length;
+	unsigned long long *offsets;
+	int *fds, *sfds;
+	char *src, *buf, *back;
+	char path[PATH_MAX];
+	int dest, missing, i;
+	int rv = 0;
+	long long t0, el;
+	struct stripe_map *sm = stripe_map_get(level, layout, raid_disks);
+
+	if (stripes < 1)
+		stripes = 1;
+	length = (unsigned long long)stripes * data_disks * chunk_size;
+	offsets = xcalloc(raid_disks, sizeof(*offsets));
+	fds = xmalloc(raid_disks * sizeof(*fds));
+	sfds = xmalloc(raid_disks * sizeof(*sfds));
+	src = xmalloc(length);
+	back = xmalloc(length);
+	buf = xmalloc(raid_disks * chunk_size);
+	for (i = 0; i + 4 <= (int)length; i += 4) {
+		uint32_t r = random();
+		memcpy(src + i, &r, 4);
+	}
+
+	for (i = 0; i < raid_disks; i++) {
+		snprintf(path, sizeof(path), "%s/test_stripe.%d", dir, i);
+		fds[i] = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+		unlink(path);
+		if (fds[i] < 0) {
+			perror(path);
+			exit(3);
+		}
+	}
+	snprintf(path, sizeof(path), "%s/test_stripe.backup", dir);
+	dest = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	unlink(path);
+	if (dest < 0) {
+		perror(path);
+		exit(3);
+	}
+
+	t0 = bench_now();
+	if (restore_stripes(fds, offsets, raid_disks, chunk_size, level,
+			    layout, -1, 0ULL, 0ULL, length, src, NULL) != 0)
+		rv = -1;
+	el = bench_now() - t0;
+	printf("op=restore level=%d layout=%d disks=%d chunk=%d gbps=%.3f\n",
+	       level, layout, raid_disks, chunk_size, (double)length / el);
+
+	for (missing = 0; missing <= level - 4; missing++) {
+		int verified;
+
+		for (i = 0; i < raid_disks; i++)
+			sfds[i] = fds[i];
+		/* lose the first data disk, then the parity as well */
+		for (i = 0; i < missing; i++)
+			sfds[i == 0 ? stripe_layout(sm, 0)->data[0] :
+			     stripe_layout(sm, 0)->pdisk] = -1;
+		if (lseek64(dest, 0, 0) != 0)
+			rv = -1;
+		t0 = bench_now();
+		if (save_stripes(sfds, offsets, raid_disks, chunk_size,
+				 level, layout, 1, &dest, 0ULL, length,
+				 buf, NULL) != 0)
+			rv = -1;
+		el = bench_now() - t0;
+		verified = pread(dest, back, length, 0) == (ssize_t)length &&
+			memcmp(back, src, length) == 0;
+		if (!verified)
+			rv = -1;
+		printf("op=save level=%d layout=%d disks=%d chunk=%d missing=%d gbps=%.3f verified=%d\n",
+		       level, layout, raid_disks, chunk_size, missing,
+		       (double)length / el, verified);
+	}
+
+	for (i = 0; i < raid_disks; i++)
+		close(fds[i]);
+	close(dest);
+	free(offsets);
+	free(fds);
+	free(sfds);
+	free(src);
+	free(back);
+	free(buf);
+	return rv;
+}
+
+int bench_stripes(char *dir)
+{
+	static const int r5layouts[] = { 0, 1, 2, 3, 4, 5 };
+	static const int r6layouts[] = { 0, 1, 2, 3, 4, 5,
+					 ALGORITHM_ROTATING_ZERO_RESTART,
+					 ALGORITHM_ROTATING_N_RESTART,
+					 ALGORITHM_ROTATING_N_CONTINUE,
+					 16, 17, 18, 19, 20 };
+	static const int ndisks[] = { 4, 6, 12 };
+	static const int chunks[] = { 65536, 524288 };
+	unsigned int ci, di, li;
+	int rv = 0;
+
+	srandom(1);
+	printf("xor_algo=%s raid6_algo=%s recov_algo=%s\n",
+	       xor_select()->name, raid6_select()->name,
+	       raid6_recov_select()->name);
+	bench_kernels();
+
+	for (ci = 0; ci < sizeof(chunks)/sizeof(chunks[0]); ci++)
+	for (di = 0; di < sizeof(ndisks)/sizeof(ndisks[0]); di++) {
+		for (li = 0; li < sizeof(r5layouts)/sizeof(r5layouts[0]); li++)
+			if (bench_roundtrip(dir, 5, r5layouts[li],
+					    ndisks[di], chunks[ci]))
+				rv = -1;
+		for (li = 0; li < sizeof(r6layouts)/sizeof(r6layouts[0]); li++)
+			if (bench_roundtrip(dir, 6, r6layouts[li],
+					    ndisks[di], chunks[ci]))
+				rv = -1;
+	}
+	return rv;
+}
+
 unsigned long long getnum(char *str, char **err)
 {
 	char *e;
@@ -942,8 +2747,14 @@ int main(int argc, char *argv[])
 	int i;
 
 	char *err = NULL;
+	if (argc == 2 && strcmp(argv[1], "kernels") == 0)
+		exit(test_kernels() ? 1 : 0);
+	if ((argc == 2 || argc == 3) && strcmp(argv[1], "bench") == 0)
+		exit(bench_stripes(argc == 3 ? argv[2] : "/dev/shm") ? 1 : 0);
 	if (argc < 10) {
 		fprintf(stderr, "Usage: test_stripe save/restore file raid_disks chunk_size level layout start length devices...\n");
+		fprintf(stderr, "   or: test_stripe kernels\n");
+		fprintf(stderr, "   or: test_stripe bench [directory]\n");
 		exit(1);
 	}
 	if (strcmp(argv[1], "save")==0)
@@ -1005,7 +2816,7 @@ int main(int argc, char *argv[])
 		int rv = save_stripes(fds, offsets,
 				      raid_disks, chunk_size, level, layout,
 				      1, &storefd,
-				      start, length, buf);
+				      start, length, buf, NULL);
 		if (rv != 0) {
 			fprintf(stderr,
 				"test_stripe: save_stripes returned %d\n", rv);
@@ -1024,7 +2835,7 @@ int main(int argc, char *argv[])
 		int rv = restore_stripes(fds, offsets,
 					 raid_disks, chunk_size, level, layout,
 					 storefd, 0ULL,
-					 start, length, NULL);
+					 start, length, NULL, NULL);
 		if (rv != 0) {
 			fprintf(stderr,
 				"test_stripe: restore_stripes returned %d\n",
@@ -10809,6 +10809,7 @@ void init_migr_record_imsm(struct supertype *st, struct imsm_dev *dev,
  *	info		: general array info
  *	buf		: input buffer
  *	length		: length of data to backup (blocks_per_unit)
+ *	sio		: stripe_io for the destination geometry, or NULL
  * Returns:
  *	 0 : success
  *,	-1 : fail
@@ -10817,7 +10818,8 @@ int save_backup_imsm(struct supertype *st,
 		     struct imsm_dev *dev,
 		     struct mdinfo *info,
 		     void *buf,
-		     int length)
+		     int length,
+		     struct stripe_io *sio)
 {
 	int rv = -1;
 	struct intel_super *super = st->sb;
@@ -10865,7 +10867,8 @@ int save_backup_imsm(struct supertype *st,
 				    * always 0 buf is already offseted */
 			    start,
 			    length,
-			    buf) != 0) {
+			    buf,
+			    sio) != 0) {
 		pr_err("Error restoring stripes\n");
 		goto abort;
 	}
@@ -12009,8 +12012,10 @@ static int imsm_manage_reshape(
 	int migr_vol_qan = 0;
 	int ndata, odata; /* [bytes] */
 	int chunk; /* [bytes] */
+	int dest_chunk; /* [bytes] */
 	struct migr_record *migr_rec;
 	char *buf = NULL;
+	struct stripe_io *save_io = NULL, *backup_io = NULL;
 	unsigned int buf_size; /* [bytes] */
 	unsigned long long max_position; /* array size [bytes] */
 	unsigned long long next_step; /* [blocks]/[bytes] */
@@ -12090,6 +12095,18 @@ static int imsm_manage_reshape(
 	max_position = sra->component_size * ndata;
 	source_layout = imsm_level_to_layout(map_src->raid_level);
 
+	/* save_stripes() and save_backup_imsm() run while the unit is
+	 * suspended, so set up their batches and workers now.
+	 */
+	save_io = stripe_io_new(map_src->num_members, chunk,
+				map_src->raid_level, source_layout, 0,
+				buf_size / old_data_stripe_length);
+	dest_chunk = __le16_to_cpu(map_dest->blocks_per_strip) * 512;
+	backup_io = stripe_io_new(map_dest->num_members, dest_chunk,
+				  map_dest->raid_level,
+				  imsm_level_to_layout(map_dest->raid_level), 0,
+				  buf_size / (ndata * dest_chunk) + 1);
+
 	while (current_migr_unit(migr_rec) <
 	       get_num_migr_units(migr_rec)) {
 		/* current reshape position [blocks] */
@@ -12145,7 +12162,7 @@ static int imsm_manage_reshape(
 					 source_layout, 0, NULL, start_src,
 					 copy_length +
 					 next_step_filler + start_buf_shift,
-					 buf)) {
+					 buf, save_io)) {
 				dprintf("imsm: Cannot save stripes to buffer\n");
 				goto abort;
 			}
@@ -12153,7 +12170,8 @@ static int imsm_manage_reshape(
 			 * in backup general migration area
 			 */
 			if (save_backup_imsm(st, dev, sra,
-				buf + start_buf_shift, copy_length)) {
+				buf + start_buf_shift, copy_length,
+				backup_io)) {
 				dprintf("imsm: Cannot save stripes to target devices\n");
 				goto abort;
 			}
@@ -12218,6 +12236,8 @@ static int imsm_manage_reshape(
 	/* return '1' if done */
 	ret_val = 1;
 abort:
+	stripe_io_free(save_io);
+	stripe_io_free(backup_io);
 	free(buf);
 	/* See Grow.c: abort_reshape() for further explanation */
 	sysfs_set_num(sra, NULL, "suspend_lo", 0x7FFFFFFFFFFFFFFFULL);
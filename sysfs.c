@@ -42,9 +42,8 @@ struct dev_sysfs_rule {
 	} *entry;
 };
 
-int load_sys(char *path, char *buf, int len)
+static int load_sys_fd(int fd, char *buf, int len)
 {
-	int fd = open(path, O_RDONLY);
 	int n;
 	if (fd < 0)
 		return -1;
@@ -58,16 +57,290 @@ int load_sys(char *path, char *buf, int len)
 	return 0;
 }
 
+int load_sys(char *path, char *buf, int len)
+{
+	return load_sys_fd(open(path, O_RDONLY), buf, len);
+}
+
+/*
+ * Commands which look at the same arrays over and over (--monitor,
+ * --wait, reshape progress) keep the md directory of each array and its
+ * dev-* directories open, and use openat() instead of looking up the
+ * whole path each time.  Attributes are opened, read and closed again:
+ * those worth polling are held open by the caller, such as --monitor's
+ * watched attributes, and any fixed set kept here would be evicted by
+ * the next array's reads.  The cache holds SYSFS_CACHE_FDS fds, or as
+ * many as sysfs_cache_size() asked for to cover every array.
+ * mdmon keeps its own fds open and has two threads, so only mdadm
+ * enables this.
+ *
+ * When an array is stopped or a device removed, lookups in the old
+ * directory fail with ENOENT even if a new one of the same name has
+ * appeared, so on ENOENT we compare the inode of the path with the one
+ * we hold and start again if they differ.
+ */
+#define SYSFS_CACHE_FDS	256	/* default for fds held by the whole cache */
+
+struct sysfs_handle {
+	struct sysfs_handle *next;	/* most recently used first */
+	char devnm[32];
+	int dirfd;			/* /sys/block/DEVNM/md */
+	ino_t ino;
+	struct sysfs_dir {
+		struct sysfs_dir *next;
+		char name[32];		/* dev-XXX */
+		int fd;
+		ino_t ino;
+	} *devs;
+	int nfds;
+};
+
+static struct sysfs_handle *sysfs_handles;
+static int sysfs_cache_fds = -1;	/* -1 when disabled */
+static int sysfs_cache_max = SYSFS_CACHE_FDS;
+
+void sysfs_cache_enable(void)
+{
+	if (sysfs_cache_fds < 0)
+		sysfs_cache_fds = 0;
+}
+
+/* Allow for 'fds' directories, one per array and one per member */
+void sysfs_cache_size(int fds)
+{
+	sysfs_cache_max = fds > SYSFS_CACHE_FDS ? fds : SYSFS_CACHE_FDS;
+}
+
+static void sysfs_handle_drop(struct sysfs_handle *h)
+{
+	struct sysfs_handle **hp;
+
+	for (hp = &sysfs_handles; *hp; hp = &(*hp)->next)
+		if (*hp == h) {
+			*hp = h->next;
+			break;
+		}
+	close(h->dirfd);
+	while (h->devs) {
+		struct sysfs_dir *d = h->devs;
+
+		h->devs = d->next;
+		close(d->fd);
+		free(d);
+	}
+	sysfs_cache_fds -= h->nfds;
+	free(h);
+}
+
+static void sysfs_cache_trim(void)
+{
+	/* Forget the least recently used arrays, but never the current one */
+	while (sysfs_cache_fds > sysfs_cache_max &&
+	       sysfs_handles && sysfs_handles->next) {
+		struct sysfs_handle *h = sysfs_handles;
+
+		while (h->next)
+			h = h->next;
+		sysfs_handle_drop(h);
+	}
+}
+
+static void sysfs_cache_add(struct sysfs_handle *h)
+{
+	h->nfds++;
+	sysfs_cache_fds++;
+	sysfs_cache_trim();
+}
+
+static struct sysfs_handle *sysfs_handle_get(char *devnm)
+{
+	struct sysfs_handle *h, **hp;
+	char fname[MAX_SYSFS_PATH_LEN];
+	struct stat stb;
+	int fd;
+
+	if (sysfs_cache_fds < 0 || !devnm ||
+	    strlen(devnm) >= sizeof(h->devnm))
+		return NULL;
+	for (hp = &sysfs_handles; (h = *hp) != NULL; hp = &h->next)
+		if (strcmp(h->devnm, devnm) == 0) {
+			*hp = h->next;
+			h->next = sysfs_handles;
+			sysfs_handles = h;
+			return h;
+		}
+
+	snprintf(fname, MAX_SYSFS_PATH_LEN, "/sys/block/%s/md", devnm);
+	fd = open(fname, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &stb) < 0) {
+		close(fd);
+		return NULL;
+	}
+	h = xcalloc(1, sizeof(*h));
+	strcpy(h->devnm, devnm);
+	h->dirfd = fd;
+	h->ino = stb.st_ino;
+	h->next = sysfs_handles;
+	sysfs_handles = h;
+	sysfs_cache_add(h);
+	return h;
+}
+
+/* Is the directory we hold still the one at this path? */
+static int sysfs_dir_current(char *devnm, char *dev, ino_t ino)
+{
+	char fname[MAX_SYSFS_PATH_LEN];
+	struct stat stb;
+
+	snprintf(fname, MAX_SYSFS_PATH_LEN, "/sys/block/%s/md/%s",
+		 devnm, dev ? dev : "");
+	return stat(fname, &stb) == 0 && stb.st_ino == ino;
+}
+
+/*
+ * Open 'rel', an attribute or dev-XXX/attribute, below the array's md
+ * directory.  Fails with ESTALE if a directory we hold has gone, and
+ * the caller should drop the handle and use the path instead.
+ */
+static int sysfs_handle_open(struct sysfs_handle *h, char *rel, int flags)
+{
+	struct sysfs_dir *d = NULL;
+	char *name = rel;
+	char *sl = strchr(rel, '/');
+	int dirfd = h->dirfd;
+	int fd;
+
+	if (sl && strncmp(rel, "dev-", 4) == 0 &&
+	    sl - rel < (int)sizeof(d->name)) {
+		int len = sl - rel;
+
+		for (d = h->devs; d; d = d->next)
+			if (strncmp(d->name, rel, len) == 0 &&
+			    d->name[len] == 0)
+				break;
+		if (!d && sysfs_cache_fds < sysfs_cache_max) {
+			char dev[sizeof(d->name)];
+			struct stat stb;
+
+			memcpy(dev, rel, len);
+			dev[len] = 0;
+			fd = openat(h->dirfd, dev, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+			if (fd < 0) {
+				if (errno == ENOENT &&
+				    !sysfs_dir_current(h->devnm, NULL, h->ino))
+					errno = ESTALE;
+				return -1;
+			}
+			if (fstat(fd, &stb) < 0) {
+				close(fd);
+				return -1;
+			}
+			d = xmalloc(sizeof(*d));
+			strcpy(d->name, dev);
+			d->fd = fd;
+			d->ino = stb.st_ino;
+			d->next = h->devs;
+			h->devs = d;
+			sysfs_cache_add(h);
+		}
+		if (d) {
+			dirfd = d->fd;
+			name = sl + 1;
+		}
+	}
+
+	fd = openat(dirfd, name, flags);
+	if (fd >= 0 || errno != ENOENT)
+		return fd;
+	/* Either it doesn't exist, or the directory has been replaced */
+	if (!sysfs_dir_current(h->devnm, NULL, h->ino) ||
+	    (d && !sysfs_dir_current(h->devnm, d->name, d->ino)))
+		errno = ESTALE;
+	else
+		errno = ENOENT;
+	return -1;
+}
+
+/* Open an attribute below /sys/block/DEVNM/md/ */
+static int sysfs_attr_open(char *devnm, char *rel, int flags)
+{
+	struct sysfs_handle *h = sysfs_handle_get(devnm);
+	char fname[MAX_SYSFS_PATH_LEN];
+
+	if (h) {
+		int fd = sysfs_handle_open(h, rel, flags);
+
+		if (fd >= 0 || errno != ESTALE)
+			return fd;
+		sysfs_handle_drop(h);
+	}
+	snprintf(fname, MAX_SYSFS_PATH_LEN, "/sys/block/%s/md/%s", devnm, rel);
+	return open(fname, flags);
+}
+
+/*
+ * Read an attribute below /sys/block/DEVNM/md/.  Returns the number of
+ * bytes read, -1 if the attribute cannot be opened or -2 if it cannot
+ * be read.
+ */
+static int sysfs_attr_read(char *devnm, char *rel, char *buf, int len)
+{
+	int fd = sysfs_attr_open(devnm, rel, O_RDONLY|O_CLOEXEC);
+	int n;
+
+	if (fd < 0)
+		return -1;
+	n = pread(fd, buf, len, 0);
+	close(fd);
+	return n < 0 ? -2 : n;
+}
+
+/* Drop the handle for an array whose directory has been replaced */
+static void sysfs_handle_check(char *devnm, ino_t ino)
+{
+	struct sysfs_handle *h;
+
+	for (h = sysfs_handles; h; h = h->next)
+		if (strcmp(h->devnm, devnm) == 0) {
+			if (h->ino != ino)
+				sysfs_handle_drop(h);
+			return;
+		}
+}
+
+/* Attribute 'name' of the array or of 'dev', relative to the md dir */
+static char *sysfs_rel(char *rel, struct mdinfo *dev, char *name)
+{
+	if (dev)
+		snprintf(rel, MAX_SYSFS_PATH_LEN, "%s/%s", dev->sys_name, name);
+	else
+		snprintf(rel, MAX_SYSFS_PATH_LEN, "%s", name);
+	return rel;
+}
+
+/* load_sys() for an attribute below /sys/block/DEVNM/md/ */
+static int load_md_sys(char *devnm, char *rel, char *buf, int len)
+{
+	return load_sys_fd(sysfs_attr_open(devnm, rel, O_RDONLY), buf, len);
+}
+
+static void sysfs_free_devs(struct mdinfo *sra)
+{
+	while (sra->devs) {
+		struct mdinfo *d = sra->devs;
+		sra->devs = d->next;
+		free(d->bb.entries);
+		free(d);
+	}
+}
+
 void sysfs_free(struct mdinfo *sra)
 {
 	while (sra) {
 		struct mdinfo *sra2 = sra->next;
-		while (sra->devs) {
-			struct mdinfo *d = sra->devs;
-			sra->devs = d->next;
-			free(d->bb.entries);
-			free(d);
-		}
+		sysfs_free_devs(sra);
 		free(sra->bb.entries);
 		free(sra);
 		sra = sra2;
@@ -79,15 +352,15 @@ int sysfs_open(char *devnm, char *devname, char *attr)
 	char fname[MAX_SYSFS_PATH_LEN];
 	int fd;
 
-	snprintf(fname, MAX_SYSFS_PATH_LEN, "/sys/block/%s/md/", devnm);
+	fname[0] = 0;
 	if (devname) {
-		strncat(fname, devname, MAX_SYSFS_PATH_LEN - strlen(fname));
-		strncat(fname, "/", MAX_SYSFS_PATH_LEN - strlen(fname));
+		strncat(fname, devname, MAX_SYSFS_PATH_LEN - 1);
+		strncat(fname, "/", MAX_SYSFS_PATH_LEN - 1 - strlen(fname));
 	}
-	strncat(fname, attr, MAX_SYSFS_PATH_LEN - strlen(fname));
-	fd = open(fname, O_RDWR);
+	strncat(fname, attr, MAX_SYSFS_PATH_LEN - 1 - strlen(fname));
+	fd = sysfs_attr_open(devnm, fname, O_RDWR);
 	if (fd < 0 && errno == EACCES)
-		fd = open(fname, O_RDONLY);
+		fd = sysfs_attr_open(devnm, fname, O_RDONLY);
 	return fd;
 }
 
@@ -116,6 +389,7 @@ int sysfs_init(struct mdinfo *mdi, int fd, char *devnm)
 		goto out;
 	if (!S_ISDIR(stb.st_mode))
 		goto out;
+	sysfs_handle_check(devnm, stb.st_ino);
 	strcpy(mdi->sys_name, devnm);
 
 	retval = 0;
@@ -125,29 +399,211 @@ out:
 
 struct mdinfo *sysfs_read(int fd, char *devnm, unsigned long options)
 {
-	char fname[PATH_MAX];
-	char buf[PATH_MAX];
-	char *base;
-	char *dbase;
 	struct mdinfo *sra;
-	struct mdinfo *dev, **devp;
-	DIR *dir = NULL;
-	struct dirent *de;
 
 	sra = xcalloc(1, sizeof(*sra));
 	if (sysfs_init(sra, fd, devnm)) {
 		free(sra);
 		return NULL;
 	}
+	if (sysfs_load(sra, options)) {
+		sysfs_free(sra);
+		return NULL;
+	}
+	return sra;
+}
+
+/* details which are read for each device */
+#define GET_DEV_DETAILS (GET_OFFSET|GET_SIZE|GET_STATE|GET_ERROR)
+
+static int sysfs_load_devs(struct mdinfo *sra, unsigned long options)
+{
+	char fname[PATH_MAX];
+	char buf[PATH_MAX];
+	char *base;
+	char *dbase;
+	struct mdinfo *dev, **devp;
+	DIR *dir = NULL;
+	struct dirent *de;
+	int dfd;
 
 	sprintf(fname, "/sys/block/%s/md/", sra->sys_name);
 	base = fname + strlen(fname);
 
-	sra->devs = NULL;
+	dfd = sysfs_attr_open(sra->sys_name, ".", O_RDONLY|O_DIRECTORY);
+	if (dfd >= 0 && (dir = fdopendir(dfd)) == NULL)
+		close(dfd);
+	if (!dir)
+		return -1;
+	sra->array.nr_disks = 0;
+
+	devp = &sra->devs;
+	while ((de = readdir(dir)) != NULL) {
+		char *ep;
+		if (de->d_ino == 0 ||
+		    strncmp(de->d_name, "dev-", 4) != 0)
+			continue;
+		strcpy(base, de->d_name);
+		dbase = base + strlen(base);
+		*dbase++ = '/';
+
+		dev = xcalloc(1, sizeof(*dev));
+
+		/* Always get slot, major, minor */
+		strcpy(dbase, "slot");
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf))) {
+			/* hmm... unable to read 'slot' maybe the device
+			 * is going away?
+			 */
+			strcpy(dbase, "block");
+			if (readlink(fname, buf, sizeof(buf)) < 0 &&
+			    errno != ENAMETOOLONG) {
+				/* ...yup device is gone */
+				free(dev);
+				continue;
+			} else {
+				/* slot is unreadable but 'block' link
+				 * still intact... something bad is happening
+				 * so abort
+				 */
+				free(dev);
+				closedir(dir);
+				return -1;
+			}
+
+		}
+		strcpy(dev->sys_name, de->d_name);
+		dev->disk.raid_disk = strtoul(buf, &ep, 10);
+		if (*ep) dev->disk.raid_disk = -1;
+
+		sra->array.nr_disks++;
+		strcpy(dbase, "block/dev");
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf))) {
+			/* assume this is a stale reference to a hot
+			 * removed device
+			 */
+			if (!(options & GET_DEVS_ALL)) {
+				free(dev);
+				continue;
+			}
+		} else {
+			sscanf(buf, "%d:%d", &dev->disk.major, &dev->disk.minor);
+		}
+
+		if (!(options & GET_DEVS_ALL)) {
+			/* special case check for block devices that can go 'offline' */
+			strcpy(dbase, "block/device/state");
+			if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)) == 0 &&
+			    strncmp(buf, "offline", 7) == 0) {
+				free(dev);
+				continue;
+			}
+		}
+
+		/* finally add this disk to the array */
+		*devp = dev;
+		devp = & dev->next;
+		dev->next = NULL;
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int sysfs_load_dev_details(struct mdinfo *sra, unsigned long options)
+{
+	char rel[MAX_SYSFS_PATH_LEN];
+	char buf[PATH_MAX];
+	struct mdinfo *dev;
+
+	if (options & GET_STATE) {
+		sra->array.spare_disks = 0;
+		sra->array.active_disks = 0;
+		sra->array.failed_disks = 0;
+		sra->array.working_disks = 0;
+	}
+
+	for (dev = sra->devs; dev; dev = dev->next) {
+		if (options & GET_OFFSET) {
+			if (load_md_sys(sra->sys_name,
+					sysfs_rel(rel, dev, "offset"),
+					buf, sizeof(buf)))
+				return -1;
+			dev->data_offset = strtoull(buf, NULL, 0);
+			if (load_md_sys(sra->sys_name,
+					sysfs_rel(rel, dev, "new_offset"),
+					buf, sizeof(buf)) == 0)
+				dev->new_data_offset = strtoull(buf, NULL, 0);
+			else
+				dev->new_data_offset = dev->data_offset;
+		}
+		if (options & GET_SIZE) {
+			if (load_md_sys(sra->sys_name,
+					sysfs_rel(rel, dev, "size"),
+					buf, sizeof(buf)))
+				return -1;
+			dev->component_size = strtoull(buf, NULL, 0) * 2;
+		}
+		if (options & GET_STATE) {
+			dev->disk.state = 0;
+			if (load_md_sys(sra->sys_name,
+					sysfs_rel(rel, dev, "state"),
+					buf, sizeof(buf)))
+				return -1;
+			if (strstr(buf, "faulty"))
+				dev->disk.state |= (1<<MD_DISK_FAULTY);
+			else {
+				sra->array.working_disks++;
+				if (strstr(buf, "in_sync")) {
+					dev->disk.state |= (1<<MD_DISK_SYNC);
+					sra->array.active_disks++;
+				}
+				if (dev->disk.state == 0)
+					sra->array.spare_disks++;
+			}
+		}
+		if (options & GET_ERROR) {
+			if (load_md_sys(sra->sys_name,
+					sysfs_rel(rel, dev, "errors"),
+					buf, sizeof(buf)))
+				return -1;
+			dev->errors = strtoul(buf, NULL, 0);
+		}
+	}
+
+	if ((options & GET_STATE) && sra->array.raid_disks)
+		sra->array.failed_disks = sra->array.raid_disks -
+			sra->array.active_disks - sra->array.spare_disks;
+	return 0;
+}
+
+/*
+ * Read the details in 'options' which haven't already been read into
+ * 'sra', so a caller can start with sysfs_read(fd, devnm, 0) and ask
+ * for each detail when it finds it needs it.  Per-device details are
+ * only read once the device list has been.
+ * Returns 0, or -1 if something could not be read.
+ */
+int sysfs_load(struct mdinfo *sra, unsigned long options)
+{
+	char buf[PATH_MAX];
+	char base[MAX_SYSFS_PATH_LEN];
+
+	if ((options & GET_DEVS_ALL) && (sra->loaded & GET_DEVS) &&
+	    !(sra->loaded & GET_DEVS_ALL)) {
+		/* need the devices which were skipped last time */
+		sysfs_free_devs(sra);
+		sra->loaded &= ~(GET_DEVS | GET_DEV_DETAILS);
+	}
+	if (!(options & GET_DEVS))
+		options &= ~GET_DEVS_ALL;
+	options &= ~sra->loaded;
+	if (!options)
+		return 0;
+
 	if (options & GET_VERSION) {
 		strcpy(base, "metadata_version");
-		if (load_sys(fname, buf, sizeof(buf)))
-			goto abort;
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
+			return -1;
 		if (strncmp(buf, "none", 4) == 0) {
 			sra->array.major_version =
 				sra->array.minor_version = -1;
@@ -165,39 +621,39 @@ struct mdinfo *sysfs_read(int fd, char *devnm, unsigned long options)
 	}
 	if (options & GET_LEVEL) {
 		strcpy(base, "level");
-		if (load_sys(fname, buf, sizeof(buf)))
-			goto abort;
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
+			return -1;
 		sra->array.level = map_name(pers, buf);
 	}
 	if (options & GET_LAYOUT) {
 		strcpy(base, "layout");
-		if (load_sys(fname, buf, sizeof(buf)))
-			goto abort;
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
+			return -1;
 		sra->array.layout = strtoul(buf, NULL, 0);
 	}
 	if (options & (GET_DISKS|GET_STATE)) {
 		strcpy(base, "raid_disks");
-		if (load_sys(fname, buf, sizeof(buf)))
-			goto abort;
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
+			return -1;
 		sra->array.raid_disks = strtoul(buf, NULL, 0);
 	}
 	if (options & GET_COMPONENT) {
 		strcpy(base, "component_size");
-		if (load_sys(fname, buf, sizeof(buf)))
-			goto abort;
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
+			return -1;
 		sra->component_size = strtoull(buf, NULL, 0);
 		/* sysfs reports "K", but we want sectors */
 		sra->component_size *= 2;
 	}
 	if (options & GET_CHUNK) {
 		strcpy(base, "chunk_size");
-		if (load_sys(fname, buf, sizeof(buf)))
-			goto abort;
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
+			return -1;
 		sra->array.chunk_size = strtoul(buf, NULL, 0);
 	}
 	if (options & GET_CACHE) {
 		strcpy(base, "stripe_cache_size");
-		if (load_sys(fname, buf, sizeof(buf)))
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
 			/* Probably level doesn't support it */
 			sra->cache_size = 0;
 		else
@@ -205,8 +661,8 @@ struct mdinfo *sysfs_read(int fd, char *devnm, unsigned long options)
 	}
 	if (options & GET_MISMATCH) {
 		strcpy(base, "mismatch_cnt");
-		if (load_sys(fname, buf, sizeof(buf)))
-			goto abort;
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
+			return -1;
 		sra->mismatch_cnt = strtoul(buf, NULL, 0);
 	}
 	if (options & GET_SAFEMODE) {
@@ -217,8 +673,8 @@ struct mdinfo *sysfs_read(int fd, char *devnm, unsigned long options)
 		size_t len;
 
 		strcpy(base, "safe_mode_delay");
-		if (load_sys(fname, buf, sizeof(buf)))
-			goto abort;
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
+			return -1;
 
 		/* remove a period, and count digits after it */
 		len = strlen(buf);
@@ -240,8 +696,8 @@ struct mdinfo *sysfs_read(int fd, char *devnm, unsigned long options)
 	}
 	if (options & GET_BITMAP_LOCATION) {
 		strcpy(base, "bitmap/location");
-		if (load_sys(fname, buf, sizeof(buf)))
-			goto abort;
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
+			return -1;
 		if (strncmp(buf, "file", 4) == 0)
 			sra->bitmap_offset = 1;
 		else if (strncmp(buf, "none", 4) == 0)
@@ -249,160 +705,35 @@ struct mdinfo *sysfs_read(int fd, char *devnm, unsigned long options)
 		else if (buf[0] == '+')
 			sra->bitmap_offset = strtol(buf+1, NULL, 10);
 		else
-			goto abort;
+			return -1;
 	}
 
 	if (options & GET_ARRAY_STATE) {
 		strcpy(base, "array_state");
-		if (load_sys(fname, buf, sizeof(buf)))
-			goto abort;
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
+			return -1;
 		sra->array_state = map_name(sysfs_array_states, buf);
 	}
 
 	if (options & GET_CONSISTENCY_POLICY) {
 		strcpy(base, "consistency_policy");
-		if (load_sys(fname, buf, sizeof(buf)))
+		if (load_md_sys(sra->sys_name, base, buf, sizeof(buf)))
 			sra->consistency_policy = CONSISTENCY_POLICY_UNKNOWN;
 		else
 			sra->consistency_policy = map_name(consistency_policies,
 							   buf);
 	}
 
-	if (! (options & GET_DEVS))
-		return sra;
-
-	/* Get all the devices as well */
-	*base = 0;
-	dir = opendir(fname);
-	if (!dir)
-		goto abort;
-	sra->array.spare_disks = 0;
-	sra->array.active_disks = 0;
-	sra->array.failed_disks = 0;
-	sra->array.working_disks = 0;
-
-	devp = &sra->devs;
-	sra->devs = NULL;
-	while ((de = readdir(dir)) != NULL) {
-		char *ep;
-		if (de->d_ino == 0 ||
-		    strncmp(de->d_name, "dev-", 4) != 0)
-			continue;
-		strcpy(base, de->d_name);
-		dbase = base + strlen(base);
-		*dbase++ = '/';
-
-		dev = xcalloc(1, sizeof(*dev));
-
-		/* Always get slot, major, minor */
-		strcpy(dbase, "slot");
-		if (load_sys(fname, buf, sizeof(buf))) {
-			/* hmm... unable to read 'slot' maybe the device
-			 * is going away?
-			 */
-			strcpy(dbase, "block");
-			if (readlink(fname, buf, sizeof(buf)) < 0 &&
-			    errno != ENAMETOOLONG) {
-				/* ...yup device is gone */
-				free(dev);
-				continue;
-			} else {
-				/* slot is unreadable but 'block' link
-				 * still intact... something bad is happening
-				 * so abort
-				 */
-				free(dev);
-				goto abort;
-			}
-
-		}
-		strcpy(dev->sys_name, de->d_name);
-		dev->disk.raid_disk = strtoul(buf, &ep, 10);
-		if (*ep) dev->disk.raid_disk = -1;
-
-		sra->array.nr_disks++;
-		strcpy(dbase, "block/dev");
-		if (load_sys(fname, buf, sizeof(buf))) {
-			/* assume this is a stale reference to a hot
-			 * removed device
-			 */
-			if (!(options & GET_DEVS_ALL)) {
-				free(dev);
-				continue;
-			}
-		} else {
-			sscanf(buf, "%d:%d", &dev->disk.major, &dev->disk.minor);
-		}
-
-		if (!(options & GET_DEVS_ALL)) {
-			/* special case check for block devices that can go 'offline' */
-			strcpy(dbase, "block/device/state");
-			if (load_sys(fname, buf, sizeof(buf)) == 0 &&
-			    strncmp(buf, "offline", 7) == 0) {
-				free(dev);
-				continue;
-			}
-		}
-
-		/* finally add this disk to the array */
-		*devp = dev;
-		devp = & dev->next;
-		dev->next = NULL;
-
-		if (options & GET_OFFSET) {
-			strcpy(dbase, "offset");
-			if (load_sys(fname, buf, sizeof(buf)))
-				goto abort;
-			dev->data_offset = strtoull(buf, NULL, 0);
-			strcpy(dbase, "new_offset");
-			if (load_sys(fname, buf, sizeof(buf)) == 0)
-				dev->new_data_offset = strtoull(buf, NULL, 0);
-			else
-				dev->new_data_offset = dev->data_offset;
-		}
-		if (options & GET_SIZE) {
-			strcpy(dbase, "size");
-			if (load_sys(fname, buf, sizeof(buf)))
-				goto abort;
-			dev->component_size = strtoull(buf, NULL, 0) * 2;
-		}
-		if (options & GET_STATE) {
-			dev->disk.state = 0;
-			strcpy(dbase, "state");
-			if (load_sys(fname, buf, sizeof(buf)))
-				goto abort;
-			if (strstr(buf, "faulty"))
-				dev->disk.state |= (1<<MD_DISK_FAULTY);
-			else {
-				sra->array.working_disks++;
-				if (strstr(buf, "in_sync")) {
-					dev->disk.state |= (1<<MD_DISK_SYNC);
-					sra->array.active_disks++;
-				}
-				if (dev->disk.state == 0)
-					sra->array.spare_disks++;
-			}
-		}
-		if (options & GET_ERROR) {
-			strcpy(buf, "errors");
-			if (load_sys(fname, buf, sizeof(buf)))
-				goto abort;
-			dev->errors = strtoul(buf, NULL, 0);
-		}
-	}
-
-	if ((options & GET_STATE) && sra->array.raid_disks)
-		sra->array.failed_disks = sra->array.raid_disks -
-			sra->array.active_disks - sra->array.spare_disks;
-
-	closedir(dir);
-	return sra;
-
- abort:
-	if (dir)
-		closedir(dir);
-	sysfs_free(sra);
-	return NULL;
+	if ((options & GET_DEVS) && sysfs_load_devs(sra, options))
+		return -1;
+	if (!((sra->loaded | options) & GET_DEVS))
+		/* leave these until there are devices */
+		options &= ~GET_DEV_DETAILS;
+	else if ((options & GET_DEV_DETAILS) &&
+		 sysfs_load_dev_details(sra, options & GET_DEV_DETAILS))
+		return -1;
+	sra->loaded |= options;
+	return 0;
 }
 
 int sysfs_attr_match(const char *attr, const char *str)
@@ -460,20 +791,19 @@ unsigned long long get_component_size(int fd)
 int sysfs_set_str(struct mdinfo *sra, struct mdinfo *dev,
 		  char *name, char *val)
 {
-	char fname[MAX_SYSFS_PATH_LEN];
+	char rel[MAX_SYSFS_PATH_LEN];
 	unsigned int n;
 	int fd;
 
-	snprintf(fname, MAX_SYSFS_PATH_LEN, "/sys/block/%s/md/%s/%s",
-		sra->sys_name, dev?dev->sys_name:"", name);
-	fd = open(fname, O_WRONLY);
+	fd = sysfs_attr_open(sra->sys_name, sysfs_rel(rel, dev, name),
+			     O_WRONLY);
 	if (fd < 0)
 		return -1;
 	n = write(fd, val, strlen(val));
 	close(fd);
 	if (n != strlen(val)) {
-		dprintf("failed to write '%s' to '%s' (%s)\n",
-			val, fname, strerror(errno));
+		dprintf("failed to write '%s' to '%s/%s' (%s)\n",
+			val, sra->sys_name, rel, strerror(errno));
 		return -1;
 	}
 	return 0;
@@ -518,38 +848,35 @@ int sysfs_uevent(struct mdinfo *sra, char *event)
 
 int sysfs_attribute_available(struct mdinfo *sra, struct mdinfo *dev, char *name)
 {
-	char fname[MAX_SYSFS_PATH_LEN];
-	struct stat st;
-
-	snprintf(fname, MAX_SYSFS_PATH_LEN, "/sys/block/%s/md/%s/%s",
-		sra->sys_name, dev?dev->sys_name:"", name);
+	char rel[MAX_SYSFS_PATH_LEN];
+	int fd;
 
-	return stat(fname, &st) == 0;
+	fd = sysfs_attr_open(sra->sys_name, sysfs_rel(rel, dev, name),
+			     O_PATH);
+	if (fd < 0)
+		return 0;
+	close(fd);
+	return 1;
 }
 
 int sysfs_get_fd(struct mdinfo *sra, struct mdinfo *dev,
 		       char *name)
 {
-	char fname[MAX_SYSFS_PATH_LEN];
+	char rel[MAX_SYSFS_PATH_LEN];
 	int fd;
 
-	snprintf(fname, MAX_SYSFS_PATH_LEN, "/sys/block/%s/md/%s/%s",
-		sra->sys_name, dev?dev->sys_name:"", name);
-	fd = open(fname, O_RDWR);
+	sysfs_rel(rel, dev, name);
+	fd = sysfs_attr_open(sra->sys_name, rel, O_RDWR);
 	if (fd < 0)
-		fd = open(fname, O_RDONLY);
+		fd = sysfs_attr_open(sra->sys_name, rel, O_RDONLY);
 	return fd;
 }
 
-int sysfs_fd_get_ll(int fd, unsigned long long *val)
+static int sysfs_parse_ll(char *buf, int n, int size, unsigned long long *val)
 {
-	char buf[50];
-	int n;
 	char *ep;
 
-	lseek(fd, 0, 0);
-	n = read(fd, buf, sizeof(buf));
-	if (n <= 0 || n == sizeof(buf))
+	if (n <= 0 || n == size)
 		return -2;
 	buf[n] = 0;
 	*val = strtoull(buf, &ep, 0);
@@ -558,34 +885,39 @@ int sysfs_fd_get_ll(int fd, unsigned long long *val)
 	return 0;
 }
 
+int sysfs_fd_get_ll(int fd, unsigned long long *val)
+{
+	char buf[50];
+
+	return sysfs_parse_ll(buf, pread(fd, buf, sizeof(buf), 0),
+			      sizeof(buf), val);
+}
+
 int sysfs_get_ll(struct mdinfo *sra, struct mdinfo *dev,
 		       char *name, unsigned long long *val)
 {
+	char rel[MAX_SYSFS_PATH_LEN];
+	char buf[50];
 	int n;
-	int fd;
 
-	fd = sysfs_get_fd(sra, dev, name);
-	if (fd < 0)
+	n = sysfs_attr_read(sra->sys_name, sysfs_rel(rel, dev, name),
+			    buf, sizeof(buf));
+	if (n == -1)
 		return -1;
-	n = sysfs_fd_get_ll(fd, val);
-	close(fd);
-	return n;
+	return sysfs_parse_ll(buf, n, sizeof(buf), val);
 }
 
-int sysfs_fd_get_two(int fd, unsigned long long *v1, unsigned long long *v2)
+static int sysfs_parse_two(char *buf, int n, int size,
+			   unsigned long long *v1, unsigned long long *v2)
 {
 	/* two numbers in this sysfs file, either
 	 *  NNN (NNN)
 	 * or
 	 *  NNN / NNN
 	 */
-	char buf[80];
-	int n;
 	char *ep, *ep2;
 
-	lseek(fd, 0, 0);
-	n = read(fd, buf, sizeof(buf));
-	if (n <= 0 || n == sizeof(buf))
+	if (n <= 0 || n == size)
 		return -2;
 	buf[n] = 0;
 	*v1 = strtoull(buf, &ep, 0);
@@ -601,26 +933,33 @@ int sysfs_fd_get_two(int fd, unsigned long long *v1, unsigned long long *v2)
 	return 2;
 }
 
+int sysfs_fd_get_two(int fd, unsigned long long *v1, unsigned long long *v2)
+{
+	char buf[80];
+
+	return sysfs_parse_two(buf, pread(fd, buf, sizeof(buf), 0),
+			       sizeof(buf), v1, v2);
+}
+
 int sysfs_get_two(struct mdinfo *sra, struct mdinfo *dev,
 		  char *name, unsigned long long *v1, unsigned long long *v2)
 {
+	char rel[MAX_SYSFS_PATH_LEN];
+	char buf[80];
 	int n;
-	int fd;
 
-	fd = sysfs_get_fd(sra, dev, name);
-	if (fd < 0)
+	n = sysfs_attr_read(sra->sys_name, sysfs_rel(rel, dev, name),
+			    buf, sizeof(buf));
+	if (n == -1)
 		return -1;
-	n = sysfs_fd_get_two(fd, v1, v2);
-	close(fd);
-	return n;
+	return sysfs_parse_two(buf, n, sizeof(buf), v1, v2);
 }
 
 int sysfs_fd_get_str(int fd, char *val, int size)
 {
 	int n;
 
-	lseek(fd, 0, 0);
-	n = read(fd, val, size);
+	n = pread(fd, val, size, 0);
 	if (n <= 0 || n == size)
 		return -1;
 	val[n] = 0;
@@ -630,14 +969,14 @@ int sysfs_fd_get_str(int fd, char *val, int size)
 int sysfs_get_str(struct mdinfo *sra, struct mdinfo *dev,
 		       char *name, char *val, int size)
 {
+	char rel[MAX_SYSFS_PATH_LEN];
 	int n;
-	int fd;
 
-	fd = sysfs_get_fd(sra, dev, name);
-	if (fd < 0)
+	n = sysfs_attr_read(sra->sys_name, sysfs_rel(rel, dev, name),
+			    val, size);
+	if (n <= 0 || n == size)
 		return -1;
-	n = sysfs_fd_get_str(fd, val, size);
-	close(fd);
+	val[n] = 0;
 	return n;
 }
 